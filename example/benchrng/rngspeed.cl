@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+//      -- OpenCL edition
+//  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+//
+//  rngspeed.cl: random number generator benchmark kernels
+//
+//  This file is appended to ../../src/mcx_core.cl, so the generators under
+//  test are exactly those used by mcx_main_loop; compile with or without
+//  -D USE_XORSHIFT128P_RAND to select the Logistic-lattice or the
+//  xorshift128+ generator.
+//
+//  Unpublished work, see LICENSE.txt for details
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// all draws stay in registers, only the sum is written to prevent the
+// compiler from optimizing the generator away
+
+__kernel void bench_rng_reg(__global uint n_seed[],__global float output[],const int loop){
+     int idx=get_global_id(0);
+     int i;
+     float c=0.f;
+     RandType t[RAND_BUF_LEN];
+
+     gpu_rng_init(t,n_seed,idx);
+     for(i=0;i<loop;i++)
+          c+=rand_uniform01(t);
+     output[idx]=c;
+}
+
+// every draw is written to the global memory, the i-th draw of all threads
+// are stored contiguously so that the writes are coalesced
+
+__kernel void bench_rng_global(__global uint n_seed[],__global float output[],const int loop){
+     int idx=get_global_id(0);
+     int len=get_global_size(0);
+     int i;
+     RandType t[RAND_BUF_LEN];
+
+     gpu_rng_init(t,n_seed,idx);
+     for(i=0;i<loop;i++)
+          output[i*len+idx]=rand_uniform01(t);
+}
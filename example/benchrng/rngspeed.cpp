@@ -0,0 +1,401 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  Reference (Fang2009):
+**        Qianqian Fang and David A. Boas, "Monte Carlo Simulation of Photon
+**        Migration in 3D Turbid Media Accelerated by Graphics Processing
+**        Units," Optics Express, vol. 17, issue 22, pp. 20178-20190 (2009)
+**
+**  rngspeed.cpp: throughput and quality benchmark of the random number
+**                generators in mcx_core.cl
+**
+**  Both generators (Logistic-lattice and xorshift128+) are timed on the
+**  selected OpenCL device by appending rngspeed.cl to mcx_core.cl, and on
+**  one CPU core by compiling the same sources through mcx_clshim.hpp. Each
+**  generator runs with two access patterns: register-only, and a global
+**  write of every draw. The written draws are then tested for the moments
+**  of U(0,1), a 64-bin chi-square, the serial correlation of each stream
+**  (as in utils/serialcorr.m) and the correlation between adjacent streams.
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <chrono>
+#include <vector>
+
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include "mcx_clshim.hpp"
+
+namespace logistic{
+#include "mcx_core.cl"
+#include "rngspeed.cl"
+}
+
+#undef RAND_BUF_LEN
+#undef RAND_SEED_LEN
+#define USE_XORSHIFT128P_RAND
+
+namespace xorshift{
+#include "mcx_core.cl"
+#include "rngspeed.cl"
+}
+
+#define SEED_LEN      5          /*seeds per thread, the larger of the two RNGs*/
+#define MAX_SHIFT     64
+#define CHI2_BINS     64
+#define Z_LIMIT       5.0        /*a statistic fails when it is this many standard errors off*/
+
+#define OCL_CHECK(x)  ocl_check((x),__FILE__,__LINE__)
+
+typedef struct RNGBenchOpt{
+	int nthread,nblock,loop,repeat,devid,maxshift,cpuonly,seed;
+	const char *kernelfile, *benchfile, *dumpfile;
+} RNGBenchOpt;
+
+typedef struct RNGStats{
+	double mean,var,skew,kurt,chi2,crossr;
+	double serialr[MAX_SHIFT];
+	float  minval,maxval;
+	int    failed;
+} RNGStats;
+
+typedef void (*BenchKernel)(__global uint *,__global float *,const int);
+
+static const char *rngname[]={"Logistic-lattice","xorshift128+"};
+static const char *patname[]={"register","global-write"};
+static int nfailed=0;
+
+static double now_ms(){
+     return std::chrono::duration<double,std::milli>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void ocl_check(cl_int status,const char *file,const int linenum){
+     if(status!=CL_SUCCESS){
+         fprintf(stderr,"OpenCL error %d in %s:%d\n",status,file,linenum);
+         exit(status);
+     }
+}
+
+static char *loadfile(const char *fname,size_t *len){
+     FILE *fp=fopen(fname,"rb");
+     char *buf;
+     if(fp==NULL){
+         fprintf(stderr,"can not open %s, use -k to specify the path to mcx_core.cl\n",fname);
+         exit(1);
+     }
+     fseek(fp,0,SEEK_END);
+     *len=ftell(fp);
+     rewind(fp);
+     buf=(char*)malloc(*len+1);
+     if(fread(buf,1,*len,fp)!=*len){
+         fprintf(stderr,"can not read %s\n",fname);
+         exit(1);
+     }
+     buf[*len]='\0';
+     fclose(fp);
+     return buf;
+}
+
+static void report_speed(const char *rng,const char *dev,int pattern,double draws,double ms){
+     printf("%-18s %-28.28s %-13s %12.0f ms %12.4e draws/s\n",rng,dev,patname[pattern],ms,draws/ms*1000.0);
+}
+
+/*
+   statistics of the draws of nthread streams, draw i of stream idx is at
+   x[i*nthread+idx]; all tests use the U(0,1) asymptotic standard errors
+*/
+
+static void rng_stats(const float *x,int nthread,int loop,int maxshift,RNGStats *s){
+     size_t n=(size_t)nthread*loop, i;
+     double m2=0.0,m3=0.0,m4=0.0,d,se;
+     std::vector<double> hist(CHI2_BINS,0.0);
+     int k,idx,bin;
+
+     memset(s,0,sizeof(RNGStats));
+     s->minval=s->maxval=x[0];
+     for(i=0;i<n;i++){
+         s->mean+=x[i];
+         if(x[i]<s->minval) s->minval=x[i];
+         if(x[i]>s->maxval) s->maxval=x[i];
+         bin=(int)(x[i]*CHI2_BINS);
+         hist[bin<0 ? 0 : (bin>=CHI2_BINS ? CHI2_BINS-1 : bin)]++;
+     }
+     s->mean/=n;
+     for(i=0;i<n;i++){
+         d=x[i]-s->mean;
+         m2+=d*d; m3+=d*d*d; m4+=d*d*d*d;
+     }
+     m2/=n; m3/=n; m4/=n;
+     s->var=m2;
+     s->skew=m3/pow(m2,1.5);
+     s->kurt=m4/(m2*m2)-3.0;
+     for(k=0;k<CHI2_BINS;k++)
+         s->chi2+=(hist[k]-(double)n/CHI2_BINS)*(hist[k]-(double)n/CHI2_BINS)/((double)n/CHI2_BINS);
+
+     /*lag-k correlation within each stream, pooled over the streams*/
+     for(k=1;k<=maxshift && k<loop;k++){
+         double c=0.0;
+         for(i=0;i<(size_t)(loop-k);i++){
+             const float *a=x+i*nthread, *b=x+(i+k)*nthread;
+             for(idx=0;idx<nthread;idx++)
+                 c+=(a[idx]-s->mean)*(b[idx]-s->mean);
+         }
+         s->serialr[k-1]=c/((double)nthread*(loop-k)*m2);
+     }
+     /*correlation between the streams of adjacent threads*/
+     if(nthread>1){
+         double c=0.0;
+         for(i=0;i<(size_t)loop;i++){
+             const float *a=x+i*nthread;
+             for(idx=0;idx<nthread-1;idx++)
+                 c+=(a[idx]-s->mean)*(a[idx+1]-s->mean);
+         }
+         s->crossr=c/((double)(nthread-1)*loop*m2);
+     }
+
+     se=sqrt(1.0/12.0/n);
+     s->failed+=(s->minval<0.f || s->maxval>1.f);
+     s->failed+=(fabs(s->mean-0.5)>Z_LIMIT*se);
+     s->failed+=(fabs(s->var-1.0/12.0)>Z_LIMIT*sqrt(1.0/180.0/n));
+     s->failed+=(fabs(s->skew)>Z_LIMIT*sqrt(6.0/n));
+     s->failed+=(fabs(s->kurt+1.2)>Z_LIMIT*sqrt(24.0/n));
+     s->failed+=(s->chi2>(CHI2_BINS-1)+Z_LIMIT*sqrt(2.0*(CHI2_BINS-1)));
+     for(k=1;k<=maxshift && k<loop;k++)
+         s->failed+=(fabs(s->serialr[k-1])>Z_LIMIT/sqrt((double)nthread*(loop-k)));
+     if(nthread>1)
+         s->failed+=(fabs(s->crossr)>Z_LIMIT/sqrt((double)(nthread-1)*loop));
+}
+
+static void report_stats(const char *rng,const char *dev,const float *x,RNGBenchOpt *opt){
+     RNGStats s;
+     int k;
+     double worst=0.0;
+
+     rng_stats(x,opt->nthread,opt->loop,opt->maxshift,&s);
+     for(k=1;k<=opt->maxshift && k<opt->loop;k++)
+         if(fabs(s.serialr[k-1])>fabs(worst)) worst=s.serialr[k-1];
+     printf("%-18s %-28.28s range=[%g %g] mean=%.6f var=%.6f skew=%.2e kurt=%.4f chi2(%d)=%.1f\n",
+         rng,dev,s.minval,s.maxval,s.mean,s.var,s.skew,s.kurt,CHI2_BINS-1,s.chi2);
+     printf("%-18s %-28.28s max|r(lag 1..%d)|=%.2e r(adjacent streams)=%.2e limit=%.2e ... %s\n",
+         "","",opt->maxshift,fabs(worst),s.crossr,Z_LIMIT/sqrt((double)opt->nthread*opt->loop),
+         s.failed ? "FAILED" : "ok");
+     nfailed+=(s.failed>0);
+}
+
+static void dump_draws(const char *fname,const char *rng,const char *dev,const float *x,size_t len){
+     char name[1024];
+     FILE *fp;
+     snprintf(name,sizeof(name),"%s_%s_%s.bin",fname,rng,dev);
+     for(char *p=name;*p;p++)
+         if(*p==' ' || *p=='+' || *p=='/') *p='_';
+     if((fp=fopen(name,"wb"))==NULL) return;
+     fwrite(x,sizeof(float),len,fp);
+     fclose(fp);
+}
+
+/*====================== native CPU, one core ======================*/
+
+static void bench_cpu(RNGBenchOpt *opt,std::vector<cl_uint> &seed){
+     BenchKernel kernel[2][2]={{logistic::bench_rng_reg,logistic::bench_rng_global},
+                               {xorshift::bench_rng_reg,xorshift::bench_rng_global}};
+     std::vector<float> output((size_t)opt->nthread*opt->loop);
+     int rng,pat,r;
+     size_t idx;
+
+     mcx_shim_global_size=opt->nthread;
+     for(rng=0;rng<2;rng++){
+         for(pat=0;pat<2;pat++){
+             double t0=now_ms();
+             for(r=0;r<opt->repeat;r++)
+                 for(idx=0;idx<(size_t)opt->nthread;idx++){
+                     mcx_shim_global_id=idx;
+                     kernel[rng][pat](&seed[0],&output[0],opt->loop);
+                 }
+             report_speed(rngname[rng],"CPU (1 core)",pat,(double)opt->nthread*opt->loop*opt->repeat,now_ms()-t0);
+         }
+         report_stats(rngname[rng],"CPU (1 core)",&output[0],opt);
+         if(opt->dumpfile)
+             dump_draws(opt->dumpfile,rngname[rng],"cpu",&output[0],output.size());
+     }
+}
+
+/*====================== OpenCL device ======================*/
+
+static cl_device_id find_device(int devid,char *name,size_t len){
+     cl_uint nplatform=0,ndev,i;
+     int count=0;
+     cl_device_id dev=NULL;
+
+     if(clGetPlatformIDs(0,NULL,&nplatform)!=CL_SUCCESS || nplatform==0)
+         return NULL;
+     std::vector<cl_platform_id> platforms(nplatform);
+     OCL_CHECK(clGetPlatformIDs(nplatform,&platforms[0],NULL));
+     for(i=0;i<nplatform && dev==NULL;i++){
+         if(clGetDeviceIDs(platforms[i],CL_DEVICE_TYPE_ALL,0,NULL,&ndev)!=CL_SUCCESS || ndev==0)
+             continue;
+         std::vector<cl_device_id> devs(ndev);
+         OCL_CHECK(clGetDeviceIDs(platforms[i],CL_DEVICE_TYPE_ALL,ndev,&devs[0],NULL));
+         if(devid<=count+(int)ndev)
+             dev=devs[devid-count-1];
+         count+=ndev;
+     }
+     if(dev)
+         OCL_CHECK(clGetDeviceInfo(dev,CL_DEVICE_NAME,len,name,NULL));
+     return dev;
+}
+
+static void bench_opencl(RNGBenchOpt *opt,std::vector<cl_uint> &seed){
+     const char *kernelname[]={"bench_rng_reg","bench_rng_global"};
+     const char *buildopt[]={"-cl-mad-enable -cl-fast-relaxed-math",
+                             "-cl-mad-enable -cl-fast-relaxed-math -D USE_XORSHIFT128P_RAND"};
+     char devname[256]={'\0'};
+     size_t corelen,benchlen,gsize=opt->nthread,lsize=opt->nblock;
+     cl_device_id dev;
+     cl_context ctx;
+     cl_command_queue queue;
+     cl_mem gseed,goutput;
+     cl_int status;
+     int rng,pat,r;
+     std::vector<float> output((size_t)opt->nthread*opt->loop);
+
+     if((dev=find_device(opt->devid,devname,sizeof(devname)))==NULL){
+         printf("no OpenCL device #%d found, skip the OpenCL benchmark\n",opt->devid);
+         return;
+     }
+     char *core=loadfile(opt->kernelfile,&corelen);
+     char *bench=loadfile(opt->benchfile,&benchlen);
+     const char *src[]={core,bench};
+
+     OCL_CHECK(((ctx=clCreateContext(NULL,1,&dev,NULL,NULL,&status)),status));
+     OCL_CHECK(((queue=clCreateCommandQueue(ctx,dev,CL_QUEUE_PROFILING_ENABLE,&status)),status));
+     OCL_CHECK(((gseed=clCreateBuffer(ctx,CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,sizeof(cl_uint)*seed.size(),&seed[0],&status)),status));
+     OCL_CHECK(((goutput=clCreateBuffer(ctx,CL_MEM_WRITE_ONLY,sizeof(float)*output.size(),NULL,&status)),status));
+
+     for(rng=0;rng<2;rng++){
+         cl_program prog;
+         OCL_CHECK(((prog=clCreateProgramWithSource(ctx,2,src,NULL,&status)),status));
+         if((status=clBuildProgram(prog,1,&dev,buildopt[rng],NULL,NULL))!=CL_SUCCESS){
+             size_t len;
+             clGetProgramBuildInfo(prog,dev,CL_PROGRAM_BUILD_LOG,0,NULL,&len);
+             std::vector<char> msg(len+1,'\0');
+             clGetProgramBuildInfo(prog,dev,CL_PROGRAM_BUILD_LOG,len,&msg[0],NULL);
+             fprintf(stderr,"kernel build log:\n%s\n",&msg[0]);
+             OCL_CHECK(status);
+         }
+         for(pat=0;pat<2;pat++){
+             cl_kernel kernel;
+             double ms=0.0;
+             OCL_CHECK(((kernel=clCreateKernel(prog,kernelname[pat],&status)),status));
+             OCL_CHECK(clSetKernelArg(kernel,0,sizeof(cl_mem),&gseed));
+             OCL_CHECK(clSetKernelArg(kernel,1,sizeof(cl_mem),&goutput));
+             OCL_CHECK(clSetKernelArg(kernel,2,sizeof(cl_int),&opt->loop));
+             for(r=0;r<=opt->repeat;r++){  /*the first launch warms up the device and is not timed*/
+                 cl_event ev;
+                 cl_ulong t0,t1;
+                 OCL_CHECK(clEnqueueNDRangeKernel(queue,kernel,1,NULL,&gsize,&lsize,0,NULL,&ev));
+                 OCL_CHECK(clWaitForEvents(1,&ev));
+                 OCL_CHECK(clGetEventProfilingInfo(ev,CL_PROFILING_COMMAND_START,sizeof(cl_ulong),&t0,NULL));
+                 OCL_CHECK(clGetEventProfilingInfo(ev,CL_PROFILING_COMMAND_END,sizeof(cl_ulong),&t1,NULL));
+                 if(r>0) ms+=(t1-t0)*1e-6;
+                 clReleaseEvent(ev);
+             }
+             report_speed(rngname[rng],devname,pat,(double)opt->nthread*opt->loop*opt->repeat,ms);
+             clReleaseKernel(kernel);
+         }
+         OCL_CHECK(clEnqueueReadBuffer(queue,goutput,CL_TRUE,0,sizeof(float)*output.size(),&output[0],0,NULL,NULL));
+         report_stats(rngname[rng],devname,&output[0],opt);
+         if(opt->dumpfile)
+             dump_draws(opt->dumpfile,rngname[rng],"ocl",&output[0],output.size());
+         clReleaseProgram(prog);
+     }
+     clReleaseMemObject(gseed);
+     clReleaseMemObject(goutput);
+     clReleaseCommandQueue(queue);
+     clReleaseContext(ctx);
+     free(core);
+     free(bench);
+}
+
+static void usage(const char *exename){
+     printf("usage: %s <options>\n\
+  -t nthread    total work-items [16384]\n\
+  -T nblock     work-items per work-group [64]\n\
+  -l loop       draws per work-item [1000]\n\
+  -r repeat     timed launches [5]\n\
+  -G devid      1-based index of the OpenCL device over all platforms [1]\n\
+  -k file       path to mcx_core.cl [../../src/mcx_core.cl]\n\
+  -K file       path to rngspeed.cl [rngspeed.cl]\n\
+  -s maxshift   max. lag of the serial correlation test [10]\n\
+  -E seed       seed of the host RNG filling the per-thread seeds [time]\n\
+  -c            only run the native CPU benchmark\n\
+  -d prefix     dump the global-write draws to prefix_<rng>_<cpu|ocl>.bin\n\
+  -h            print this message\n\
+the exit code is 1 when any generator fails a statistical test\n",exename);
+}
+
+int main(int argc, char *argv[]){
+     RNGBenchOpt opt={16384,64,1000,5,1,10,0,0,"../../src/mcx_core.cl","rngspeed.cl",NULL};
+     int i;
+
+     opt.seed=(int)time(0);
+     for(i=1;i<argc;i++){
+         if(argv[i][0]!='-' || strlen(argv[i])!=2){
+             usage(argv[0]);
+             return 2;
+         }
+         switch(argv[i][1]){
+             case 'c': opt.cpuonly=1; continue;
+             case 'h': usage(argv[0]); return 0;
+         }
+         if(i+1>=argc){
+             usage(argv[0]);
+             return 2;
+         }
+         switch(argv[i][1]){
+             case 't': opt.nthread=atoi(argv[++i]); break;
+             case 'T': opt.nblock=atoi(argv[++i]); break;
+             case 'l': opt.loop=atoi(argv[++i]); break;
+             case 'r': opt.repeat=atoi(argv[++i]); break;
+             case 'G': opt.devid=atoi(argv[++i]); break;
+             case 'k': opt.kernelfile=argv[++i]; break;
+             case 'K': opt.benchfile=argv[++i]; break;
+             case 's': opt.maxshift=atoi(argv[++i]); break;
+             case 'E': opt.seed=atoi(argv[++i]); break;
+             case 'd': opt.dumpfile=argv[++i]; break;
+             default:  usage(argv[0]); return 2;
+         }
+     }
+     if(opt.nthread<=0 || opt.nblock<=0 || opt.loop<=0 || opt.repeat<=0 || opt.devid<=0){
+         usage(argv[0]);
+         return 2;
+     }
+     if(opt.maxshift>MAX_SHIFT) opt.maxshift=MAX_SHIFT;
+     opt.nthread=(opt.nthread+opt.nblock-1)/opt.nblock*opt.nblock;
+
+     /*seeded the same way as mcx_host.cpp*/
+     std::vector<cl_uint> seed((size_t)opt.nthread*SEED_LEN);
+     srand(opt.seed);
+     for(size_t j=0;j<seed.size();j++)
+         seed[j]=rand();
+
+     printf("threads=%d, block=%d, draws per thread=%d, repeat=%d, seed=%d\n",
+         opt.nthread,opt.nblock,opt.loop,opt.repeat,opt.seed);
+     printf("%-18s %-28s %-13s %15s %19s\n","RNG","device","pattern","time","throughput");
+
+     if(!opt.cpuonly)
+         bench_opencl(&opt,seed);
+     bench_cpu(&opt,seed);
+     return nfailed>0;
+}
@@ -1,21 +1,9 @@
 #!/bin/sh
-echo ============================================================
-echo "running MT RNG using only registers"
-make clean mt
-../../bin/rngspeed 128 128 100000
-
-echo ============================================================
-echo "running LL5 RNG using only registers"
-make clean logistic
-../../bin/rngspeed 128 128 100000
+# build and run the RNG benchmark on the first OpenCL device and on
+# one CPU core; extra options are passed to rngspeed, see rngspeed -h
 
-#echo ============================================================
-#echo "running MT RNG with global write (bottleneck)"
-#make clean mtw
-#../../bin/rngspeed 128 128 100000
-
-#echo ============================================================
-#echo "running LL5 RNG with global write (bottleneck)"
-#make clean logisticw
-#../../bin/rngspeed 128 128 100000
+make || exit 1
 
+echo ============================================================
+echo "Logistic-lattice and xorshift128+ RNG, register-only and global write"
+../../bin/rngspeed -t 16384 -T 64 -l 1000 -r 5 -s 10 $*
@@ -0,0 +1,359 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  Reference (Fang2009):
+**        Qianqian Fang and David A. Boas, "Monte Carlo Simulation of Photon
+**        Migration in 3D Turbid Media Accelerated by Graphics Processing
+**        Units," Optics Express, vol. 17, issue 22, pp. 20178-20190 (2009)
+**
+**  microbench.cpp: host micro-benchmarks for the building blocks of mcx_core.cl
+**
+**  The kernel source is compiled twice on the host through mcx_clshim.hpp,
+**  once for each random number generator. Each function is timed in
+**  isolation on pre-generated random inputs and its output is compared
+**  with a double precision reference.
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "mcx_clshim.hpp"
+
+#define MCX_SAVE_DETECTORS
+#define MCX_DO_REFLECTION
+
+namespace logistic{
+#include "mcx_core.cl"
+}
+
+#undef RAND_BUF_LEN
+#undef RAND_SEED_LEN
+#define USE_XORSHIFT128P_RAND
+
+namespace xorshift{
+#include "mcx_core.cl"
+}
+
+#define INPUT_LEN     4096       /*number of pre-generated inputs, power of 2*/
+#define DET_NUM       16
+
+typedef struct BenchReport{
+	const char *name;
+	double nspercall;
+	double maxerr;   /*max. error against the reference*/
+	double tol;      /*tolerated error*/
+} BenchReport;
+
+static double now_ns(){
+     return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*a small 64bit generator for the inputs, independent from the kernel RNGs*/
+static uint64_t seedstate=0x9E3779B97F4A7C15ULL;
+static double urand(){
+     seedstate^=seedstate<<13; seedstate^=seedstate>>7; seedstate^=seedstate<<17;
+     return (seedstate>>11)*(1.0/9007199254740992.0);
+}
+
+static float4 randdir(){
+     double ct=2.0*urand()-1.0, phi=2.0*M_PI*urand(), st=sqrt(1.0-ct*ct);
+     return float4((float)(st*cos(phi)),(float)(st*sin(phi)),(float)ct,0.f);
+}
+
+volatile float sink;
+
+/*=========================== hitgrid ===========================*/
+
+void bench_hitgrid(long n, BenchReport *r){
+     std::vector<float4> p(INPUT_LEN), v(INPUT_LEN);
+     float acc=0.f;
+     long i;
+     int k;
+
+     for(k=0;k<INPUT_LEN;k++){
+         p[k]=float4((float)(urand()*60.0),(float)(urand()*60.0),(float)(urand()*60.0),1.f);
+         v[k]=randdir();
+     }
+     r->name="hitgrid";
+     r->tol=1e-3;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         float4 p0=p[k], v0=v[k], htime;
+         double dref=1e30, d;
+         int id, a, idref=0;
+         float dist=logistic::hitgrid(&p0,&v0,&htime,&id);
+         for(a=0;a<3;a++){
+             double pa=p[k].s[a], va=v[k].s[a];
+             if(va==0.0) continue;
+             d=(va>0.0) ? (floor(pa)+1.0-pa)/va : (pa-floor(pa))/(-va);
+             if(d<dref){ dref=d; idref=a; }
+         }
+         /*distance to the wall and the snapped coordinate on the wall*/
+         d=fabs(dist-dref)/(1.0+dref)*fabs(v[k].s[idref]);
+         if(d>r->maxerr) r->maxerr=d;
+         d=fabs(htime.s[idref]-((v[k].s[idref]>0.f) ? floor(p[k].s[idref])+1.0 : floor(p[k].s[idref])));
+         if(d>r->maxerr) r->maxerr=d;
+     }
+     double t0=now_ns();
+     for(i=0;i<n;i++){
+         float4 p0=p[i&(INPUT_LEN-1)], v0=v[i&(INPUT_LEN-1)], htime;
+         int id;
+         acc+=logistic::hitgrid(&p0,&v0,&htime,&id)+htime.s[id];
+     }
+     r->nspercall=(now_ns()-t0)/n;
+     sink=acc;
+}
+
+/*=========================== rotatevector ===========================*/
+
+void bench_rotatevector(long n, BenchReport *r){
+     std::vector<float4> v(INPUT_LEN), ang(INPUT_LEN);
+     float acc=0.f;
+     long i;
+     int k;
+
+     for(k=0;k<INPUT_LEN;k++){
+         double theta=M_PI*urand(), phi=2.0*M_PI*urand();
+         v[k]=randdir();
+         if(k==0) v[k]=float4(0.f,0.f,1.f,0.f);  /*the pole branch*/
+         if(k==1) v[k]=float4(0.f,0.f,-1.f,0.f);
+         ang[k]=float4((float)sin(theta),(float)cos(theta),(float)sin(phi),(float)cos(phi));
+     }
+     r->name="rotatevector";
+     r->tol=1e-5;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         float4 v0=v[k];
+         double x=v[k].x, y=v[k].y, z=v[k].z, st=ang[k].x, ct=ang[k].y, sp=ang[k].z, cp=ang[k].w, ref[3];
+         logistic::rotatevector(&v0,ang[k].x,ang[k].y,ang[k].z,ang[k].w);
+         if(fabs(z)<1.0-FLT_EPSILON){
+             double tmp=sqrt(1.0-z*z);
+             ref[0]=st*(x*z*cp-y*sp)/tmp+x*ct;
+             ref[1]=st*(y*z*cp+x*sp)/tmp+y*ct;
+             ref[2]=-st*cp*tmp+z*ct;
+         }else{
+             ref[0]=st*cp; ref[1]=st*sp; ref[2]=(z>0.0) ? ct : -ct;
+         }
+         for(int a=0;a<3;a++)
+             if(fabs(v0.s[a]-ref[a])>r->maxerr) r->maxerr=fabs(v0.s[a]-ref[a]);
+     }
+     double t0=now_ns();
+     for(i=0;i<n;i++){
+         float4 v0=v[i&(INPUT_LEN-1)], a=ang[i&(INPUT_LEN-1)];
+         logistic::rotatevector(&v0,a.x,a.y,a.z,a.w);
+         acc+=v0.x;
+     }
+     r->nspercall=(now_ns()-t0)/n;
+     sink=acc;
+}
+
+/*=========================== mcx_nextafterf ===========================*/
+
+void bench_nextafterf(long n, BenchReport *r){
+     std::vector<float> a(INPUT_LEN);
+     std::vector<int> dir(INPUT_LEN);
+     float acc=0.f;
+     long i;
+     int k;
+
+     for(k=0;k<INPUT_LEN;k++){
+         a[k]=(float)(int)(urand()*512.0);  /*grid coordinates as produced by convert_int_rte*/
+         dir[k]=(int)(urand()*3.0)-1;
+     }
+     r->name="mcx_nextafterf";
+     r->tol=0.0;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         float ref=a[k]+1000.f;
+         if(dir[k]) ref=nextafterf(ref,dir[k]>0 ? INFINITY : -INFINITY);
+         ref-=1000.f;
+         double d=fabs(logistic::mcx_nextafterf(a[k],dir[k])-ref);
+         if(d>r->maxerr) r->maxerr=d;
+     }
+     double t0=now_ns();
+     for(i=0;i<n;i++)
+         acc+=logistic::mcx_nextafterf(a[i&(INPUT_LEN-1)],dir[i&(INPUT_LEN-1)]);
+     r->nspercall=(now_ns()-t0)/n;
+     sink=acc;
+}
+
+/*=========================== logistic_step ===========================*/
+
+void bench_logistic_step(long n, BenchReport *r){
+     float t[5], tnew[5];
+     double td[5], ref[5];
+     long i;
+     int k, j;
+
+     r->name="logistic_step";
+     r->tol=1e-5;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         for(j=0;j<5;j++)
+             td[j]=t[j]=(float)urand();
+         logistic::logistic_step(t,tnew,4);
+         for(j=0;j<5;j++)
+             td[j]=4.0*td[j]*(1.0-td[j]);
+         for(j=0;j<5;j++)  /*tnew[j]=RING_FUN(t[j+1],t[j],t[j+2])*/
+             ref[j]=(1.0-2e-7)*td[(j+1)%5]+1e-7*(td[j]+td[(j+2)%5]);
+         for(j=0;j<5;j++)
+             if(fabs(tnew[j]-ref[j])>r->maxerr) r->maxerr=fabs(tnew[j]-ref[j]);
+     }
+     for(j=0;j<5;j++)
+         t[j]=(float)urand();
+     double t0=now_ns();
+     for(i=0;i<n;i+=2){  /*two steps per iteration, as in rand_need_more*/
+         logistic::logistic_step(t,tnew,4);
+         logistic::logistic_step(tnew,t,4);
+     }
+     r->nspercall=(now_ns()-t0)/n;
+     sink=t[0];
+}
+
+/*=========================== xorshift128p_nextf ===========================*/
+
+void bench_xorshift128p_nextf(long n, BenchReport *r){
+     ulong t[2]={0x0123456789ABCDEFULL,0xFEDCBA9876543210ULL}, s0, s1;
+     float acc=0.f;
+     long i;
+     int k;
+
+     r->name="xorshift128p_nextf";
+     r->tol=2.0*FLT_EPSILON;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         s1=t[0]; s0=t[1];
+         s1^=s1<<23;
+         s1=s1^s0^(s1>>18)^(s0>>5);
+         double ref=((s1+s0)>>12)*(1.0/4503599627370496.0);
+         double d=fabs(xorshift::xorshift128p_nextf(t)-ref);
+         if(t[0]!=s0 || t[1]!=s1) d=1.0;  /*the state must follow the reference exactly*/
+         if(d>r->maxerr) r->maxerr=d;
+     }
+     double t0=now_ns();
+     for(i=0;i<n;i++)
+         acc+=xorshift::xorshift128p_nextf(t);
+     r->nspercall=(now_ns()-t0)/n;
+     sink=acc;
+}
+
+/*=========================== finddetector ===========================*/
+
+void bench_finddetector(long n, BenchReport *r){
+     std::vector<float4> p(INPUT_LEN);
+     float4 detpos[DET_NUM];
+     logistic::MCXParam param;
+     uint acc=0;
+     long i;
+     int k, j;
+
+     memset((void*)&param,0,sizeof(param));
+     param.detnum=DET_NUM;
+     for(j=0;j<DET_NUM;j++)
+         detpos[j]=float4((float)(urand()*60.0),(float)(urand()*60.0),0.f,(float)(4.0+urand()*16.0));
+     for(k=0;k<INPUT_LEN;k++)
+         p[k]=float4((float)(urand()*60.0),(float)(urand()*60.0),(float)(urand()*2.0),1.f);
+
+     r->name="finddetector";
+     r->tol=0.0;
+     r->maxerr=0.0;
+     for(k=0;k<INPUT_LEN;k++){
+         uint id=logistic::finddetector(&p[k],detpos,&param), ref=0;
+         for(j=0;j<DET_NUM;j++){
+             double dx=detpos[j].x-p[k].x, dy=detpos[j].y-p[k].y, dz=detpos[j].z-p[k].z;
+             double d2=dx*dx+dy*dy+dz*dz;
+             if(fabs(d2-detpos[j].w)<1e-4) { ref=id; break; }  /*on the rim, float and double may differ*/
+             if(d2<detpos[j].w){ ref=j+1; break; }
+         }
+         if(id!=ref) r->maxerr=1.0;
+     }
+     double t0=now_ns();
+     for(i=0;i<n;i++)
+         acc+=logistic::finddetector(&p[i&(INPUT_LEN-1)],detpos,&param);
+     r->nspercall=(now_ns()-t0)/n;
+     sink=(float)acc;
+}
+
+/*=========================== mcx_main_loop ===========================*/
+
+/*
+   run one work-item of the whole kernel in a 20x20x20 homogeneous cube;
+   the check is the energy balance: escaped energy <= launched energy
+*/
+void bench_main_loop(long n, BenchReport *r){
+     const int dim=20;
+     std::vector<uchar> media(dim*dim*dim,1);
+     std::vector<float> field(dim*dim*dim,0.f);
+     float genergy[2]={0.f,0.f}, det[1]={0.f}, ppath[1]={0.f};
+     float4 prop[2]={float4(0.f,0.f,0.f,1.f),float4(0.005f,1.f,0.01f,1.37f)};
+     float4 detpos[1]={float4(10.f,10.f,0.f,1.f)};
+     uint seed[5]={0};
+     uint stopsign[1]={0}, detected[1]={0};
+     logistic::MCXParam param;
+     int nphoton=(int)(n/1000>0 ? n/1000 : 1), j;
+
+     for(j=0;j<5;j++)
+         seed[j]=(uint)(urand()*4294967295.0);
+     memset((void*)&param,0,sizeof(param));
+     param.ps=float4(10.f,10.f,0.f,1.f);
+     param.c0=float4(0.f,0.f,1.f,0.f);
+     param.maxidx=float4((float)dim,(float)dim,(float)dim,0.f);
+     param.dimlen.x=dim; param.dimlen.y=dim*dim; param.dimlen.z=dim*dim*dim;
+     param.twin0=0.f; param.twin1=5e-9f; param.tmax=5e-9f;
+     param.oneoverc0=3.335640951981520e-12f;
+     param.save2pt=1; param.doreflect=0;
+     param.Rtstep=1.f/5e-9f;
+     param.minaccumtime=1.f*3.335640951981520e-12f;
+     param.maxmedia=1;
+     param.idx1dorig=10*dim+10;
+     param.mediaidorig=1;
+
+     r->name="mcx_main_loop (per photon)";
+     r->tol=1e-3;
+     mcx_shim_global_id=0;
+     mcx_shim_local_id=0;
+     double t0=now_ns();
+     logistic::mcx_main_loop(nphoton,0,&media[0],&field[0],genergy,seed,det,prop,detpos,stopsign,detected,ppath,&param);
+     r->nspercall=(now_ns()-t0)/nphoton;
+     r->maxerr=(genergy[1]>0.f) ? fmax(0.0,(genergy[0]-genergy[1])/genergy[1]) : 1.0;
+     sink=genergy[0];
+}
+
+int main(int argc, char *argv[]){
+     long n=10000000;
+     BenchReport r[7];
+     int i, len=sizeof(r)/sizeof(r[0]), failed=0;
+
+     if(argc>1 && (strcmp(argv[1],"-h")==0 || atof(argv[1])<=0.0)){
+         printf("usage: %s [calls per function, 1e7 by default]\n",argv[0]);
+         return 0;
+     }
+     if(argc>1)
+         n=(long)atof(argv[1]);
+
+     bench_hitgrid(n,r);
+     bench_rotatevector(n,r+1);
+     bench_nextafterf(n,r+2);
+     bench_logistic_step(n,r+3);
+     bench_xorshift128p_nextf(n,r+4);
+     bench_finddetector(n,r+5);
+     bench_main_loop(n,r+6);
+
+     printf("%-28s %12s %12s %12s %s\n","function","ns/call","Mcall/s","max.error","check");
+     for(i=0;i<len;i++){
+         int pass=(r[i].maxerr<=r[i].tol);
+         printf("%-28s %12.3f %12.2f %12.3e %s\n",r[i].name,r[i].nspercall,1e3/r[i].nspercall,r[i].maxerr,pass ? "ok" : "FAILED");
+         failed+=!pass;
+     }
+     return failed ? 1 : 0;
+}
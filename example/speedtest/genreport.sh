@@ -1,3 +1,6 @@
 #!/bin/sh
-grep '^simulat' $1 | sed -e :a -e '/ms$/N; s/ms\n/ /; ta' -e 's/[a-zA-Z\.]//g' | \
-  awk '{print $4 "\t" $5 "\t" $6 "\t" $7}' | sed -e 's/[\)\(]//g'
+# tabulate a result file saved by mcxbench (mcxbench.json by default)
+file=${1:-mcxbench.json}
+printf "%-32s %12s %10s %10s %10s %s\n" case photon/ms build_ms kernel_ms transfer_ms status
+grep '"case"' $file | sed -e 's/"[a-z_]*"://g' -e 's/[{}",]/ /g' | \
+  awk '{printf "%-32s %12s %10s %10s %10s %s\n",$1,$8,$9,$10,$11,$12}'
@@ -0,0 +1,339 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  Reference (Fang2009):
+**        Qianqian Fang and David A. Boas, "Monte Carlo Simulation of Photon
+**        Migration in 3D Turbid Media Accelerated by Graphics Processing
+**        Units," Optics Express, vol. 17, issue 22, pp. 20178-20190 (2009)
+**
+**  mcxbench.cpp: end-to-end speed benchmark driver for mcxcl
+**
+**  The driver runs mcxcl over a fixed matrix of volume size, scattering,
+**  thread number, block size, atomic/non-atomic and detector on/off, records
+**  the speed and the build/kernel/transfer timings reported by mcxcl in a
+**  JSON file and compares the speed against a stored baseline.
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define MAX_LINE_LENGTH  4096
+
+typedef struct BenchCase{
+	int   vol;        /*edge length of the cubic volume in voxels*/
+	float mus;        /*scattering coeff. in 1/mm*/
+	int   nthread;    /*-t*/
+	int   nblocksize; /*-T*/
+	int   isatomic;   /*1 to compile the kernel with -D USE_ATOMIC*/
+	int   issavedet;  /*-d*/
+} BenchCase;
+
+typedef struct BenchResult{
+	char   name[128];
+	BenchCase c;
+	double speed;     /*photon/ms, median of all repetitions*/
+	int    buildms;
+	int    kernelms;
+	int    transferms;
+	int    status;    /*0: success, otherwise mcxcl failed*/
+	double baseline;  /*speed in the baseline, negative if not found*/
+} BenchResult;
+
+typedef struct BenchOption{
+	char   binary[MAX_LINE_LENGTH];
+	char   kernel[MAX_LINE_LENGTH];
+	char   output[MAX_LINE_LENGTH];
+	char   baseline[MAX_LINE_LENGTH];
+	char   devices[256];
+	double nphoton;
+	int    repeat;
+	int    isquick;
+	int    isupdate;
+	double tolerance;
+} BenchOption;
+
+/*the fixed benchmark matrix, the first entry of each row forms the quick matrix*/
+
+static const int   bench_vol[]   ={60,120};
+static const float bench_mus[]   ={1.f,10.f};
+static const int   bench_thread[]={4096,16384};
+static const int   bench_block[] ={64,128};
+
+#define LEN(x)  (int)(sizeof(x)/sizeof(x[0]))
+
+void bench_usage(const char *exename){
+     printf("\
+usage: %s <param1> <param2> ...\n\
+where possible parameters include (the first item in [] is the default value)\n\
+ -b [../../bin/mcxcl]        path to the mcxcl binary\n\
+ -k [../../src/mcx_core.cl]  path to the OpenCL kernel source file\n\
+ -n [1e6|float]              photon number for each case\n\
+ -r [3|int]                  repeat each case and report the median speed\n\
+ -G ['1'|string]             active device list passed to mcxcl (-G)\n\
+ -o [mcxbench.json]          output file for the benchmark results\n\
+ -c [baseline.json]          baseline file to compare with\n\
+ -e [0.1|float]              tolerated relative slow-down before flagging a regression\n\
+ -q                          run the quick matrix only (60^3 volume, -t 4096 -T 64)\n\
+ -u                          save the results as the new baseline\n\
+ -h                          print this message\n\
+the exit code is 0 if all cases pass, 1 if any regression is found and 2 if mcxcl fails\n",exename);
+}
+
+void bench_parsecmd(int argc, char *argv[], BenchOption *opt){
+     int i;
+     strcpy(opt->binary,"../../bin/mcxcl");
+     strcpy(opt->kernel,"../../src/mcx_core.cl");
+     strcpy(opt->output,"mcxbench.json");
+     strcpy(opt->baseline,"baseline.json");
+     strcpy(opt->devices,"1");
+     opt->nphoton=1e6;
+     opt->repeat=3;
+     opt->isquick=0;
+     opt->isupdate=0;
+     opt->tolerance=0.1;
+
+     for(i=1;i<argc;i++){
+         if(argv[i][0]!='-' || argv[i][1]=='\0' || argv[i][2]!='\0'){
+             fprintf(stderr,"unknown option %s\n",argv[i]);
+             exit(2);
+         }
+         if(strchr("bknrGoce",argv[i][1]) && i+1>=argc){
+             fprintf(stderr,"option %s needs a value\n",argv[i]);
+             exit(2);
+         }
+         switch(argv[i][1]){
+             case 'b': strncpy(opt->binary,argv[++i],MAX_LINE_LENGTH-1);   break;
+             case 'k': strncpy(opt->kernel,argv[++i],MAX_LINE_LENGTH-1);   break;
+             case 'o': strncpy(opt->output,argv[++i],MAX_LINE_LENGTH-1);   break;
+             case 'c': strncpy(opt->baseline,argv[++i],MAX_LINE_LENGTH-1); break;
+             case 'G': strncpy(opt->devices,argv[++i],sizeof(opt->devices)-1); break;
+             case 'n': opt->nphoton=atof(argv[++i]);   break;
+             case 'r': opt->repeat=atoi(argv[++i]);    break;
+             case 'e': opt->tolerance=atof(argv[++i]); break;
+             case 'q': opt->isquick=1;  break;
+             case 'u': opt->isupdate=1; break;
+             case 'h': bench_usage(argv[0]); exit(0);
+             default:
+                 fprintf(stderr,"unknown option %s\n",argv[i]);
+                 exit(2);
+         }
+     }
+     if(opt->repeat<1)
+         opt->repeat=1;
+}
+
+/*
+   write a homogeneous cubic volume and an input file for a given size and mus
+*/
+void bench_writeinput(int vol, float mus, const char *inpfile){
+     char volfile[MAX_LINE_LENGTH];
+     FILE *fp;
+     float c=vol*0.5f;
+
+     sprintf(volfile,"benchvol%d.bin",vol);
+     if((fp=fopen(volfile,"rb"))==NULL){
+         std::vector<unsigned char> seg((size_t)vol*vol*vol,1);
+         if((fp=fopen(volfile,"wb"))==NULL || fwrite(&seg[0],1,seg.size(),fp)!=seg.size()){
+             fprintf(stderr,"can not write volume file %s\n",volfile);
+             exit(2);
+         }
+     }
+     fclose(fp);
+
+     if((fp=fopen(inpfile,"wt"))==NULL){
+         fprintf(stderr,"can not write input file %s\n",inpfile);
+         exit(2);
+     }
+     fprintf(fp,"1000000              # total photon, overwritten by -n\n");
+     fprintf(fp,"29012392             # RNG seed, fixed for reproducibility\n");
+     fprintf(fp,"%.1f %.1f 1.0        # source position (grid unit)\n",c,c);
+     fprintf(fp,"0 0 1                # initial directional vector\n");
+     fprintf(fp,"0.e+00 5.e-09 5.e-10 # time-gates(s): start, end, step\n");
+     fprintf(fp,"%s     # volume ('uchar' format)\n",volfile);
+     fprintf(fp,"1 %d 1 %d            # x: voxel size, dim, start/end indices\n",vol,vol);
+     fprintf(fp,"1 %d 1 %d            # y: voxel size, dim, start/end indices\n",vol,vol);
+     fprintf(fp,"1 %d 1 %d            # z: voxel size, dim, start/end indices\n",vol,vol);
+     fprintf(fp,"1                    # num of media\n");
+     fprintf(fp,"%f 0.01 0.005 1.37  # scat(1/mm), g, mua (1/mm), n\n",mus);
+     fprintf(fp,"4 1                  # detector number and radius (grid unit)\n");
+     fprintf(fp,"%.1f %.1f 1.0\n%.1f %.1f 1.0\n%.1f %.1f 1.0\n%.1f %.1f 1.0\n",
+             c,c-10.f,c,c+10.f,c-10.f,c,c+10.f,c);
+     fclose(fp);
+}
+
+/*
+   run mcxcl once for a case and collect the timings printed at the end of the log
+*/
+int bench_runonce(const BenchOption *opt, const BenchCase *c, const char *inpfile,
+                  double *speed, int *buildms, int *kernelms, int *transferms){
+     char cmd[MAX_LINE_LENGTH*3], line[MAX_LINE_LENGTH];
+     FILE *pp;
+     int status=0, found=0;
+
+     snprintf(cmd,sizeof(cmd),"\"%s\" -t %d -T %d -n %.0f -g 10 -f %s -s mcxbench -b 0 -d %d -G %s -k \"%s\"%s 2>&1",
+             opt->binary,c->nthread,c->nblocksize,opt->nphoton,inpfile,c->issavedet,opt->devices,
+             opt->kernel,c->isatomic ? " -J '-D USE_ATOMIC'" : "");
+     if((pp=popen(cmd,"r"))==NULL)
+         return -1;
+     while(fgets(line,MAX_LINE_LENGTH,pp)){
+         if(sscanf(line,"MCX simulation speed: %lf photon/ms",speed)==1)
+             found|=1;
+         else if(sscanf(line,"timing: build %d ms, kernel %d ms, transfer %d ms",buildms,kernelms,transferms)==3)
+             found|=2;
+         else if(strstr(line,"MCX ERROR"))
+             fprintf(stderr,"%s",line);
+     }
+     status=pclose(pp);
+     return (status==0 && found==3) ? 0 : -1;
+}
+
+void bench_run(const BenchOption *opt, const BenchCase *c, BenchResult *res){
+     char inpfile[MAX_LINE_LENGTH];
+     std::vector<double> speed(opt->repeat), kernel(opt->repeat), transfer(opt->repeat), build(opt->repeat);
+     int i, b, k, t;
+
+     sprintf(res->name,"v%d_s%g_t%d_b%d_a%d_d%d",c->vol,c->mus,c->nthread,c->nblocksize,c->isatomic,c->issavedet);
+     res->c=*c;
+     res->status=0;
+     res->baseline=-1.0;
+
+     sprintf(inpfile,"bench_v%d_s%g.inp",c->vol,c->mus);
+     bench_writeinput(c->vol,c->mus,inpfile);
+
+     for(i=0;i<opt->repeat;i++){
+         if(bench_runonce(opt,c,inpfile,&speed[i],&b,&k,&t)){
+             res->status=-1;
+             res->speed=0.0;
+             res->buildms=res->kernelms=res->transferms=0;
+             return;
+         }
+         build[i]=b; kernel[i]=k; transfer[i]=t;
+     }
+     std::sort(speed.begin(),speed.end());
+     std::sort(build.begin(),build.end());
+     std::sort(kernel.begin(),kernel.end());
+     std::sort(transfer.begin(),transfer.end());
+     res->speed=speed[opt->repeat/2];
+     res->buildms=(int)build[opt->repeat/2];
+     res->kernelms=(int)kernel[opt->repeat/2];
+     res->transferms=(int)transfer[opt->repeat/2];
+}
+
+/*
+   load the speed of each case from a result file written by bench_savejson,
+   each run record is stored in a single line
+*/
+void bench_loadbaseline(const char *fname, std::vector<BenchResult> &res){
+     char line[MAX_LINE_LENGTH], name[128];
+     char *p;
+     FILE *fp=fopen(fname,"rt");
+     size_t i;
+
+     if(fp==NULL)
+         return;
+     while(fgets(line,MAX_LINE_LENGTH,fp)){
+         if((p=strstr(line,"\"case\":\""))==NULL || sscanf(p+8,"%127[^\"]",name)!=1)
+             continue;
+         if((p=strstr(line,"\"speed\":"))==NULL)
+             continue;
+         for(i=0;i<res.size();i++)
+             if(strcmp(res[i].name,name)==0)
+                 res[i].baseline=atof(p+8);
+     }
+     fclose(fp);
+}
+
+void bench_savejson(const char *fname, const BenchOption *opt, std::vector<BenchResult> &res){
+     char date[64];
+     time_t now=time(NULL);
+     FILE *fp=fopen(fname,"wt");
+     size_t i;
+
+     if(fp==NULL){
+         fprintf(stderr,"can not write to %s\n",fname);
+         exit(2);
+     }
+     strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%S",localtime(&now));
+     fprintf(fp,"{\n\"mcxbench\":{\n\t\"version\":1,\n\t\"date\":\"%s\",\n\t\"photon\":%.0f,\n\t\"repeat\":%d,\n\t\"devices\":\"%s\",\n\t\"runs\":[\n",
+             date,opt->nphoton,opt->repeat,opt->devices);
+     for(i=0;i<res.size();i++){
+         const BenchCase *c=&res[i].c;
+         fprintf(fp,"\t\t{\"case\":\"%s\",\"vol\":%d,\"mus\":%g,\"nthread\":%d,\"blocksize\":%d,\"atomic\":%d,\"savedet\":%d,"
+                    "\"speed\":%.2f,\"build_ms\":%d,\"kernel_ms\":%d,\"transfer_ms\":%d,\"status\":\"%s\"}%s\n",
+                 res[i].name,c->vol,c->mus,c->nthread,c->nblocksize,c->isatomic,c->issavedet,
+                 res[i].speed,res[i].buildms,res[i].kernelms,res[i].transferms,
+                 res[i].status ? "failed" : "ok", (i+1<res.size()) ? "," : "");
+     }
+     fprintf(fp,"\t]\n}\n}\n");
+     fclose(fp);
+}
+
+int main(int argc, char *argv[]){
+     BenchOption opt;
+     std::vector<BenchResult> res;
+     int v,s,t,b,a,d,failed=0,regressed=0;
+     size_t i;
+
+     bench_parsecmd(argc,argv,&opt);
+
+     for(v=0;v<(opt.isquick ? 1 : LEN(bench_vol));v++)
+      for(s=0;s<LEN(bench_mus);s++)
+       for(t=0;t<(opt.isquick ? 1 : LEN(bench_thread));t++)
+        for(b=0;b<(opt.isquick ? 1 : LEN(bench_block));b++)
+         for(a=0;a<2;a++)
+          for(d=0;d<2;d++){
+              BenchCase c={bench_vol[v],bench_mus[s],bench_thread[t],bench_block[b],a,d};
+              BenchResult r;
+              bench_run(&opt,&c,&r);
+              printf("%-36s %12.2f photon/ms  build %6d ms  kernel %8d ms  transfer %6d ms  %s\n",
+                     r.name,r.speed,r.buildms,r.kernelms,r.transferms,r.status ? "FAILED" : "");
+              fflush(stdout);
+              res.push_back(r);
+          }
+
+     bench_savejson(opt.output,&opt,res);
+     printf("results are saved to %s\n",opt.output);
+
+     if(opt.isupdate){
+         bench_savejson(opt.baseline,&opt,res);
+         printf("baseline %s is updated\n",opt.baseline);
+         return 0;
+     }
+
+     bench_loadbaseline(opt.baseline,res);
+     for(i=0;i<res.size();i++){
+         if(res[i].status){
+             failed++;
+             continue;
+         }
+         if(res[i].baseline<=0.0)
+             continue;
+         if(res[i].speed<res[i].baseline*(1.0-opt.tolerance)){
+             printf("REGRESSION: %-36s %12.2f photon/ms vs baseline %12.2f (%+.1f%%)\n",res[i].name,
+                    res[i].speed,res[i].baseline,(res[i].speed/res[i].baseline-1.0)*100.0);
+             regressed++;
+         }
+     }
+     for(i=0;i<res.size() && res[i].baseline<=0.0;i++);
+     if(i==res.size())
+         printf("no baseline found in %s, run with -u to create one\n",opt.baseline);
+     else
+         printf("%d regression(s) beyond %.0f%% found\n",regressed,opt.tolerance*100.0);
+
+     if(failed){
+         printf("%d case(s) failed to run\n",failed);
+         return 2;
+     }
+     return regressed ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  Reference (Fang2009):
+**        Qianqian Fang and David A. Boas, "Monte Carlo Simulation of Photon
+**        Migration in 3D Turbid Media Accelerated by Graphics Processing
+**        Units," Optics Express, vol. 17, issue 22, pp. 20178-20190 (2009)
+**
+**  mcx_clshim.hpp: host C++ mapping of the OpenCL C built-ins used in
+**                  mcx_core.cl, so that the kernel functions can be compiled,
+**                  timed and verified on the CPU
+**
+**  Usage: include all system headers first, then this file, then mcx_core.cl.
+**  The vector types implement only the operators and swizzles (xyz,xy,xz,yz)
+**  that the kernel uses; the work-item functions return the values of
+**  mcx_shim_global_id/mcx_shim_local_id/mcx_shim_global_size set by
+**  the caller.
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#ifndef _MCEXTREME_CL_SHIM_H
+#define _MCEXTREME_CL_SHIM_H
+
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* address space and function qualifiers */
+
+#define __kernel
+#define __global
+#define __local
+#define __constant
+#define __private
+
+/* mcx_core.cl defines its own NULL and RAND_MAX */
+
+#undef NULL
+#undef RAND_MAX
+
+/* vector literal (float4)(x,y,z,w) can not be expressed in C++ */
+
+#define FLOAT4(x,y,z,w)   float4((x),(y),(z),(w))
+
+typedef unsigned char uchar;
+typedef unsigned int  uint;
+typedef uint64_t      ulong;
+
+struct float2{
+     float x,y;
+     float2(){}
+     explicit float2(float a):x(a),y(a){}
+     float2(float a,float b):x(a),y(b){}
+};
+
+struct float3{
+     float x,y,z;
+     float3(){}
+     explicit float3(float a):x(a),y(a),z(a){}
+     float3(float a,float b,float c):x(a),y(b),z(c){}
+};
+
+struct int3{ int x,y,z; };
+struct int4{ int x,y,z,w; };
+struct uint2{ uint x,y; };
+struct uint4{ uint x,y,z,w; };
+
+/* swizzles alias the storage of the owning float4 through a union */
+
+template<int A,int B> struct mcx_swizzle2{
+     float s[4];
+     operator float2() const { return float2(s[A],s[B]); }
+     mcx_swizzle2& operator=(const float2 &v){ s[A]=v.x; s[B]=v.y; return *this; }
+     mcx_swizzle2& operator=(const mcx_swizzle2 &v){ return *this=(float2)v; }
+};
+
+template<int A,int B,int C> struct mcx_swizzle3{
+     float s[4];
+     operator float3() const { return float3(s[A],s[B],s[C]); }
+     mcx_swizzle3& operator=(const float3 &v){ s[A]=v.x; s[B]=v.y; s[C]=v.z; return *this; }
+     mcx_swizzle3& operator=(const mcx_swizzle3 &v){ return *this=(float3)v; }
+};
+
+struct float4{
+     union{
+         struct{ float x,y,z,w; };
+         float s[4];
+         mcx_swizzle3<0,1,2> xyz;
+         mcx_swizzle2<0,1> xy;
+         mcx_swizzle2<0,2> xz;
+         mcx_swizzle2<1,2> yz;
+     };
+     float4(){}
+     explicit float4(float a){ x=y=z=w=a; }
+     float4(float a,float b,float c,float d){ x=a; y=b; z=c; w=d; }
+     float4(const float4 &v){ x=v.x; y=v.y; z=v.z; w=v.w; }
+     float4& operator=(const float4 &v){ x=v.x; y=v.y; z=v.z; w=v.w; return *this; }
+} __attribute__ ((aligned (16)));
+
+/* arithmetic operators */
+
+static inline float2 operator*(float a,const float2 &b){ return float2(a*b.x,a*b.y); }
+static inline float2 operator*(const float2 &a,float b){ return float2(a.x*b,a.y*b); }
+static inline float2 operator+(const float2 &a,const float2 &b){ return float2(a.x+b.x,a.y+b.y); }
+static inline float2 operator-(const float2 &a,const float2 &b){ return float2(a.x-b.x,a.y-b.y); }
+
+static inline float3 operator+(const float3 &a,const float3 &b){ return float3(a.x+b.x,a.y+b.y,a.z+b.z); }
+static inline float3 operator-(const float3 &a,const float3 &b){ return float3(a.x-b.x,a.y-b.y,a.z-b.z); }
+static inline float3 operator*(const float3 &a,const float3 &b){ return float3(a.x*b.x,a.y*b.y,a.z*b.z); }
+static inline float3 operator*(float a,const float3 &b){ return float3(a*b.x,a*b.y,a*b.z); }
+static inline float3 operator*(const float3 &a,float b){ return float3(a.x*b,a.y*b,a.z*b); }
+
+static inline float4 operator+(const float4 &a,const float4 &b){ return float4(a.x+b.x,a.y+b.y,a.z+b.z,a.w+b.w); }
+static inline float4 operator-(const float4 &a,const float4 &b){ return float4(a.x-b.x,a.y-b.y,a.z-b.z,a.w-b.w); }
+static inline float4 operator*(const float4 &a,const float4 &b){ return float4(a.x*b.x,a.y*b.y,a.z*b.z,a.w*b.w); }
+static inline float4 operator/(const float4 &a,const float4 &b){ return float4(a.x/b.x,a.y/b.y,a.z/b.z,a.w/b.w); }
+static inline float4 operator*(float a,const float4 &b){ return float4(a*b.x,a*b.y,a*b.z,a*b.w); }
+static inline float4 operator*(const float4 &a,float b){ return float4(a.x*b,a.y*b,a.z*b,a.w*b); }
+
+/* math built-ins, scalar versions come from math.h */
+
+static inline float  max(float a,float b){ return a>b ? a : b; }
+static inline float  min(float a,float b){ return a<b ? a : b; }
+static inline float  rsqrt(float a){ return 1.f/sqrtf(a); }
+static inline float  sincos(float a,float *c){ *c=cosf(a); return sinf(a); }
+static inline float  nextafter(int a,float b){ return nextafterf((float)a,b); }
+static inline float  native_divide(float a,float b){ return a/b; }
+static inline float4 native_divide(const float4 &a,const float4 &b){ return a/b; }
+static inline float4 floor(const float4 &a){ return float4(floorf(a.x),floorf(a.y),floorf(a.z),floorf(a.w)); }
+static inline float4 fabs(const float4 &a){ return float4(fabsf(a.x),fabsf(a.y),fabsf(a.z),fabsf(a.w)); }
+
+/* conversions, vector relational functions return -1 (all bits set) for true */
+
+static inline int    convert_int_rte(float a){ return (int)rintf(a); }
+static inline float4 convert_float4(const int4 &a){ return float4((float)a.x,(float)a.y,(float)a.z,(float)a.w); }
+static inline int4   isgreater(const float4 &a,const float4 &b){
+     int4 r={-(a.x>b.x),-(a.y>b.y),-(a.z>b.z),-(a.w>b.w)};
+     return r;
+}
+static inline int3   isgreater(const float3 &a,const float3 &b){
+     int3 r={-(a.x>b.x),-(a.y>b.y),-(a.z>b.z)};
+     return r;
+}
+static inline int3   isless(const float3 &a,const float3 &b){
+     int3 r={-(a.x<b.x),-(a.y<b.y),-(a.z<b.z)};
+     return r;
+}
+static inline int    any(const int3 &a){ return (a.x|a.y|a.z)<0; }
+static inline int    any(const int4 &a){ return (a.x|a.y|a.z|a.w)<0; }
+
+/* work-item and atomic functions */
+
+static size_t mcx_shim_global_id=0, mcx_shim_local_id=0, mcx_shim_global_size=1, mcx_shim_local_size=1;
+
+static inline size_t get_global_id(uint dim){ return mcx_shim_global_id; }
+static inline size_t get_global_size(uint dim){ return mcx_shim_global_size; }
+static inline size_t get_local_id(uint dim){ return mcx_shim_local_id; }
+static inline size_t get_local_size(uint dim){ return mcx_shim_local_size; }
+#define CLK_LOCAL_MEM_FENCE 1
+static inline void   barrier(int flags){ (void)flags; }  //the work-items of a shim group run one after another
+static inline uint   atomic_inc(volatile uint *p){ return __sync_fetch_and_add(p,1U); }
+static inline uint   atomic_cmpxchg(volatile uint *p,uint cmp,uint val){ return __sync_val_compare_and_swap(p,cmp,val); }
+
+#endif
@@ -46,6 +46,36 @@
 #define MED_MASK           0x7F
 #define NULL               0
 
+#ifndef FLOAT4
+  #define FLOAT4(x,y,z,w)  (float4)(x,y,z,w)       //vector literal, mcx_clshim.hpp maps it for the host
+#endif
+
+#ifdef MCX_USE_LONG_INDEX
+  typedef ulong FieldIndex;                        //the time gates extend the field beyond 2^32 elements
+#else
+  typedef uint  FieldIndex;                        //32-bit offsets are faster on most devices
+#endif
+
+#ifdef MCX_SLAB_SPLIT
+  #define MCX_HANDOFF_LEN  11                      //p(4),v(4),f.x,f.y,mediaid of a handed-over photon, then ppath
+  #define MEDIA_OFFSET     (gcfg->mediaoffset)     //the media of a slab starts one z-layer below the slab
+  #define FIELD_OFFSET     (gcfg->slabstart)       //the field of a slab only covers the slab
+  #define SLAB_ARGS        ,gimport,nimport,&importid
+  #define SLAB_PARAMS      ,__global const float gimport[],const uint nimport,uint *importid
+#else
+  #define MEDIA_OFFSET     0
+  #define FIELD_OFFSET     0
+  #define SLAB_ARGS
+  #define SLAB_PARAMS
+#endif
+
+#ifdef MCX_OUTPUT_ROI
+  #define OUTSIDE_ROI      0xFFFFFFFFu             //a voxel outside of the box of the field
+  #define FIELD_VOXEL(idx) outputvoxel(idx,gcfg)
+#else
+  #define FIELD_VOXEL(idx) ((idx)-FIELD_OFFSET)
+#endif
+
 typedef struct KernelParams {
   float4 ps,c0;
   float4 maxidx;
@@ -64,8 +94,33 @@ typedef struct KernelParams {
   unsigned int detnum;
   unsigned int idx1dorig;
   unsigned int mediaidorig;
+  unsigned int slabstart;      //voxels [slabstart,slabend) are simulated here, the rest are handed over
+  unsigned int slabend;
+  unsigned int mediaoffset;
+  uint4  roi0,roi1;            //voxel box of the tally monitored by -E, inclusive
+  uint4  outroi0,outroidim;    //first voxel and size in cells of the box of the field with -O
+  uint4  outbin;               //voxels of a cell of the field along each axis with -N
+  uint4  reserved;             //keeps the size a multiple of the alignment, the host compiles this struct too
 } MCXParam __attribute__ ((aligned (32)));
 
+#ifdef MCX_MULTI_PROBLEM
+typedef struct ProblemParams {
+  float4 ps,c0;                //source of a packed problem
+  unsigned int idx1dorig;
+  unsigned int mediaidorig;
+  unsigned int threadphoton;   //photons per thread of the problem, the first oddphotons threads run one more
+  unsigned int oddphotons;
+} MCXProblem;
+
+  #define SRC              gsrc                    //the source of the problem of this thread
+  #define SRC_ARGS         ,gsrc
+  #define SRC_PARAMS       ,__constant MCXProblem *gsrc
+#else
+  #define SRC              gcfg
+  #define SRC_ARGS
+  #define SRC_PARAMS
+#endif
+
 
 #ifndef USE_XORSHIFT128P_RAND
 
@@ -243,6 +298,57 @@ void savedetphoton(__global float n_det[],__global uint *detectedphoton,float ns
 }
 #endif
 
+#ifdef MCX_PRECISION_ROI
+int inroi(uint idx1d,__constant MCXParam gcfg[]){
+      uint z=idx1d/gcfg->dimlen.y, y=(idx1d-z*gcfg->dimlen.y)/gcfg->dimlen.x, x=idx1d-z*gcfg->dimlen.y-y*gcfg->dimlen.x;
+      return (x>=gcfg->roi0.x && x<=gcfg->roi1.x && y>=gcfg->roi0.y && y<=gcfg->roi1.y && z>=gcfg->roi0.z && z<=gcfg->roi1.z);
+}
+#endif
+
+#ifdef MCX_OUTPUT_ROI
+/*
+   the index of the cell of a voxel in the box of the field (-O, -N), or
+   OUTSIDE_ROI; the coordinates below the box wrap around to large unsigned
+   values, which stay beyond the box once divided by the cell size
+*/
+uint outputvoxel(uint idx1d,__constant MCXParam gcfg[]){
+      uint z=idx1d/gcfg->dimlen.y, y=(idx1d-z*gcfg->dimlen.y)/gcfg->dimlen.x, x=idx1d-z*gcfg->dimlen.y-y*gcfg->dimlen.x;
+      x=(x-gcfg->outroi0.x)/gcfg->outbin.x;
+      y=(y-gcfg->outroi0.y)/gcfg->outbin.y;
+      z=(z-gcfg->outroi0.z)/gcfg->outbin.z;
+      if(x>=gcfg->outroidim.x || y>=gcfg->outroidim.y || z>=gcfg->outroidim.z)
+          return OUTSIDE_ROI;
+      return (z*gcfg->outroidim.y+y)*gcfg->outroidim.x+x;
+}
+#endif
+
+#ifdef MCX_SLAB_SPLIT
+void handoffphoton(__global float gexport[],__global uint *gexportnum,uint maxhandoff,float4 p[],float4 v[],float4 f[],
+                   uint mediaid,__local float *ppath,__constant MCXParam gcfg[]){
+      uint i, baseaddr=atomic_inc(gexportnum);
+      if(baseaddr<maxhandoff){
+          baseaddr*=MCX_HANDOFF_LEN+gcfg->maxmedia;
+          gexport[baseaddr++]=p[0].x;
+          gexport[baseaddr++]=p[0].y;
+          gexport[baseaddr++]=p[0].z;
+          gexport[baseaddr++]=p[0].w;
+          gexport[baseaddr++]=v[0].x;
+          gexport[baseaddr++]=v[0].y;
+          gexport[baseaddr++]=v[0].z;
+          gexport[baseaddr++]=v[0].w;
+          gexport[baseaddr++]=f[0].x;
+          gexport[baseaddr++]=f[0].y;
+          gexport[baseaddr++]=mediaid;
+          for(i=0;i<gcfg->maxmedia;i++)
+              gexport[baseaddr+i]=(gcfg->savedet ? ppath[i] : 0.f);
+      }
+#ifdef MCX_SAVE_DETECTORS
+      if(gcfg->savedet)
+          clearpath(ppath,gcfg);
+#endif
+}
+#endif
+
 float mcx_nextafterf(float a, int dir){
       union{
           float f;
@@ -258,7 +364,8 @@ float hitgrid(float4 p0[], float4 v[], float4 htime[], int *id){
 
       //time-of-flight to hit the wall in each direction
 
-      htime[0]=fabs(floor(p0[0])+convert_float4(isgreater(v[0],((float4)(0.f))))-p0[0]);
+      //isgreater() returns -1 for true on vector types, so subtract it to step to the upper wall
+      htime[0]=fabs(floor(p0[0])-convert_float4(isgreater(v[0],((float4)(0.f))))-p0[0]);
       htime[0]=fabs(native_divide(htime[0]+(float4)EPS,v[0]));
 
       //get the direction with the smallest time-of-flight
@@ -280,14 +387,14 @@ void rotatevector(float4 v[], float stheta, float ctheta, float sphi, float cphi
       if( v[0].z>-1.f+EPS && v[0].z<1.f-EPS ) {
    	  float tmp0=1.f-v[0].z*v[0].z;
    	  float tmp1=stheta*rsqrt(tmp0);
-   	  *((float4*)v)=(float4)(
+   	  *((float4*)v)=FLOAT4(
    	       tmp1*(v[0].x*v[0].z*cphi - v[0].y*sphi) + v[0].x*ctheta,
    	       tmp1*(v[0].y*v[0].z*cphi + v[0].x*sphi) + v[0].y*ctheta,
    	      -tmp1*tmp0*cphi                          + v[0].z*ctheta,
    	       v[0].w
    	  );
       }else{
-   	  v[0]=(float4)(stheta*cphi,stheta*sphi,(v[0].z>0.f)?ctheta:-ctheta,v[0].w);
+   	  v[0]=FLOAT4(stheta*cphi,stheta*sphi,(v[0].z>0.f)?ctheta:-ctheta,v[0].w);
       }
       GPUDEBUG(((__constant char*)"new dir: %10.5e %10.5e %10.5e\n",v[0].x,v[0].y,v[0].z));
 }
@@ -295,10 +402,13 @@ void rotatevector(float4 v[], float stheta, float ctheta, float sphi, float cphi
 int launchnewphoton(float4 p[],float4 v[],float4 f[],float4 prop[],uint *idx1d,
            uint *mediaid,float *w0,uchar isdet, __local float ppath[],float *energyloss,float *energylaunched,
 	   __global float n_det[],__global uint *dpnum, __constant float4 gproperty[],
-	   __constant float4 gdetpos[],__constant MCXParam gcfg[],int threadid, int threadphoton, int oddphotons){
+	   __constant float4 gdetpos[],__global volatile uint stopsign[],__constant MCXParam gcfg[],
+	   int threadid, int threadphoton, int oddphotons SLAB_PARAMS SRC_PARAMS){
       
       if(p[0].w>=0.f){
           *energyloss+=p[0].w;  // sum all the remaining energy
+          if(get_local_id(0)==0)
+              atomic_inc(stopsign+1);  // progress: one count per completed photon of the first thread of each work-group
 #ifdef MCX_SAVE_DETECTORS
           // let's handle detectors here
           if(gcfg->savedet){
@@ -310,13 +420,36 @@ int launchnewphoton(float4 p[],float4 v[],float4 f[],float4 prop[],uint *idx1d,
 #endif
       }
 
+#ifdef MCX_SLAB_SPLIT
+      if(*importid<nimport){  // resume the photons handed over by the other slabs first
+          __global const float *rec=gimport+(*importid)*(MCX_HANDOFF_LEN+gcfg->maxmedia);
+          p[0]=FLOAT4(rec[0],rec[1],rec[2],rec[3]);
+          v[0]=FLOAT4(rec[4],rec[5],rec[6],rec[7]);
+          f[0]=FLOAT4(rec[8],rec[9],0.f,f[0].w);  // f.w counts the launches of this thread only
+          *idx1d=((int)floor(p[0].z)*gcfg->dimlen.y+(int)floor(p[0].y)*gcfg->dimlen.x+(int)floor(p[0].x));
+          *mediaid=(uint)rec[10];
+          prop[0]=gproperty[*mediaid & MED_MASK];
+          *w0=p[0].w;
+#ifdef MCX_SAVE_DETECTORS
+          if(gcfg->savedet){
+              uint i;
+              for(i=0;i<gcfg->maxmedia;i++)
+                  ppath[i]=rec[MCX_HANDOFF_LEN+i];
+          }
+#endif
+          *importid+=get_global_size(0);
+          return 0;
+      }
+#endif
+      if(stopsign[0])
+         return 1; // the host asked to stop, the photons terminated so far are tallied
       if(f[0].w>=(threadphoton+(threadid<oddphotons)))
          return 1; // all photons complete 
-      p[0]=gcfg->ps;
-      v[0]=gcfg->c0;
-      f[0]=(float4)(0.f,0.f,gcfg->minaccumtime,f[0].w+1);
-      *idx1d=gcfg->idx1dorig;
-      *mediaid=gcfg->mediaidorig;
+      p[0]=SRC->ps;
+      v[0]=SRC->c0;
+      f[0]=FLOAT4(0.f,0.f,gcfg->minaccumtime,f[0].w+1);
+      *idx1d=SRC->idx1dorig;
+      *mediaid=SRC->mediaidorig;
       prop[0]=gproperty[*mediaid & MED_MASK]; //always use mediaid to read gproperty[]
       *energylaunched+=p[0].w;
       *w0=p[0].w;
@@ -329,20 +462,46 @@ int launchnewphoton(float4 p[],float4 v[],float4 f[],float4 prop[],uint *idx1d,
 __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const uchar media[],
      __global float field[], __global float genergy[], __global uint n_seed[],
      __global float n_det[],__constant float4 gproperty[],
-     __constant float4 gdetpos[], __global uint stopsign[1],__global uint detectedphoton[1],
-     __local float *sharedmem, __constant MCXParam gcfg[]){
+     __constant float4 gdetpos[], __global volatile uint stopsign[2],__global uint detectedphoton[1],
+     __local float *sharedmem, __constant MCXParam gcfg[]
+#ifdef MCX_SLAB_SPLIT
+     ,__global const float gimport[],const uint nimport,__global float gexport[],__global uint gexportnum[1],
+     const uint maxhandoff
+#endif
+#ifdef MCX_MULTI_PROBLEM
+     ,__constant MCXProblem gproblem[],const uint nproblem,const uint maxgate
+#endif
+#ifdef MCX_PRECISION_ROI
+     ,__global float gtally[]
+#endif
+     ){
 
      int idx= get_global_id(0);
+     int threadid=idx, threadphoton=nphoton, oddphotons=ophoton;
+
+#ifdef MCX_MULTI_PROBLEM
+     // each packed problem runs on its own range of work-groups, with its own properties and outputs
+     uint nthread=get_global_size(0)/nproblem, pid=idx/nthread;
+     __constant MCXProblem *gsrc=gproblem+pid;
+
+     threadid=idx-pid*nthread;
+     threadphoton=gsrc->threadphoton;
+     oddphotons=gsrc->oddphotons;
+     gproperty+=pid*(gcfg->maxmedia+1);
+     field+=(FieldIndex)pid*gcfg->dimlen.z*maxgate;
+     n_det+=pid*gcfg->maxdetphoton*(gcfg->maxmedia+2);
+     detectedphoton+=pid;
+#endif
 
      float4 p={0.f,0.f,0.f,-1.f};  //{x,y,z}: x,y,z coordinates,{w}:packet weight
-     float4 v=gcfg->c0;  //{x,y,z}: ix,iy,iz unitary direction vector, {w}:total scat event
+     float4 v=SRC->c0;  //{x,y,z}: ix,iy,iz unitary direction vector, {w}:total scat event
      float4 f={0.f,0.f,0.f,0.f};  //f.w can be dropped to save register
      float  energyloss=0.f;
      float  energylaunched=0.f;
 
      uint idx1d, idx1dold;   //idx1dold is related to reflection
 
-     uint   mediaid=gcfg->mediaidorig,mediaidold=0;
+     uint   mediaid=SRC->mediaidorig,mediaidold=0;
      float  w0;
      float  n1;   //reflection var
      float4 htime;            //reflection var
@@ -354,9 +513,15 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
 
      float cphi,sphi,theta,stheta,ctheta,tmp0,tmp1;
      float accumweight=0.f;
+#ifdef MCX_PRECISION_ROI
+     float roiweight=0.f;     //energy deposited in the box of -E by this thread
+#endif
      float slen;
 
      __local float *ppath=sharedmem+get_local_id(0)*gcfg->maxmedia;
+#ifdef MCX_SLAB_SPLIT
+     uint importid=idx;  //the photons handed over to this slab are shared out by thread
+#endif
 
 #ifdef  MCX_SAVE_DETECTORS
      if(gcfg->savedet) clearpath(ppath,gcfg);
@@ -365,13 +530,27 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
      gpu_rng_init(t,n_seed,idx);
 
      if(launchnewphoton(&p,&v,&f,&prop,&idx1d,&mediaid,&w0,0,ppath,
-		      &energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,gcfg,idx,nphoton,ophoton)){
+		      &energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,stopsign,gcfg,threadid,threadphoton,oddphotons SLAB_ARGS SRC_ARGS)){
          n_seed[idx]=NO_LAUNCH;
+#ifdef MCX_PRECISION_ROI
+         gtally[idx]=0.f;
+#endif
          return;
      }
 
-     while(f.w<=nphoton + (idx<ophoton)) {
+     while(f.w<=threadphoton + (threadid<oddphotons)) {
 
+#ifdef MCX_SLAB_SPLIT
+          if(idx1d<gcfg->slabstart || idx1d>=gcfg->slabend){ // entered another slab, hand it over to its device
+              handoffphoton(gexport,gexportnum,maxhandoff,&p,&v,&f,mediaid,ppath,gcfg);
+              p.w=-1.f;  // the remaining weight is counted where the photon terminates
+              if(launchnewphoton(&p,&v,&f,&prop,&idx1d,&mediaid,&w0,0,ppath,
+                  &energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,stopsign,gcfg,threadid,threadphoton,oddphotons SLAB_ARGS SRC_ARGS)){
+                  break;
+              }
+              continue;
+          }
+#endif
           GPUDEBUG(((__constant char*)"photonid [%d] L=%f w=%e medium=%d\n",(int)f.w,f.x,p.w,mediaid));
 
 	  if(f.x<=0.f) {  // if this photon has finished the current jump
@@ -432,14 +611,14 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
 	      ppath[(mediaid & MED_MASK)-1]+=f.z; //(unit=grid)
 #endif
 
-          mediaidold=media[idx1d];
+          mediaidold=media[idx1d-MEDIA_OFFSET];
           idx1dold=idx1d;
           idx1d=((int)floor(p.z)*gcfg->dimlen.y+(int)floor(p.y)*gcfg->dimlen.x+(int)floor(p.x));
           GPUDEBUG(((__constant char*)"idx1d [%d]->[%d]\n",idx1dold,idx1d));
           if(any(isless(p.xyz,(float3)(0.f))) || any(isgreater(p.xyz,(gcfg->maxidx.xyz)))){
 	      mediaid=0;	
 	  }else{
-              mediaid=media[idx1d] & MED_MASK;
+              mediaid=media[idx1d-MEDIA_OFFSET] & MED_MASK;
           }
           GPUDEBUG(((__constant char*)"medium [%d]->[%d]\n",mediaidold,mediaid));
 
@@ -447,21 +626,32 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
              GPUDEBUG(((__constant char*)"field add to %d->%f(%d)\n",idx1dold,w0-p.w,(int)f.w));
              // if t is within the time window, which spans cfg->maxgate*cfg->tstep wide
              if(gcfg->save2pt && f.y>=gcfg->twin0 && f.y<gcfg->twin1){
+                  uint fieldvoxel=FIELD_VOXEL(idx1dold);
                   GPUDEBUG(((__constant char*)"deposit to [%d] %e, w=%f\n",idx1dold,w0-p.w,p.w));
+#ifdef MCX_OUTPUT_ROI
+                  if(fieldvoxel!=OUTSIDE_ROI){  //only the box of -O is tallied
+#endif
 #ifndef USE_ATOMIC
                   // set gcfg->skipradius2 to only start depositing energy when dist^2>gcfg->skipradius2 
                   if(gcfg->skipradius2>EPS){
-                      if((p.x-gcfg->ps.x)*(p.x-gcfg->ps.x)+(p.y-gcfg->ps.y)*(p.y-gcfg->ps.y)+(p.z-gcfg->ps.z)*(p.z-gcfg->ps.z)>gcfg->skipradius2){
-                          field[idx1dold+(int)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=w0-p.w;
+                      if((p.x-SRC->ps.x)*(p.x-SRC->ps.x)+(p.y-SRC->ps.y)*(p.y-SRC->ps.y)+(p.z-SRC->ps.z)*(p.z-SRC->ps.z)>gcfg->skipradius2){
+                          field[fieldvoxel+(FieldIndex)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=w0-p.w;
                       }else{
                           accumweight+=p.w*prop.x; // weight*absorption
                       }
                   }else{
-                      field[idx1dold+(int)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=w0-p.w;
+                      field[fieldvoxel+(FieldIndex)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=w0-p.w;
                   }
 #else
-		  atomicadd(& field[idx1dold+(int)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z], w0-p.w);
+		  atomicadd(& field[fieldvoxel+(FieldIndex)(floor((f.y-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z], w0-p.w);
                   GPUDEBUG(((__constant char*)"atomic write to [%d] %e, w=%f\n",idx1dold,weight,p.w));
+#endif
+#ifdef MCX_OUTPUT_ROI
+                  }
+#endif
+#ifdef MCX_PRECISION_ROI
+                  if(inroi(idx1dold,gcfg))
+                      roiweight+=w0-p.w;
 #endif
 	     }
 	     w0=p.w;
@@ -470,7 +660,7 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
           if((mediaid==0 && (!gcfg->doreflect || (gcfg->doreflect && n1==gproperty[mediaid].w))) || f.y>gcfg->twin1){
                   GPUDEBUG(((__constant char*)"direct relaunch at idx=[%d] mediaid=[%d], ref=[%d]\n",idx1d,mediaid,gcfg->doreflect));
 		  if(launchnewphoton(&p,&v,&f,&prop,&idx1d,&mediaid,&w0,(mediaidold & DET_MASK),ppath,
-		      &energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,gcfg,idx,nphoton,ophoton)){ 
+		      &energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,stopsign,gcfg,threadid,threadphoton,oddphotons SLAB_ARGS SRC_ARGS)){ 
                          break;
 		  }
                   continue;
@@ -502,7 +692,7 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
                         if(mediaid==0){ // transmission to external boundary
                             GPUDEBUG(((__constant char*)"transmit to air, relaunch\n"));
 		    	    if(launchnewphoton(&p,&v,&f,&prop,&idx1d,&mediaid,&w0,(mediaidold & DET_MASK),
-			        ppath,&energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,gcfg,idx,nphoton,ophoton)){
+			        ppath,&energyloss,&energylaunched,n_det,detectedphoton,gproperty,gdetpos,stopsign,gcfg,threadid,threadphoton,oddphotons SLAB_ARGS SRC_ARGS)){
                                     break;
 			    }
 			    continue;
@@ -530,7 +720,7 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
 				(p.z=nextafter(convert_int_rte(p.z), p.z+(v.z > 0.f)-0.5f)) );
 	                GPUDEBUG(((__constant char*)"ref p_new=[%f %f %f] v_new=[%f %f %f]\n",p.x,p.y,p.z,v.x,v.y,v.z));
                 	idx1d=idx1dold;
-		 	mediaid=(media[idx1d] & MED_MASK);
+		 	mediaid=(media[idx1d-MEDIA_OFFSET] & MED_MASK);
 			prop=gproperty[mediaid];
 			n1=prop.w;
 		  }
@@ -546,5 +736,45 @@ __kernel void mcx_main_loop(const int nphoton, const int ophoton,__global const
 
      genergy[idx<<1]=energyloss;
      genergy[(idx<<1)+1]=energylaunched;
+#ifdef MCX_PRECISION_ROI
+     gtally[idx]=roiweight;
+#endif
+}
+
+/*
+   with -V, the photons a launch has actually launched, summed from the
+   per-thread counts of genergy by one work-group (a power of 2): each
+   work-item adds a strided share, then the shares are halved in local
+   memory; a stopped launch launches fewer photons than planned
+*/
+__kernel void mcx_sum_launched(__global const float genergy[],__global float launched[],const uint nthread,__local float partial[]){
+     uint tid=get_local_id(0), nlocal=get_local_size(0), i;
+     float sum=0.f;
+
+     for(i=tid;i<nthread;i+=nlocal)
+         sum+=genergy[(i<<1)+1];
+     partial[tid]=sum;
+     for(i=nlocal>>1;i>0;i>>=1){
+         barrier(CLK_LOCAL_MEM_FENCE);
+         if(tid<i)
+             partial[tid]+=partial[tid+i];
+     }
+     if(tid==0)
+         launched[0]=partial[0];
+}
+
+/*
+   with -V, the field of a launch of nphoton photons is added to the field
+   of the run and its square, divided by nphoton, to the second moment;
+   the launch field is cleared for the next launch
+*/
+__kernel void mcx_add_moment(__global float batch[],__global float field[],__global float moment[],__global const float launched[]){
+     size_t idx=get_global_id(0);
+     float x=batch[idx], nphoton=launched[0];
+
+     field[idx]+=x;
+     if(nphoton>0.f)  //a launch stopped before its first photon deposits nothing
+         moment[idx]+=x*x/nphoton;
+     batch[idx]=0.f;
 }
 
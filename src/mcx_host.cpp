@@ -16,11 +16,20 @@
 *******************************************************************************/
 
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <time.h>
 #include <ctype.h>
 #include <math.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#else
+  #define omp_get_thread_num()   0
+  #define omp_get_num_threads()  1
+#endif
 #include "mcx_host.hpp"
 #include "tictoc.h"
 #include "mcx_const.h"
@@ -94,7 +103,7 @@ void ocl_assess(int cuerr,const char *file,const int linenum){
 /*
   query GPU info and set active GPU
 */
-cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *activedevlist){
+cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *activedevlist,cl_platform_id *activeplatformlist){
 
     uint i,j,k,cuid=0,devnum;
     cl_uint numPlatforms,devparam,clockspeed;
@@ -133,13 +142,12 @@ cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *ac
                     OCL_ASSERT((clGetContextInfo(context,CL_CONTEXT_DEVICES,deviceListSize,devices,NULL)));
 		    devnum=deviceListSize/sizeof(cl_device_id);
                     for(k=0;k<devnum;k++){
-		         if(cfg->deviceid[cuid++]=='1'){
+		         if(cfg->deviceid[cuid++]=='1' && *activedev<MAX_DEVICE){
+				if(activeplatformlist)
+					activeplatformlist[*activedev]=platform;
 				activedevlist[(*activedev)++]=devices[k];
-				if(activeplatform && activeplatform!=platform){
-					fprintf(stderr,"Error: one can not mix devices between different platforms\n");
-					exit(-1);
-				}
-				activeplatform=platform;
+				if(activeplatform==NULL)
+					activeplatform=platform;
                           }
 			  if(cfg->isgpuinfo){
         	        	OCL_ASSERT((clGetDeviceInfo(devices[k],CL_DEVICE_NAME,100,(void*)&pbuf,NULL)));
@@ -163,56 +171,437 @@ cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *ac
         }
         free(platforms);
     }
-    if(cfg->isgpuinfo==2) exit(0);
+    if(cfg->isgpuinfo==2){
+        mcx_infoonly("-L");
+        exit(0);
+    }
     return activeplatform;
 }
 
 
 /*
-   master driver code to run MC simulations
+   64bit FNV-1a hash, used to tag the tuned launch sizes by kernel and device
 */
-void mcx_run_simulation(Config *cfg,float *fluence,float *totalenergy){
+cl_ulong mcx_hash(cl_ulong hash,const char *str){
+     if(hash==0)
+         hash=0xcbf29ce484222325ULL;
+     while(str && *str){
+         hash^=(unsigned char)(*str++);
+         hash*=0x100000001b3ULL;
+     }
+     return hash;
+}
+
+
+/*
+   path of the tuning cache, one line per kernel/device: hash nthread nblocksize speed name;
+   returns 0 when the path does not fit in the len bytes of fname, the cache is then not used
+*/
+int mcx_tunefile(char *fname,size_t len){
+     const char *home=getenv("HOME");
+     int n;
+     if(home==NULL)
+         home=getenv("USERPROFILE");
+     n=snprintf(fname,len,"%s/%s",(home ? home : "."),MCX_TUNE_FILE);
+     return (n>0 && (size_t)n<len);
+}
+
+
+/*
+   look up the launch size of a device in the tuning cache, the last record wins
+*/
+int mcx_loadtune(cl_ulong key,size_t *nthread,size_t *nblock){
+     char fname[MAX_PATH_LENGTH], line[MAX_PATH_LENGTH];
+     unsigned long long hash;
+     unsigned long thread,block;
+     int found=0;
+     FILE *fp;
+
+     if(!mcx_tunefile(fname,sizeof(fname)) || (fp=fopen(fname,"rt"))==NULL)
+         return 0;
+     while(fgets(line,MAX_PATH_LENGTH,fp)){
+         if(sscanf(line,"%llx %lu %lu",&hash,&thread,&block)==3 && hash==key && thread>0 && block>0){
+             *nthread=thread;
+             *nblock=block;
+             found=1;
+         }
+     }
+     fclose(fp);
+     return found;
+}
+
+
+void mcx_savetune(cl_ulong key,size_t nthread,size_t nblock,float speed,const char *devname){
+     char fname[MAX_PATH_LENGTH];
+     FILE *fp;
+
+     if(!mcx_tunefile(fname,sizeof(fname)) || (fp=fopen(fname,"at"))==NULL)
+         return;
+     fprintf(fp,"%016llx %lu %lu %.2f %s\n",(unsigned long long)key,(unsigned long)nthread,
+             (unsigned long)nblock,speed,devname);
+     fclose(fp);
+}
+
 
-     cl_uint i,j,iter;
+/*
+   create a kernel bound to scratch buffers, so that the calibration launches
+   leave the simulation untouched; maxthread is the largest launch to support
+*/
+cl_kernel mcx_tunekernel(Config *cfg,cl_context context,cl_command_queue queue,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,size_t maxthread,cl_mem *scratch){
+     cl_uint detected=0,stopsign[2]={0,0};
+     size_t dimxyz=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z;
+     cl_int status=0;
+     cl_kernel kernel;
+     cl_float *buf;
+     cl_uint  *seed;
+     float4 nodet={0.f,0.f,0.f,0.f};
+     size_t buflen,i;
+
+     buflen=MAX((size_t)dimxyz*cfg->maxgate,(size_t)cfg->maxdetphoton*(cfg->medianum+1));
+     buflen=MAX(buflen,maxthread*RAND_SEED_LEN);
+     buf=(cl_float *)calloc(buflen,sizeof(cl_float));
+     seed=(cl_uint *)buf;
+     for(i=0;i<maxthread*RAND_SEED_LEN;i++)
+         seed[i]=(i+1)*2654435761U;  /*fixed seeds, do not consume the host RNG*/
+     OCL_ASSERT(((scratch[0]=clCreateBuffer(context,RW_MEM, sizeof(cl_uint)*maxthread*RAND_SEED_LEN,seed,&status),status)));
+     memset(buf,0,buflen*sizeof(cl_float));
+     OCL_ASSERT(((scratch[1]=clCreateBuffer(context,RW_MEM, sizeof(cl_float)*dimxyz*cfg->maxgate,buf,&status),status)));
+     OCL_ASSERT(((scratch[2]=clCreateBuffer(context,RW_MEM, sizeof(float)*cfg->maxdetphoton*(cfg->medianum+1),buf,&status),status)));
+     OCL_ASSERT(((scratch[3]=clCreateBuffer(context,RW_MEM, sizeof(float)*maxthread*2,buf,&status),status)));
+     OCL_ASSERT(((scratch[4]=clCreateBuffer(context,RW_MEM, sizeof(stopsign),stopsign,&status),status)));
+     OCL_ASSERT(((scratch[5]=clCreateBuffer(context,RW_MEM, sizeof(cl_uint),&detected,&status),status)));
+     OCL_ASSERT(((scratch[6]=clCreateBuffer(context,RO_MEM, MAX(cfg->detnum,1)*sizeof(float4),(cfg->detnum ? (void*)cfg->detpos : (void*)&nodet),&status),status)));
+     OCL_ASSERT(((scratch[7]=clCreateBuffer(context,RW_MEM, sizeof(float)*maxthread,buf,&status),status)));
+     free(buf);
+
+     param->twin0=cfg->tstart;
+     param->twin1=cfg->tstart+cfg->tstep*cfg->maxgate;
+     OCL_ASSERT((clEnqueueWriteBuffer(queue,gparam,CL_TRUE,0,sizeof(MCXParam),param, 0, NULL, NULL)));
+
+     OCL_ASSERT(((kernel=clCreateKernel(program, "mcx_main_loop", &status),status)));
+     OCL_ASSERT((clSetKernelArg(kernel, 2, sizeof(cl_mem), (void*)&gmedia)));
+     OCL_ASSERT((clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)(scratch+1))));
+     OCL_ASSERT((clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)(scratch+3))));
+     OCL_ASSERT((clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*)(scratch+0))));
+     OCL_ASSERT((clSetKernelArg(kernel, 6, sizeof(cl_mem), (void*)(scratch+2))));
+     OCL_ASSERT((clSetKernelArg(kernel, 7, sizeof(cl_mem), (void*)&gproperty)));
+     OCL_ASSERT((clSetKernelArg(kernel, 8, sizeof(cl_mem), (void*)(scratch+6))));
+     OCL_ASSERT((clSetKernelArg(kernel, 9, sizeof(cl_mem), (void*)(scratch+4))));
+     OCL_ASSERT((clSetKernelArg(kernel,10, sizeof(cl_mem), (void*)(scratch+5))));
+     OCL_ASSERT((clSetKernelArg(kernel,12, sizeof(cl_mem), (void*)&gparam)));
+     if(cfg->precision>0.f && cfg->precbox[0]>=0.f)
+         OCL_ASSERT((clSetKernelArg(kernel,13, sizeof(cl_mem), (void*)(scratch+7))));
+     return kernel;
+}
+
+
+void mcx_tunerelease(cl_kernel kernel,cl_mem *scratch){
+     int i;
+     for(i=0;i<MCX_TUNE_BUFNUM;i++)
+         clReleaseMemObject(scratch[i]);
+     clReleaseKernel(kernel);
+}
+
+
+/*
+   time one calibration launch of mcx_main_loop, returns photon/ms
+*/
+float mcx_tunelaunch(cl_command_queue queue,cl_kernel kernel,size_t nthread,size_t nblock,
+                     cl_uint nphoton,cl_uint maxmedia,int issavedet){
+     cl_uint threadphoton=nphoton/nthread, oddphotons=nphoton-threadphoton*nthread;
+     cl_ulong tstart,tend;
+     cl_event ev;
+
+     OCL_ASSERT((clSetKernelArg(kernel, 0, sizeof(cl_uint),(void*)&threadphoton)));
+     OCL_ASSERT((clSetKernelArg(kernel, 1, sizeof(cl_uint),(void*)&oddphotons)));
+     OCL_ASSERT((clSetKernelArg(kernel,11, issavedet? sizeof(cl_float)*nblock*maxmedia : 1, NULL)));
+     OCL_ASSERT((clEnqueueNDRangeKernel(queue,kernel,1,NULL,&nthread,&nblock, 0, NULL, &ev)));
+     OCL_ASSERT((clWaitForEvents(1,&ev)));
+     OCL_ASSERT((clGetEventProfilingInfo(ev,CL_PROFILING_COMMAND_START,sizeof(cl_ulong),&tstart,NULL)));
+     OCL_ASSERT((clGetEventProfilingInfo(ev,CL_PROFILING_COMMAND_END,sizeof(cl_ulong),&tend,NULL)));
+     clReleaseEvent(ev);
+     return nphoton/((tend-tstart)*1e-6f+EPS);
+}
+
+
+/*
+   choose the launch size of a device: the work-group size is searched among
+   the multiples of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE that leave
+   room for ppath in the local memory, then the total thread number among
+   1 to MCX_TUNE_MAXWAVE work-groups per compute unit; each candidate is
+   timed with a short launch on scratch buffers, the fastest one is cached
+*/
+void mcx_tune_device(Config *cfg,cl_context context,cl_command_queue queue,cl_device_id dev,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,cl_ulong key,
+                     size_t *nthread,size_t *nblock,float *speed){
+     cl_uint cucount,i,nphoton;
+     cl_ulong devlocal,kernlocal;
+     size_t maxblock,multiple,block,thread,bestblock,bestthread;
+     float rate,bestspeed=0.f;
+     char devname[MAX_SESSION_LENGTH]={'\0'};
+     cl_int status=0;
+     cl_kernel kernel;
+     cl_mem scratch[MCX_TUNE_BUFNUM];
+
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DEVICE_NAME,MAX_SESSION_LENGTH,(void*)devname,NULL)));
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DEVICE_MAX_COMPUTE_UNITS,sizeof(cl_uint),(void*)&cucount,NULL)));
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DEVICE_LOCAL_MEM_SIZE,sizeof(cl_ulong),(void*)&devlocal,NULL)));
+     OCL_ASSERT(((kernel=clCreateKernel(program, "mcx_main_loop", &status),status)));
+     OCL_ASSERT((clSetKernelArg(kernel,11,1,NULL)));
+     OCL_ASSERT((clGetKernelWorkGroupInfo(kernel,dev,CL_KERNEL_WORK_GROUP_SIZE,sizeof(size_t),&maxblock,NULL)));
+     OCL_ASSERT((clGetKernelWorkGroupInfo(kernel,dev,CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,sizeof(size_t),&multiple,NULL)));
+     OCL_ASSERT((clGetKernelWorkGroupInfo(kernel,dev,CL_KERNEL_LOCAL_MEM_SIZE,sizeof(cl_ulong),&kernlocal,NULL)));
+     clReleaseKernel(kernel);
+
+     if(multiple==0 || multiple>maxblock)
+         multiple=maxblock;
+     nphoton=(cl_uint)MAX(MIN(cfg->nphoton/cfg->respin,(size_t)MCX_TUNE_PHOTON),multiple);
+
+     kernel=mcx_tunekernel(cfg,context,queue,program,gmedia,gproperty,gparam,param,MCX_TUNE_PHOTON,scratch);
+
+     fprintf(cfg->flog,"- [%s] auto-tuning launch size with %d photons per launch\n",devname,nphoton);
+
+     /*warm-up launch, the first launch may include one-time driver costs*/
+     mcx_tunelaunch(queue,kernel,multiple,multiple,multiple,param->maxmedia,cfg->issavedet);
+
+     /*pass 1: work-group size, at MCX_TUNE_MAXWAVE/4 work-groups per compute unit*/
+     bestblock=multiple;
+     for(block=multiple;block<=maxblock;block<<=1){
+         if(cfg->issavedet && kernlocal+sizeof(cl_float)*block*param->maxmedia>devlocal)
+             break;
+         thread=MIN(cucount*block*(MCX_TUNE_MAXWAVE>>2),MCX_TUNE_PHOTON/block*block);
+         rate=mcx_tunelaunch(queue,kernel,thread,block,nphoton,param->maxmedia,cfg->issavedet);
+         if(cfg->isverbose)
+             fprintf(cfg->flog,"\tnthread=%lu nblocksize=%lu: %.2f photon/ms\n",(unsigned long)thread,(unsigned long)block,rate);
+         if(rate>bestspeed){
+             bestspeed=rate;
+             bestblock=block;
+         }
+     }
+     /*pass 2: total thread number*/
+     bestspeed=0.f;
+     bestthread=bestblock;
+     for(i=1;i<=MCX_TUNE_MAXWAVE;i<<=1){
+         thread=cucount*bestblock*i;
+         if(thread>nphoton || thread>MCX_TUNE_PHOTON)
+             break;
+         rate=mcx_tunelaunch(queue,kernel,thread,bestblock,nphoton,param->maxmedia,cfg->issavedet);
+         if(cfg->isverbose)
+             fprintf(cfg->flog,"\tnthread=%lu nblocksize=%lu: %.2f photon/ms\n",(unsigned long)thread,(unsigned long)bestblock,rate);
+         if(rate>bestspeed){
+             bestspeed=rate;
+             bestthread=thread;
+         }
+     }
+     *nthread=bestthread;
+     *nblock=bestblock;
+     fprintf(cfg->flog,"- [%s] tuned nthread=%lu nblocksize=%lu (%.2f photon/ms)\n",devname,
+             (unsigned long)bestthread,(unsigned long)bestblock,bestspeed);
+     mcx_savetune(key,bestthread,bestblock,bestspeed,devname);
+     if(speed)
+         *speed=bestspeed;
+
+     mcx_tunerelease(kernel,scratch);
+}
+
+
+/*
+   measure the speed (photon/ms) of a device on this problem with one short launch
+*/
+float mcx_calibrate_device(Config *cfg,cl_context context,cl_command_queue queue,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,
+                     size_t nthread,size_t nblock,cl_uint nphoton){
+     cl_mem scratch[MCX_TUNE_BUFNUM];
+     cl_kernel kernel;
+     float speed;
+
+     kernel=mcx_tunekernel(cfg,context,queue,program,gmedia,gproperty,gparam,param,nthread,scratch);
+     mcx_tunelaunch(queue,kernel,nblock,nblock,nblock,param->maxmedia,cfg->issavedet);
+     speed=mcx_tunelaunch(queue,kernel,nthread,nblock,MAX(nphoton,nthread),param->maxmedia,cfg->issavedet);
+     mcx_tunerelease(kernel,scratch);
+     return speed;
+}
+
+
+/*
+   launch size of each device: -t/-T when given, otherwise the tuning cache or a new
+   calibration; speed is set to the measured photon/ms if the device was tuned now
+*/
+void mcx_launchsize(Config *cfg,cl_context context,cl_command_queue queue,cl_device_id dev,cl_program program,
+                     const char *opt,cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,
+                     size_t *nthread,size_t *nblock,float *speed){
+     char pbuf[MAX_SESSION_LENGTH]={'\0'};
+     cl_ulong key;
+     cl_uint cucount;
+
+     *speed=0.f;
+     if(cfg->nthread>0 && cfg->autotune<2){
+         *nblock=cfg->nblocksize;
+         *nthread=(cfg->nthread+cfg->nblocksize-1)/cfg->nblocksize*cfg->nblocksize;
+         if(*nthread!=cfg->nthread)
+             fprintf(cfg->flog,"WARNING: nthread (%d) is rounded up to %lu, a multiple of the block size %d\n",
+                     cfg->nthread,(unsigned long)*nthread,cfg->nblocksize);
+         return;
+     }
+     key=mcx_hash(0,cfg->clsource);
+     key=mcx_hash(key,opt);
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DEVICE_NAME,MAX_SESSION_LENGTH,(void*)pbuf,NULL)));
+     key=mcx_hash(key,pbuf);
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DRIVER_VERSION,MAX_SESSION_LENGTH,(void*)pbuf,NULL)));
+     key=mcx_hash(key,pbuf);
+
+     if(cfg->autotune==1 && mcx_loadtune(key,nthread,nblock))
+         return;
+     if(cfg->autotune){
+         mcx_tune_device(cfg,context,queue,dev,program,gmedia,gproperty,gparam,param,key,nthread,nblock,speed);
+         return;
+     }
+     /*no tuning: fill every compute unit with MCX_TUNE_MAXWAVE/4 work-groups of -T threads*/
+     OCL_ASSERT((clGetDeviceInfo(dev,CL_DEVICE_MAX_COMPUTE_UNITS,sizeof(cl_uint),(void*)&cucount,NULL)));
+     *nblock=cfg->nblocksize;
+     *nthread=cucount*cfg->nblocksize*(MCX_TUNE_MAXWAVE>>2);
+}
+
+
+/*
+   plan the memory of the run: the footprint of every device buffer is
+   computed from CL_DEVICE_GLOBAL_MEM_SIZE and CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+   and the gate group (-g) is set to the largest one that fits all devices
+   when -g is 0, or lowered when the given one does not fit; the thread
+   number is bounded by the largest launch the tuning may pick, and the
+   field, properties and detected photons are kept once per packed run
+*/
+void mcx_plan_memory(Config *cfg,cl_device_id *devices,cl_uint workdev,int issplit,cl_uint *slab0,cl_uint *slab1,
+                     char *devzerocopy,cl_uint npack){
+     cl_uint i, cucount, gates=(cl_uint)((cfg->tend-cfg->tstart)/cfg->tstep+0.5f), maxgate, nwindow=0, nfield;
+     cl_ulong globalmem, maxalloc, budget, fieldgate[MAX_DEVICE], fixed[MAX_DEVICE], mediasize[MAX_DEVICE];
+     size_t layer=(size_t)cfg->dim.x*cfg->dim.y, dimxyz=layer*cfg->dim.z, maxwg, nthread, handoff=0, outlen;
+     double hostout, hostcopy=0.0, hoststage=0.0;
+     float t;
+     int isstream;
+     cl_uint lo[3], len[3];
+
+     outlen=(cfg->issave2pt ? mcx_outputbox(cfg,lo,len) : dimxyz);  //the field of a time gate, the whole volume unless -O or -N is given
+
+     if(gates<1)
+         gates=1;
+     maxgate=gates;
+     if(issplit)
+         handoff=(size_t)MIN((cfg->nphoton+cfg->respin-1)/cfg->respin,(size_t)MCX_MAX_HANDOFF)*(MCX_HANDOFF_LEN+cfg->medianum-1)*sizeof(float);
+     for(i=0;i<workdev;i++){
+         cl_ulong g;
+         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_GLOBAL_MEM_SIZE,sizeof(cl_ulong),(void*)&globalmem,NULL)));
+         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_MAX_MEM_ALLOC_SIZE,sizeof(cl_ulong),(void*)&maxalloc,NULL)));
+         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_MAX_COMPUTE_UNITS,sizeof(cl_uint),(void*)&cucount,NULL)));
+         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(size_t),(void*)&maxwg,NULL)));
+         if(cfg->nthread>0 && cfg->autotune<2)
+             nthread=(cfg->nthread+cfg->nblocksize-1)/cfg->nblocksize*cfg->nblocksize;
+         else if(cfg->autotune)
+             nthread=MIN((size_t)cucount*maxwg*MCX_TUNE_MAXWAVE,(size_t)MCX_TUNE_PHOTON);
+         else
+             nthread=(size_t)cucount*cfg->nblocksize*(MCX_TUNE_MAXWAVE>>2);
+
+         fieldgate[i]=sizeof(cl_float)*(issplit ? (slab1[i]-slab0[i])*layer : outlen)*npack;
+         if(cfg->issavese && !issplit && npack<2)  //-V adds the field of the current launch and the second moment
+             fieldgate[i]*=3;
+         mediasize[i]=sizeof(cl_uchar)*(issplit ? (MIN(slab1[i]+1,cfg->dim.z)-(slab0[i] ? slab0[i]-1 : 0))*layer : dimxyz);
+         fixed[i]=mediasize[i]+npack*cfg->medianum*sizeof(Medium)+sizeof(MCXParam)+cfg->detnum*sizeof(cl_float4)+sizeof(cl_uint)
+                 +MCX_BUFNUM*(nthread*(RAND_SEED_LEN+2)*sizeof(cl_uint)+npack*((size_t)cfg->maxdetphoton*(cfg->medianum+1)*sizeof(float)+sizeof(cl_uint)))
+                 +2*handoff+sizeof(cl_uint)+npack*sizeof(MCXProblem);
+         budget=(cl_ulong)(globalmem*MCX_MEM_USABLE);
+         if(mediasize[i]>maxalloc || fixed[i]+fieldgate[i]>budget)
+             mcx_error(-1,(char*)(issplit ? "a slab does not fit in the device memory, please add devices"
+                                         : "the volume does not fit in the device memory, please use -X 1 with several devices"),__FILE__,__LINE__);
+         g=MIN((budget-fixed[i])/fieldgate[i],maxalloc/fieldgate[i]);
+         if(g<gates && !issplit && npack<2)  //several time windows keep two fields, one is read back while the next is simulated
+             g=MIN((budget-fixed[i])/(2*fieldgate[i]),maxalloc/fieldgate[i]);
+         maxgate=MIN(maxgate,(cl_uint)MAX(g,(cl_ulong)1));
+     }
+     if(cfg->maxgate==0){
+         cfg->maxgate=maxgate;
+         fprintf(cfg->flog,"- gate group (-g) is set to %d of %d gates\n",maxgate,gates);
+     }else if(cfg->maxgate>maxgate){
+         fprintf(cfg->flog,"WARNING: the gate group (-g %d) does not fit in the device memory, it is lowered to %d\n",
+                 cfg->maxgate,maxgate);
+         cfg->maxgate=maxgate;
+     }
+
+     for(t=cfg->tstart;t<cfg->tend;t+=cfg->tstep*cfg->maxgate)
+         nwindow++;
+     nfield=(nwindow>1 && !issplit && npack<2 ? MCX_BUFNUM : 1);
+     isstream=(nwindow>1 && npack<2 && cfg->issave2pt && cfg->parentid==mpStandalone);
+     for(i=0;i<workdev;i++){
+         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_GLOBAL_MEM_SIZE,sizeof(cl_ulong),(void*)&globalmem,NULL)));
+         fprintf(cfg->flog,"- [device %d] memory plan: %.1f of %.1f MB (media %.1f, field %.1f x%d, other %.1f)\n",i,
+             (fixed[i]+(double)fieldgate[i]*cfg->maxgate*nfield)/MCX_MB,globalmem/MCX_MB,mediasize[i]/MCX_MB,
+             (double)fieldgate[i]*cfg->maxgate/MCX_MB,nfield,(fixed[i]-mediasize[i])/MCX_MB);
+         if(cfg->issave2pt && !issplit && !devzerocopy[i])
+             hoststage+=(double)fieldgate[i]*cfg->maxgate*nfield;
+     }
+     hostout=(cfg->issave2pt ? (double)outlen*cfg->maxgate*sizeof(float)*(isstream ? MCX_WRITER_SLOT+(issplit>0) : (cfg->issavese ? 2 : 1)) : 0.0)
+            +(cfg->issavedet ? (double)cfg->maxdetphoton*(cfg->medianum+1)*sizeof(float) : 0.0);
+     if(npack>1){  //the packed runs are read back together, then kept until they are saved
+         hostout*=npack;
+         hoststage=(cfg->issave2pt ? (double)outlen*cfg->maxgate*sizeof(float)*npack : 0.0);
+     }else if(issplit)
+         hoststage=(cfg->issave2pt ? (double)dimxyz*cfg->maxgate*sizeof(float) : 0.0)+(double)(workdev+1)*handoff;
+     else if(workdev>1 && cfg->issave2pt && !isstream)
+         hostcopy=(double)workdev*outlen*cfg->maxgate*sizeof(float);
+     fprintf(cfg->flog,"- host memory plan: output %.1f MB, per-device fields %.1f MB, read-back %.1f MB\n",
+         hostout/MCX_MB,hostcopy/MCX_MB,hoststage/MCX_MB);
+}
+
+
+/*
+   split the photons of one repetition by the relative workload of a device,
+   returns the number of photons the device will launch; the split is done
+   in double as the total may exceed 2^32, but the count of each thread must
+   stay below MCX_MAX_THREADPHOTON, the kernel counts it in a float
+*/
+cl_ulong mcx_setphoton(Config *cfg,cl_kernel kernel,size_t nthread,float load,float fullload){
+     cl_int threadphoton, oddphotons;
+     double devphoton=(double)cfg->nphoton*load/((double)fullload*cfg->respin);
+
+     if(devphoton/nthread+1.0>=MCX_MAX_THREADPHOTON)
+         mcx_error(-1,(char*)"too many photons per thread, please increase the repetition number (-r)",__FILE__,__LINE__);
+     threadphoton=(cl_int)(devphoton/nthread);
+     oddphotons=(cl_int)(devphoton-(double)threadphoton*nthread);
+     OCL_ASSERT((clSetKernelArg(kernel, 0, sizeof(cl_uint),(void*)&threadphoton)));
+     OCL_ASSERT((clSetKernelArg(kernel, 1, sizeof(cl_uint),(void*)&oddphotons)));
+     return (cl_ulong)threadphoton*nthread+oddphotons;
+}
+
+
+/*
+   set up the OpenCL state of a run: list the devices, create the contexts
+   and queues, plan the memory, upload the media, build the kernel, pick the
+   launch sizes and create the buffers and kernels; nothing here depends on
+   the source, the optical properties or the photon number of a sweep run
+   beyond the initial tuning
+*/
+void mcx_init_session(MCXSession *ses,Config *cfg){
+
+     cl_uint i,j,k;
      cl_float  minstep=MIN(MIN(cfg->steps.x,cfg->steps.y),cfg->steps.z);
-     cl_float t,twindow0,twindow1;
-     cl_float fullload=0.f;
-     cl_float *energy;
-     cl_int stopsign=0;
-     cl_uint detected=0,workdev;
 
-     cl_uint tic,tic0,tic1,toc=0,fieldlen;
+     cl_uint tic;
      cl_uint4 cp0={{cfg->crop0.x,cfg->crop0.y,cfg->crop0.z,cfg->crop0.w}};
      cl_uint4 cp1={{cfg->crop1.x,cfg->crop1.y,cfg->crop1.z,cfg->crop1.w}};
      cl_uint2 cachebox;
      cl_uint4 dimlen;
 
-     cl_context mcxcontext;                 // compute mcxcontext
-     cl_command_queue *mcxqueue;          // compute command queue
-     cl_program mcxprogram;                 // compute mcxprogram
-     cl_kernel *mcxkernel;                   // compute mcxkernel
      cl_int status = 0;
      cl_device_id devices[MAX_DEVICE];
-     cl_event * waittoread;
-     cl_platform_id platform = NULL;
-
-     cl_uint *cucount,totalcucore;
+     cl_platform_id platforms[MAX_DEVICE], devplatform[MAX_DEVICE];
      cl_uint  devid=0;
-     cl_mem gmedia,gproperty,gparam;
-     cl_mem *gfield,*gdetphoton,*gseed,*genergy;
-     cl_mem *gstopsign,*gdetected,*gdetpos;
-
-     size_t mcgrid[1], mcblock[1];
-
-     cl_uint dimxyz=cfg->dim.x*cfg->dim.y*cfg->dim.z;
 
      cl_uchar  *media=(cl_uchar *)(cfg->vol);
-     cl_float  *field;
 
-     cl_uint   *Pseed;
-     float  *Pdet;
+     cl_float   t;
      char opt[MAX_PATH_LENGTH]={'\0'};
      cl_uint detreclen=cfg->medianum+1;
+     cl_uint stopsign[2]={0,0};
 
      MCXParam param={{{cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,1.f}},
 		     {{cfg->srcdir.x,cfg->srcdir.y,cfg->srcdir.z,0.f}},
@@ -223,107 +612,250 @@ void mcx_run_simulation(Config *cfg,float *fluence,float *totalenergy){
                      cfg->sradius*cfg->sradius,minstep*R_C0*cfg->unitinmm,cfg->maxdetphoton,
                      cfg->medianum-1,cfg->detnum,0,0};
 
-     platform=mcx_list_gpu(cfg,&workdev,devices);
+     memset(ses,0,sizeof(MCXSession));
+     ses->param=param;
+     ses->dimxyz=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z;
+     ses->respin=cfg->respin;
+     ses->npack=(cfg->sweepfile[0] && cfg->npack>1 ? cfg->npack : 1);
+     ses->isprecroi=(cfg->precision>0.f && cfg->precbox[0]>=0.f);
+     ses->isoutroi=(cfg->issave2pt && (cfg->outroi[0]>=0.f || cfg->tallybin[0]>1 || cfg->tallybin[1]>1 || cfg->tallybin[2]>1));
 
-     if(workdev>MAX_DEVICE)
-         workdev=MAX_DEVICE;
+     /*the voxel index of the kernel is 32-bit, only the time gates may extend the field beyond it*/
+     if(ses->dimxyz>=0xFFFFFFFFULL)
+         mcx_error(-1,(char*)"the volume has 2^32 voxels or more, which is not supported",__FILE__,__LINE__);
 
-     if(devices == NULL){
-         OCL_ASSERT(-1);
-     }
+     mcx_list_gpu(cfg,&ses->workdev,devices,devplatform);
 
-     cl_context_properties cps[3]={CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+     if(ses->workdev>MAX_DEVICE)
+         ses->workdev=MAX_DEVICE;
 
-     /* Use NULL for backward compatibility */
-     cl_context_properties* cprops=(platform==NULL)?NULL:cps;
-     OCL_ASSERT(((mcxcontext=clCreateContextFromType(cprops,CL_DEVICE_TYPE_ALL,NULL,NULL,&status),status)));
+     if(devices == NULL || ses->workdev==0){
+         OCL_ASSERT(-1);
+     }
 
-     mcxqueue= (cl_command_queue*)malloc(workdev*sizeof(cl_command_queue));
-     waittoread=(cl_event *)malloc(workdev*sizeof(cl_event));
-     cucount=(cl_uint *)calloc(workdev,sizeof(cl_uint));
+     /*
+        devices from different platforms can not share a context, so each
+        platform gets its own context with only its active devices; the
+        program and the read-only buffers are then created per platform
+     */
+     for(i=0;i<ses->workdev;i++){
+         for(j=0;j<ses->nplatform;j++)
+             if(platforms[j]==devplatform[i])
+                 break;
+         if(j==ses->nplatform)
+             platforms[ses->nplatform++]=devplatform[i];
+         ses->devplat[i]=j;
+     }
+     for(j=0;j<ses->nplatform;j++){
+         cl_device_id platdev[MAX_DEVICE];
+         cl_uint platdevnum=0;
+         cl_context_properties cps[3]={CL_CONTEXT_PLATFORM, (cl_context_properties)platforms[j], 0};
+
+         /* Use NULL for backward compatibility */
+         cl_context_properties* cprops=(platforms[j]==NULL)?NULL:cps;
+         for(i=0;i<ses->workdev;i++)
+             if(ses->devplat[i]==j)
+                 platdev[platdevnum++]=devices[i];
+         OCL_ASSERT(((ses->mcxcontext[j]=clCreateContext(cprops,platdevnum,platdev,NULL,NULL,&status),status)));
+     }
 
-     gseed=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     gfield=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     gdetphoton=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     genergy=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     gstopsign=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     gdetected=(cl_mem *)malloc(workdev*sizeof(cl_mem));
-     gdetpos=(cl_mem *)malloc(workdev*sizeof(cl_mem));
+     ses->mcxqueue= (cl_command_queue*)malloc(ses->workdev*sizeof(cl_command_queue));
+     ses->mcxcopyq= (cl_command_queue*)malloc(ses->workdev*sizeof(cl_command_queue));
+     ses->mcxctrlq= (cl_command_queue*)malloc(ses->workdev*sizeof(cl_command_queue));
+     ses->workload=(cl_float *)calloc(ses->workdev,sizeof(cl_float));
+     ses->devspeed=(cl_float *)calloc(ses->workdev,sizeof(cl_float));
+     ses->devphoton=(cl_ulong *)calloc(ses->workdev,sizeof(cl_ulong));
+     ses->devseed=(cl_uint *)calloc(ses->workdev,sizeof(cl_uint));
+     ses->devdetcount=(size_t *)calloc(ses->workdev,sizeof(size_t));
+     ses->devdetected=(cl_ulong *)calloc(ses->workdev,sizeof(cl_ulong));
+     ses->devenergy=(double *)calloc(ses->workdev<<1,sizeof(double));
+     ses->devdet=(float **)calloc(ses->workdev,sizeof(float*));
+     ses->devzerocopy=(char *)calloc(ses->workdev,sizeof(char));
+
+     ses->gparam=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+     ses->gseed=(cl_mem *)calloc(ses->workdev*MCX_BUFNUM,sizeof(cl_mem));
+     ses->gfield=(cl_mem *)calloc(ses->workdev*MCX_BUFNUM,sizeof(cl_mem));
+     ses->gdetphoton=(cl_mem *)calloc(ses->workdev*MCX_BUFNUM,sizeof(cl_mem));
+     ses->genergy=(cl_mem *)calloc(ses->workdev*MCX_BUFNUM,sizeof(cl_mem));
+     ses->gstopsign=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+     ses->gdetected=(cl_mem *)calloc(ses->workdev*MCX_BUFNUM,sizeof(cl_mem));
+     ses->gdetpos=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
 
      /* The block is to move the declaration of prop closer to its use */
      cl_command_queue_properties prop = CL_QUEUE_PROFILING_ENABLE;
 
-     totalcucore=0;
-     for(i=0;i<workdev;i++){
-         char pbuf[100]={'\0'};
-         OCL_ASSERT(((mcxqueue[i]=clCreateCommandQueue(mcxcontext,devices[i],prop,&status),status)));
-         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_MAX_COMPUTE_UNITS,sizeof(cl_uint),(void*)(cucount+i),NULL)));
-         OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_NAME,100,(void*)&pbuf,NULL)));
-         if(strstr(pbuf,"ATI")){
-            cucount[i]*=(80/5); // an ati core typically has 80 SP, and 80/5=16 VLIW
-	 }else if(strstr(pbuf,"GeForce") || strstr(pbuf,"Quadro") || strstr(pbuf,"Tesla")){
-            cucount[i]*=8;  // an nvidia MP typically has 8 SP
+     ses->fullload=0.f;
+     for(i=0;i<ses->workdev;i++){
+         OCL_ASSERT(((ses->mcxqueue[i]=clCreateCommandQueue(ses->mcxcontext[ses->devplat[i]],devices[i],prop,&status),status)));
+         OCL_ASSERT(((ses->mcxcopyq[i]=clCreateCommandQueue(ses->mcxcontext[ses->devplat[i]],devices[i],0,&status),status)));
+         OCL_ASSERT(((ses->mcxctrlq[i]=clCreateCommandQueue(ses->mcxcontext[ses->devplat[i]],devices[i],0,&status),status)));
+         if(cfg->zerocopy==2){
+             cl_bool unified=CL_FALSE;
+             OCL_ASSERT((clGetDeviceInfo(devices[i],CL_DEVICE_HOST_UNIFIED_MEMORY,sizeof(cl_bool),(void*)&unified,NULL)));
+             ses->devzerocopy[i]=(unified==CL_TRUE);
+         }else
+             ses->devzerocopy[i]=(cfg->zerocopy==1);
+         ses->workload[i]=cfg->workload[i];
+     	 ses->fullload+=cfg->workload[i];
+     }
+     ses->isbalance=(ses->fullload<EPS && ses->workdev>1); /*without -W, split the photons by the measured speed*/
+
+     /*
+        with -X 1, each device owns the z-layers [slab0,slab1) sized by -W,
+        with one extra layer of media on each side for the reflections; all
+        photons are launched by the device owning the source, the others only
+        continue the photons handed over to them
+     */
+     ses->issplit=(cfg->issplit && ses->workdev>1);
+     if(ses->issplit){
+         float slabload=0.f;
+         if(cfg->dim.z<ses->workdev)
+             mcx_error(-1,(char*)"the volume has fewer z-layers than devices, can not split it",__FILE__,__LINE__);
+         for(i=0;i<ses->workdev;i++){
+             slabload+=(ses->fullload>EPS ? ses->workload[i]/ses->fullload : 1.f/ses->workdev);
+             ses->slab0[i]=(i ? ses->slab1[i-1] : 0);
+             ses->slab1[i]=(i==ses->workdev-1) ? cfg->dim.z : (cl_uint)(slabload*cfg->dim.z+0.5f);
+             ses->slab1[i]=MIN(MAX(ses->slab1[i],ses->slab0[i]+1),cfg->dim.z-(ses->workdev-1-i));
+         }
+         ses->isbalance=0;
+         if(ses->isoutroi)
+             mcx_error(-1,(char*)"-O and -N can not be used with -X 1",__FILE__,__LINE__);
+         if(cfg->autotune){
+             cfg->autotune=0;  //a calibration launch would need the whole volume
+             fprintf(cfg->flog,"- launch size tuning is disabled with -X 1\n");
          }
-         totalcucore+=cucount[i];
      }
-     fullload=0.f;
-     for(i=0;i<workdev;i++)
-     	fullload+=cfg->workload[i];
 
-     if(fullload<EPS){
-	for(i=0;i<workdev;i++)
-     	    cfg->workload[i]=cucount[i];
-	fullload=totalcucore;
+     /*
+        with -P n, up to n sweep runs share a launch, each on an equal range
+        of the work-groups; the kernel then takes the problem table, so the
+        tuning and calibration launches, which do not set it, are skipped
+     */
+     if(ses->npack>1){
+         if(ses->issplit)
+             mcx_error(-1,(char*)"packed runs (-P) can not be used with -X 1",__FILE__,__LINE__);
+         if(cfg->autotune){
+             cfg->autotune=0;
+             fprintf(cfg->flog,"- launch size tuning is disabled with -P\n");
+         }
+         if(ses->isbalance){
+             for(i=0;i<ses->workdev;i++)
+                 ses->workload[i]=1.f;
+             ses->fullload=ses->workdev;
+             ses->isbalance=0;
+         }
      }
 
-     if(cfg->respin>1){
-         field=(cl_float *)calloc(sizeof(cl_float)*dimxyz,cfg->maxgate*2); //the second half will be used to accumul$
-     }else{
-         field=(cl_float *)calloc(sizeof(cl_float)*dimxyz,cfg->maxgate);
+     mcx_plan_memory(cfg,devices,ses->workdev,ses->issplit,ses->slab0,ses->slab1,ses->devzerocopy,ses->npack);
+
+     /*
+        with -O, the field only holds the voxels of the box, time gate after
+        time gate; the kernel skips the deposits outside of it. With -N, a
+        cell of the field sums the deposits of tallybin voxels per axis
+     */
+     ses->outlen=ses->dimxyz;
+     if(ses->isoutroi){
+         cl_uint lo[3], len[3];
+         ses->outlen=mcx_outputbox(cfg,lo,len);
+         for(i=0;i<3;i++){
+             ses->param.outroi0.s[i]=lo[i];
+             ses->param.outroidim.s[i]=(len[i]+cfg->tallybin[i]-1)/cfg->tallybin[i];
+             ses->param.outbin.s[i]=cfg->tallybin[i];
+         }
      }
-     if(cfg->nthread%cfg->nblocksize)
-        cfg->nthread=(cfg->nthread/cfg->nblocksize)*cfg->nblocksize;
-
-     mcgrid[0]=cfg->nthread;
-     mcblock[0]=cfg->nblocksize;
-
-     Pseed=(cl_uint*)malloc(sizeof(cl_uint)*cfg->nthread*RAND_SEED_LEN);
-     energy=(cl_float*)calloc(sizeof(cl_float),cfg->nthread*3);
-     Pdet=(float*)calloc(cfg->maxdetphoton,sizeof(float)*(cfg->medianum+1));
+     ses->fieldlen=ses->outlen*cfg->maxgate;
+     for(t=cfg->tstart;t<cfg->tend;t+=cfg->tstep*cfg->maxgate)
+         ses->nwindow++;
+
+     /*
+        with -E, each launch of a device is a batch; the run stops once the
+        batches give the detected photons, or the energy deposited in the -K
+        box, per launched photon within the target relative standard error
+     */
+     if(cfg->precision>0.f){
+         if(ses->issplit || ses->npack>1)
+             mcx_error(-1,(char*)"-E can not be used with -X 1 or -P",__FILE__,__LINE__);
+         if(ses->nwindow>1)
+             mcx_error(-1,(char*)"-E needs all time gates in one window, please raise -g",__FILE__,__LINE__);
+         if(cfg->respin<2)
+             mcx_error(-1,(char*)"-E needs -r 2 or more, -r sets the largest number of batches",__FILE__,__LINE__);
+         if(!ses->isprecroi && !cfg->issavedet)
+             mcx_error(-1,(char*)"-E monitors the detected photons, please use -d 1 or give a box with -K",__FILE__,__LINE__);
+         if(ses->isprecroi){
+             float off=(cfg->issrcfrom0 ? 0.f : 1.f);
+             cl_uint dim[3]={cfg->dim.x,cfg->dim.y,cfg->dim.z}, lo[3], hi[3];
+             for(i=0;i<3;i++){
+                 lo[i]=(cl_uint)MAX(cfg->precbox[i]-off,0.f);
+                 hi[i]=(cl_uint)MIN(MAX(cfg->precbox[i+3]-off,0.f),(float)(dim[i]-1));
+                 if(lo[i]>hi[i])
+                     mcx_error(-1,(char*)"the box of -K is empty or outside of the volume",__FILE__,__LINE__);
+             }
+             ses->param.roi0.s[0]=lo[0]; ses->param.roi0.s[1]=lo[1]; ses->param.roi0.s[2]=lo[2];
+             ses->param.roi1.s[0]=hi[0]; ses->param.roi1.s[1]=hi[1]; ses->param.roi1.s[2]=hi[2];
+         }
+     }
+     /*
+        with -V, the kernel deposits in gbatch, which mcx_add_moment adds
+        to the field and, squared, to the second moment after every launch;
+        the launches of all devices are the batches of the standard error
+     */
+     if(cfg->issavese){
+         if(!cfg->issave2pt)
+             mcx_error(-1,(char*)"-V needs the field, please use -S 1",__FILE__,__LINE__);
+         if(ses->issplit || ses->npack>1)
+             mcx_error(-1,(char*)"-V can not be used with -X 1 or -P",__FILE__,__LINE__);
+         if(ses->nwindow>1)
+             mcx_error(-1,(char*)"-V needs all time gates in one window, please raise -g",__FILE__,__LINE__);
+         if(cfg->respin*ses->workdev<2)
+             mcx_error(-1,(char*)"-V needs 2 launches or more, please use -r 2 or more",__FILE__,__LINE__);
+     }
+     if(cfg->checkpoint>0.f || cfg->isresume){
+         if(ses->issplit || ses->npack>1)
+             mcx_error(-1,(char*)"-C and -Q can not be used with -X 1 or -P",__FILE__,__LINE__);
+         if(ses->nwindow>1)
+             mcx_error(-1,(char*)"-C and -Q need all time gates in one window, please raise -g",__FILE__,__LINE__);
+         if(cfg->precision>0.f || cfg->issavese)
+             mcx_error(-1,(char*)"-C and -Q can not be used with -E or -V",__FILE__,__LINE__);
+         if(ses->isbalance)  //the devices checkpoint at their own launches, a rebalanced split can not be resumed
+             mcx_error(-1,(char*)"-C and -Q need a fixed split of the photons, please give -W with several devices",__FILE__,__LINE__);
+     }
+     if(cfg->outputformat<ofFloat || cfg->outputformat>ofSparse)
+         mcx_error(-1,(char*)"unknown output format, -F must be 0, 1, 2 or 3",__FILE__,__LINE__);
+     ses->nfield=(ses->nwindow>1 && ses->npack<2 ? MCX_BUFNUM : 1); //the 2nd field buffer is only used by the next time window
+     /*the gates of the time windows follow each other in the .mc2, each window is saved once complete*/
+     ses->isstream=(ses->nwindow>1 && cfg->issave2pt && cfg->parentid==mpStandalone);  //the packed runs save their windows in mcx_run_packed
+     if(ses->workdev>1 && !ses->issplit && ses->npack<2 && cfg->issave2pt && !ses->isstream)  //one slice per device for the final reduction, a single device adds to exportfield directly
+         ses->field=(cl_float *)calloc(sizeof(cl_float)*ses->fieldlen,ses->workdev);
+     else
+         ses->field=NULL;
+     ses->mcgrid=(size_t *)calloc(ses->workdev,sizeof(size_t));
+     ses->mcblock=(size_t *)calloc(ses->workdev,sizeof(size_t));
 
      cachebox.x=(cp1.x-cp0.x+1);
      cachebox.y=(cp1.y-cp0.y+1)*(cp1.x-cp0.x+1);
      dimlen.x=cfg->dim.x;
      dimlen.y=cfg->dim.x*cfg->dim.y;
-     dimlen.z=cfg->dim.x*cfg->dim.y*cfg->dim.z;
-
-     memcpy(&(param.dimlen.x),&(dimlen.x),sizeof(uint4));
-     memcpy(&(param.cachebox.x),&(cachebox.x),sizeof(uint2));
-     param.idx1dorig=(int(floorf(param.ps.z))*dimlen.y+
-                      int(floorf(param.ps.y))*dimlen.x+
-		      int(floorf(param.ps.x)));
-     param.mediaidorig=(cfg->vol[param.idx1dorig] & MED_MASK);
-
-     if(cfg->seed>0)
-     	srand(cfg->seed);
-     else
-        srand(time(0));
+     dimlen.z=ses->outlen;  //the kernel steps through the time gates of the field by dimlen.z
 
-     OCL_ASSERT(((gmedia=clCreateBuffer(mcxcontext,RO_MEM, sizeof(cl_uchar)*(dimxyz),media,&status),status)));
-     OCL_ASSERT(((gproperty=clCreateBuffer(mcxcontext,RO_MEM, cfg->medianum*sizeof(Medium),cfg->prop,&status),status)));
-     OCL_ASSERT(((gparam=clCreateBuffer(mcxcontext,RO_MEM, sizeof(MCXParam),&param,&status),status)));
+     memcpy(&(ses->param.dimlen.x),&(dimlen.x),sizeof(uint4));
+     memcpy(&(ses->param.cachebox.x),&(cachebox.x),sizeof(uint2));
 
-     for(i=0;i<workdev;i++){
-       for (j=0; j<cfg->nthread*RAND_SEED_LEN;j++)
-	   Pseed[j]=rand();
-       OCL_ASSERT(((gseed[i]=clCreateBuffer(mcxcontext,RW_MEM, sizeof(cl_uint)*cfg->nthread*RAND_SEED_LEN,Pseed,&status),status)));
-       OCL_ASSERT(((gfield[i]=clCreateBuffer(mcxcontext,RW_MEM, sizeof(cl_float)*(dimxyz)*cfg->maxgate,field,&status),status)));
-       OCL_ASSERT(((gdetphoton[i]=clCreateBuffer(mcxcontext,RW_MEM, sizeof(float)*cfg->maxdetphoton*(cfg->medianum+1),Pdet,&status),status)));
-       OCL_ASSERT(((genergy[i]=clCreateBuffer(mcxcontext,RW_MEM, sizeof(float)*(cfg->nthread<<1),energy,&status),status)));
-       OCL_ASSERT(((gstopsign[i]=clCreateBuffer(mcxcontext,RW_PTR, sizeof(cl_uint),&stopsign,&status),status)));
-       OCL_ASSERT(((gdetected[i]=clCreateBuffer(mcxcontext,RW_MEM, sizeof(cl_uint),&detected,&status),status)));
-       OCL_ASSERT(((gdetpos[i]=clCreateBuffer(mcxcontext,RO_MEM, cfg->detnum*sizeof(float4),cfg->detpos,&status),status)));
+     /*the media stay on the devices for the whole session, the source and the properties are written by mcx_update_session*/
+     for(j=0;j<ses->nplatform;j++){
+         if(!ses->issplit)
+             OCL_ASSERT(((ses->gmedia[j]=clCreateBuffer(ses->mcxcontext[j],RO_MEM, sizeof(cl_uchar)*(ses->dimxyz),media,&status),status)));
+         OCL_ASSERT(((ses->gproperty[j]=clCreateBuffer(ses->mcxcontext[j],CL_MEM_READ_ONLY, ses->npack*cfg->medianum*sizeof(Medium),NULL,&status),status)));
+     }
+     for(i=0;i<ses->workdev;i++){
+         if(ses->issplit){  //gmedia holds the slab of each device, the field only covers the slab
+             size_t mediaoffset=(size_t)(ses->slab0[i] ? ses->slab0[i]-1 : 0)*dimlen.y;
+             OCL_ASSERT(((ses->gmedia[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],RO_MEM, sizeof(cl_uchar)*(MIN(ses->slab1[i]+1,cfg->dim.z)*dimlen.y-mediaoffset),
+                                            media+mediaoffset,&status),status)));
+             fprintf(cfg->flog,"- [device %d] slab z=[%d,%d)\n",i,ses->slab0[i],ses->slab1[i]);
+         }
+         OCL_ASSERT(((ses->gparam[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_ONLY, sizeof(MCXParam),NULL,&status),status)));
      }
+     mcx_update_session(ses,cfg);
 
      fprintf(cfg->flog,"\
 ===============================================================================\n\
@@ -347,248 +879,1728 @@ $MCXCL$Rev::    $ Last Commit $Date::                     $ by $Author:: fangq$\
      fprintf(cfg->flog,"- compiled with: [RNG] %s [Seed Length] %d\n",MCX_RNG_NAME,RAND_SEED_LEN);
      fprintf(cfg->flog,"initializing streams ...\t");
      fflush(cfg->flog);
-     fieldlen=dimxyz*cfg->maxgate;
 
      fprintf(cfg->flog,"init complete : %d ms\n",GetTimeMillis()-tic);
 
-     OCL_ASSERT(((mcxprogram=clCreateProgramWithSource(mcxcontext, 1,(const char **)&(cfg->clsource), NULL, &status),status)));
+     for(j=0;j<ses->nplatform;j++){
+         char pname[MAX_PATH_LENGTH]={'\0'};
+         cl_uint platdevnum=0;
+         for(i=0;i<ses->workdev;i++)
+             platdevnum+=(ses->devplat[i]==j);
+         if(platforms[j])
+             OCL_ASSERT((clGetPlatformInfo(platforms[j],CL_PLATFORM_NAME,sizeof(pname),pname,NULL)));
+         fprintf(cfg->flog,"- [platform %d] %s: %d device(s)\n",j,pname,platdevnum);
+         OCL_ASSERT(((ses->mcxprogram[j]=clCreateProgramWithSource(ses->mcxcontext[j], 1,(const char **)&(cfg->clsource), NULL, &status),status)));
+     }
 
      sprintf(opt,"-cl-mad-enable -cl-fast-relaxed-math %s",cfg->compileropt);
      if(cfg->issavedet)
          sprintf(opt+strlen(opt)," -D MCX_SAVE_DETECTORS");
      if(cfg->isreflect)
          sprintf(opt+strlen(opt)," -D MCX_DO_REFLECTION");
+     if(ses->fieldlen*ses->npack>0xFFFFFFFFULL)  //64-bit field offsets only when the time gates need them
+         sprintf(opt+strlen(opt)," -D MCX_USE_LONG_INDEX");
+     if(ses->issplit)
+         sprintf(opt+strlen(opt)," -D MCX_SLAB_SPLIT");
+     if(ses->npack>1)
+         sprintf(opt+strlen(opt)," -D MCX_MULTI_PROBLEM");
+     if(ses->isprecroi)
+         sprintf(opt+strlen(opt)," -D MCX_PRECISION_ROI");
+     if(ses->isoutroi)
+         sprintf(opt+strlen(opt)," -D MCX_OUTPUT_ROI");
      sprintf(opt+strlen(opt)," %s",cfg->compileropt);
 
-     status=clBuildProgram(mcxprogram, 0, NULL, opt, NULL, NULL);
-     
-     if(status!=CL_SUCCESS){
+     ses->tbuild=GetTimeMillis();
+     for(j=0;j<ses->nplatform;j++){
+       status=clBuildProgram(ses->mcxprogram[j], 0, NULL, opt, NULL, NULL);
+
+       if(status!=CL_SUCCESS){
 	 size_t len;
 	 char *msg;
+	 for(devid=0;devid<ses->workdev && ses->devplat[devid]!=j;devid++);
 	 // get the details on the error, and store it in buffer
-	 clGetProgramBuildInfo(mcxprogram,devices[devid],CL_PROGRAM_BUILD_LOG,0,NULL,&len); 
+	 clGetProgramBuildInfo(ses->mcxprogram[j],devices[devid],CL_PROGRAM_BUILD_LOG,0,NULL,&len); 
 	 msg=new char[len];
-	 clGetProgramBuildInfo(mcxprogram,devices[devid],CL_PROGRAM_BUILD_LOG,len,msg,NULL); 
-	 fprintf(cfg->flog,"Kernel build error:\n%s\n", msg);
+	 clGetProgramBuildInfo(ses->mcxprogram[j],devices[devid],CL_PROGRAM_BUILD_LOG,len,msg,NULL); 
+	 fprintf(cfg->flog,"Kernel build error on platform %d:\n%s\n",j,msg);
 	 mcx_error(-(int)status,(char*)("Error: Failed to build program executable!"),__FILE__,__LINE__);
 	 delete msg;
+       }
      }
+     ses->tbuild=GetTimeMillis()-ses->tbuild;
      fprintf(cfg->flog,"build program complete : %d ms\n",GetTimeMillis()-tic);
 
-     mcxkernel=(cl_kernel*)malloc(workdev*sizeof(cl_kernel));
+     for(i=0;i<ses->workdev;i++){
+         mcx_launchsize(cfg,ses->mcxcontext[ses->devplat[i]],ses->mcxqueue[i],devices[i],ses->mcxprogram[ses->devplat[i]],opt,ses->gmedia[ses->issplit ? i : ses->devplat[i]],
+                     ses->gproperty[ses->devplat[i]],ses->gparam[i],&ses->param,ses->mcgrid+i,ses->mcblock+i,ses->devspeed+i);
+         ses->maxthread=MAX(ses->maxthread,ses->mcgrid[i]);
+         ses->totalthread+=ses->mcgrid[i];
+     }
+     if(ses->isbalance){
+         for(i=0;i<ses->workdev;i++){
+             if(ses->devspeed[i]<=0.f)
+                 ses->devspeed[i]=mcx_calibrate_device(cfg,ses->mcxcontext[ses->devplat[i]],ses->mcxqueue[i],ses->mcxprogram[ses->devplat[i]],
+                     ses->gmedia[ses->devplat[i]],ses->gproperty[ses->devplat[i]],ses->gparam[i],&ses->param,
+                     ses->mcgrid[i],ses->mcblock[i],(cl_uint)MIN(cfg->nphoton/(cfg->respin*ses->workdev*MCX_CALIB_SHARE),(size_t)MCX_TUNE_PHOTON));
+             ses->workload[i]=ses->devspeed[i];
+             ses->fullload+=ses->workload[i];
+             fprintf(cfg->flog,"- [device %d] calibrated speed: %.2f photon/ms\n",i,ses->devspeed[i]);
+         }
+     }else if(ses->fullload<EPS){
+         ses->workload[0]=ses->fullload=1.f;
+     }
+     /*every photon of a launch may be handed over at once, the queues hold a whole launch*/
+     if(ses->issplit)
+         ses->handoffcap=(cl_uint)MIN((cfg->nphoton+cfg->respin-1)/cfg->respin,(size_t)MCX_MAX_HANDOFF);
+     ses->Pseed=(cl_uint*)malloc(sizeof(cl_uint)*ses->maxthread*RAND_SEED_LEN);
+
+     /*
+        every device owns MCX_BUFNUM sets of the per-launch buffers, the next
+        launch runs on one set while the results of the previous one are read
+        from the other; these buffers are cleared on the device before use
+     */
+     for(i=0;i<ses->workdev;i++){
+       /*in zero-copy mode, the results are mapped and consumed in place*/
+       cl_mem_flags resultflag=CL_MEM_READ_WRITE | (ses->devzerocopy[i] ? CL_MEM_ALLOC_HOST_PTR : 0);
+       for(j=0;j<MCX_BUFNUM;j++){
+         k=i*MCX_BUFNUM+j;
+         OCL_ASSERT(((ses->gseed[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_uint)*ses->mcgrid[i]*RAND_SEED_LEN,NULL,&status),status)));
+         if(j<ses->nfield && !ses->issplit)
+             OCL_ASSERT(((ses->gfield[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],resultflag, sizeof(cl_float)*ses->fieldlen*ses->npack,NULL,&status),status)));
+         else if(j==0 && ses->issplit)
+             OCL_ASSERT(((ses->gfield[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE,
+                         sizeof(cl_float)*(ses->slab1[i]-ses->slab0[i])*dimlen.y*cfg->maxgate,NULL,&status),status)));
+         OCL_ASSERT(((ses->gdetphoton[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],resultflag, sizeof(float)*cfg->maxdetphoton*detreclen*ses->npack,NULL,&status),status)));
+         OCL_ASSERT(((ses->genergy[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],resultflag, sizeof(float)*(ses->mcgrid[i]<<1),NULL,&status),status)));
+         OCL_ASSERT(((ses->gdetected[k]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_uint)*ses->npack,NULL,&status),status)));
+       }
+       OCL_ASSERT(((ses->gstopsign[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],RW_MEM, sizeof(stopsign),stopsign,&status),status)));
+       OCL_ASSERT(((ses->gdetpos[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],RO_MEM, cfg->detnum*sizeof(float4),cfg->detpos,&status),status)));
+     }
+     if(ses->issplit){
+         ses->gimport=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         ses->gexport=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         ses->gexportnum=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         for(i=0;i<ses->workdev;i++){
+             size_t queuelen=sizeof(float)*(size_t)ses->handoffcap*(MCX_HANDOFF_LEN+ses->param.maxmedia);
+             OCL_ASSERT(((ses->gimport[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_ONLY, queuelen,NULL,&status),status)));
+             OCL_ASSERT(((ses->gexport[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, queuelen,NULL,&status),status)));
+             OCL_ASSERT(((ses->gexportnum[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_uint),NULL,&status),status)));
+         }
+     }
+     if(ses->isprecroi){
+         ses->gtally=(cl_mem *)malloc(ses->workdev*MCX_BUFNUM*sizeof(cl_mem));
+         for(i=0;i<ses->workdev*MCX_BUFNUM;i++)
+             OCL_ASSERT(((ses->gtally[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i/MCX_BUFNUM]],CL_MEM_READ_WRITE,
+                         sizeof(cl_float)*ses->mcgrid[i/MCX_BUFNUM],NULL,&status),status)));
+     }
+     if(cfg->issavese){
+         ses->gbatch=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         ses->gmoment=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         ses->glaunched=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         ses->momentkernel=(cl_kernel *)malloc(ses->workdev*sizeof(cl_kernel));
+         ses->launchkernel=(cl_kernel *)malloc(ses->workdev*sizeof(cl_kernel));
+         for(i=0;i<ses->workdev;i++){
+             OCL_ASSERT(((ses->gbatch[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_float)*ses->fieldlen,NULL,&status),status)));
+             OCL_ASSERT(((ses->gmoment[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_float)*ses->fieldlen,NULL,&status),status)));
+             OCL_ASSERT(((ses->glaunched[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_WRITE, sizeof(cl_float),NULL,&status),status)));
+         }
+         ses->moment=(cl_float *)malloc(sizeof(cl_float)*ses->fieldlen);
+     }
+     if(ses->npack>1){
+         ses->gproblem=(cl_mem *)malloc(ses->workdev*sizeof(cl_mem));
+         for(i=0;i<ses->workdev;i++)
+             OCL_ASSERT(((ses->gproblem[i]=clCreateBuffer(ses->mcxcontext[ses->devplat[i]],CL_MEM_READ_ONLY, ses->npack*sizeof(MCXProblem),NULL,&status),status)));
+     }
 
-     for(i=0;i<workdev;i++){
-         cl_int threadphoton, oddphotons;
-
-         threadphoton=(int)(cfg->nphoton*cfg->workload[i]/(fullload*cfg->nthread*cfg->respin));
-         oddphotons=(int)(cfg->nphoton*cfg->workload[i]/(fullload*cfg->respin)-threadphoton*cfg->nthread);
-         fprintf(cfg->flog,"- [device %d] threadph=%d oddphotons=%d np=%.1f nthread=%d repetition=%d\n",i,threadphoton,oddphotons,
-               cfg->nphoton*cfg->workload[i]/fullload,cfg->nthread,cfg->respin);
-
-	 OCL_ASSERT(((mcxkernel[i] = clCreateKernel(mcxprogram, "mcx_main_loop", &status),status)));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 0, sizeof(cl_uint),(void*)&threadphoton)));
-         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 1, sizeof(cl_uint),(void*)&oddphotons)));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 2, sizeof(cl_mem), (void*)&gmedia)));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 3, sizeof(cl_mem), (void*)(gfield+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 4, sizeof(cl_mem), (void*)(genergy+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 5, sizeof(cl_mem), (void*)(gseed+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 6, sizeof(cl_mem), (void*)(gdetphoton+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 7, sizeof(cl_mem), (void*)&gproperty)));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 8, sizeof(cl_mem), (void*)(gdetpos+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i], 9, sizeof(cl_mem), (void*)(gstopsign+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i],10, sizeof(cl_mem), (void*)(gdetected+i))));
-	 OCL_ASSERT((clSetKernelArg(mcxkernel[i],11, cfg->issavedet? sizeof(cl_float)*cfg->nblocksize*param.maxmedia : 1, NULL)));
+     ses->mcxkernel=(cl_kernel*)malloc(ses->workdev*sizeof(cl_kernel));
+
+     for(i=0;i<ses->workdev;i++){
+	 OCL_ASSERT(((ses->mcxkernel[i] = clCreateKernel(ses->mcxprogram[ses->devplat[i]], "mcx_main_loop", &status),status)));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 2, sizeof(cl_mem), (void*)(ses->gmedia+(ses->issplit ? i : ses->devplat[i])))));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 7, sizeof(cl_mem), (void*)(ses->gproperty+ses->devplat[i]))));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 8, sizeof(cl_mem), (void*)(ses->gdetpos+i))));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 9, sizeof(cl_mem), (void*)(ses->gstopsign+i))));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],12, sizeof(cl_mem), (void*)(ses->gparam+i))));
+	 OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],11, cfg->issavedet? sizeof(cl_float)*ses->mcblock[i]*ses->param.maxmedia : 1, NULL)));
+         if(ses->issplit){
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 3, sizeof(cl_mem), (void*)(ses->gfield+i*MCX_BUFNUM))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],13, sizeof(cl_mem), (void*)(ses->gimport+i))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],15, sizeof(cl_mem), (void*)(ses->gexport+i))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],16, sizeof(cl_mem), (void*)(ses->gexportnum+i))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],17, sizeof(cl_uint), (void*)&ses->handoffcap)));
+         }
+         if(ses->npack>1){
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 3, sizeof(cl_mem), (void*)(ses->gfield+i*MCX_BUFNUM))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],13, sizeof(cl_mem), (void*)(ses->gproblem+i))));
+             OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],15, sizeof(cl_uint), (void*)&cfg->maxgate)));
+         }
+         if(ses->gmoment){
+             cl_uint nthread=ses->mcgrid[i];
+             size_t maxwg;
+             OCL_ASSERT(((ses->momentkernel[i] = clCreateKernel(ses->mcxprogram[ses->devplat[i]], "mcx_add_moment", &status),status)));
+             OCL_ASSERT((clSetKernelArg(ses->momentkernel[i], 0, sizeof(cl_mem), (void*)(ses->gbatch+i))));
+             OCL_ASSERT((clSetKernelArg(ses->momentkernel[i], 2, sizeof(cl_mem), (void*)(ses->gmoment+i))));
+             OCL_ASSERT((clSetKernelArg(ses->momentkernel[i], 3, sizeof(cl_mem), (void*)(ses->glaunched+i))));
+             OCL_ASSERT(((ses->launchkernel[i] = clCreateKernel(ses->mcxprogram[ses->devplat[i]], "mcx_sum_launched", &status),status)));
+             OCL_ASSERT((clSetKernelArg(ses->launchkernel[i], 1, sizeof(cl_mem), (void*)(ses->glaunched+i))));
+             OCL_ASSERT((clSetKernelArg(ses->launchkernel[i], 2, sizeof(cl_uint), (void*)&nthread)));
+             OCL_ASSERT((clGetKernelWorkGroupInfo(ses->launchkernel[i],devices[i],CL_KERNEL_WORK_GROUP_SIZE,sizeof(size_t),(void*)&maxwg,NULL)));
+             for(ses->sumgroup[i]=MCX_SUM_GROUP;ses->sumgroup[i]>maxwg && ses->sumgroup[i]>1;ses->sumgroup[i]>>=1);
+             OCL_ASSERT((clSetKernelArg(ses->launchkernel[i], 3, sizeof(cl_float)*ses->sumgroup[i], NULL)));
+         }
      }
      fprintf(cfg->flog,"set kernel arguments complete : %d ms\n",GetTimeMillis()-tic);
+}
+
 
-     if(cfg->exportfield==NULL)
-         cfg->exportfield=(float *)calloc(sizeof(float)*cfg->dim.x*cfg->dim.y*cfg->dim.z,cfg->maxgate*2);
-     if(cfg->exportdetected==NULL)
+/*
+   upload the data of a run that may change between the runs of a sweep:
+   the source position and direction, the optical properties and, with
+   -X 1, the device owning the source
+*/
+void mcx_update_session(MCXSession *ses,Config *cfg){
+     cl_uint i,j;
+     cl_uint layer=ses->param.dimlen.y;
+     MCXParam devparam;
+
+     ses->param.ps.x=cfg->srcpos.x;
+     ses->param.ps.y=cfg->srcpos.y;
+     ses->param.ps.z=cfg->srcpos.z;
+     ses->param.c0.x=cfg->srcdir.x;
+     ses->param.c0.y=cfg->srcdir.y;
+     ses->param.c0.z=cfg->srcdir.z;
+     ses->param.idx1dorig=(int(floorf(ses->param.ps.z))*layer+
+                      int(floorf(ses->param.ps.y))*ses->param.dimlen.x+
+		      int(floorf(ses->param.ps.x)));
+     ses->param.mediaidorig=(cfg->vol[ses->param.idx1dorig] & MED_MASK);
+
+     /*with -X 1, all photons are launched by the device owning the source*/
+     if(ses->issplit){
+         cl_uint srcz=(cl_uint)MIN(MAX((int)floorf(cfg->srcpos.z),0),(int)cfg->dim.z-1);
+         for(i=0;i<ses->workdev;i++)
+             if(srcz>=ses->slab0[i] && srcz<ses->slab1[i])
+                 ses->srcdev=i;
+         for(i=0;i<ses->workdev;i++)
+             ses->workload[i]=(i==ses->srcdev);
+         ses->fullload=1.f;
+         fprintf(cfg->flog,"- [device %d] owns the source, launching the photons\n",ses->srcdev);
+     }
+
+     for(j=0;j<ses->nplatform;j++){
+         for(i=0;ses->devplat[i]!=j;i++);
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gproperty[j],CL_TRUE,0,cfg->medianum*sizeof(Medium),
+                                            cfg->prop, 0, NULL, NULL)));
+     }
+     for(i=0;i<ses->workdev;i++){
+         devparam=ses->param;
+         if(ses->issplit){  //the field only covers the slab
+             devparam.slabstart=ses->slab0[i]*layer;
+             devparam.slabend=ses->slab1[i]*layer;
+             devparam.mediaoffset=(ses->slab0[i] ? ses->slab0[i]-1 : 0)*layer;
+             devparam.dimlen.z=(ses->slab1[i]-ses->slab0[i])*layer;
+         }
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gparam[i],CL_TRUE,0,sizeof(MCXParam),
+                                            &devparam, 0, NULL, NULL)));
+     }
+}
+
+
+static volatile sig_atomic_t mcxstoprequest=0;
+
+/*
+   ask the running and the following runs to stop early and save what they
+   have simulated; mcxcl calls it on SIGINT
+*/
+void mcx_request_stop(int isstop){
+     mcxstoprequest=isstop;
+}
+
+int mcx_stop_requested(void){
+     return mcxstoprequest;
+}
+
+/*
+   stop the current run early: no further launch is enqueued, and the
+   kernels in flight stop launching photons once they see the flag
+*/
+void mcx_stop_run(MCXSession *ses){
+     cl_uint i,one=1;
+
+     ses->stopsign=1;
+     for(i=0;i<ses->workdev;i++)
+         clEnqueueWriteBuffer(ses->mcxctrlq[i],ses->gstopsign[i],CL_TRUE,0,sizeof(cl_uint),&one, 0, NULL, NULL);
+}
+
+/*
+   add a batch of -E, the tally y of a launch of a device and its launched
+   photons n: the estimate is the ratio R=sum(y)/sum(n), its variance comes
+   from the spread of the batches around it, sum((y-R*n)^2)/(B-1), divided
+   by B*mean(n)^2; the run is stopped once the relative standard error is
+   below the target. The caller holds the lock of the devices.
+*/
+void mcx_add_batch(MCXSession *ses,Config *cfg,double y,double n){
+     double *s=ses->batchstat, r, nbar, var, rse;
+
+     if(n<=0.0)
+         return;
+     s[0]+=y;
+     s[1]+=n;
+     s[2]+=y*y;
+     s[3]+=y*n;
+     s[4]+=n*n;
+     ses->nbatch++;
+     if(ses->nbatch<MCX_PRECISION_MINBATCH || s[0]<=0.0 || ses->stopsign)
+         return;
+     r=s[0]/s[1];
+     nbar=s[1]/ses->nbatch;
+     var=(s[2]-2.0*r*s[3]+r*r*s[4])/((ses->nbatch-1.0)*ses->nbatch*nbar*nbar);
+     rse=sqrt(MAX(var,0.0))/r;
+     if(cfg->isverbose)
+         fprintf(cfg->flog,"\tbatch %d: relative standard error %.5f\n",ses->nbatch,rse);
+     if(rse<=cfg->precision){
+         fprintf(cfg->flog,"- precision reached: relative standard error %.5f after %d batches\n",rse,ses->nbatch);
+         mcx_stop_run(ses);
+     }
+}
+
+/*
+   the monitor thread of a run: every MCX_MONITOR_MS, it raises the stop
+   flags when a stop is requested or the time budget (-w) is used up, and
+   with -j it prints the progress from the completed photon counters. The
+   kernels check the flag before launching a photon and the host before the
+   next launch. The flag and the counters go through a queue of their own,
+   which some platforms only serve between the kernels; the progress then
+   advances by launch, and a stop takes effect after the current launch.
+*/
+void *mcx_monitor(void *arg){
+     MCXMonitor *mon=(MCXMonitor*)arg;
+     MCXSession *ses=mon->ses;
+     Config *cfg=mon->cfg;
+     cl_uint i,j,count;
+     cl_ulong done;
+     cl_uint ckpttic=mon->tic;
+     int percent,lastpercent=-1;
+
+     while(!mon->isdone){
+         usleep(MCX_MONITOR_MS*1000);
+         if(cfg->checkpoint>0.f && !ses->stopsign && GetTimeMillis()-ckpttic>=cfg->checkpoint*1000.f){
+             ses->ckptseq++;  //each device saves its state after its next launch
+             ckpttic=GetTimeMillis();
+         }
+         if(!ses->stopsign && (mcxstoprequest || (cfg->maxtime>0.f && GetTimeMillis()-mon->tic>=cfg->maxtime*1000.f))){
+             mcx_stop_run(ses);
+             if(lastpercent>=0)
+                 fprintf(stderr,"\n");
+             fprintf(cfg->flog,"- %s, stopping the run and saving the partial results\n",
+                 mcxstoprequest ? "interrupted" : "the time budget (-w) is used up");
+             fflush(cfg->flog);
+         }
+         if(!cfg->isprogress || ses->stopsign || mon->total==0)
+             continue;
+         done=0;
+         for(i=0;i<ses->workdev;i++)
+             if(clEnqueueReadBuffer(ses->mcxctrlq[i],ses->gstopsign[i],CL_TRUE,sizeof(cl_uint),sizeof(cl_uint),&count, 0, NULL, NULL)==CL_SUCCESS)
+                 done+=(cl_ulong)count*ses->mcblock[i];
+         percent=(int)MIN(done*100/mon->total,(cl_ulong)100);
+         if(percent!=lastpercent){
+             fprintf(stderr,"\rprogress: [");
+             for(j=0;j<MCX_PROGRESS_LEN;j++)
+                 fputc(j<(cl_uint)percent*MCX_PROGRESS_LEN/100 ? '=' : ' ',stderr);
+             fprintf(stderr,"] %3d%%",percent);
+             fflush(stderr);
+             lastpercent=percent;
+         }
+     }
+     if(lastpercent>=0 && !ses->stopsign)
+         fprintf(stderr,"\n");
+     return NULL;
+}
+
+
+/*
+   run the photons of one simulation on a session set up by mcx_init_session
+   and uploaded by mcx_update_session, then reduce, normalize and save the
+   results; the seeds are drawn here, so that the runs of a sweep do not
+   replay each other
+*/
+void mcx_run_session(MCXSession *ses,Config *cfg){
+
+     cl_uint i,j,k,l;
+     cl_uint devid;
+     cl_uint tic,tic0,tic1,toc=0,ttransfer=0;
+     cl_uint detreclen=cfg->medianum+1;
+     cl_uint seedstate;
+     cl_uint stopsign[2]={0,0}, balancestop=0;
+     double launched=0.0;
+     MCXMonitor mon;
+     MCXWriter out;
+     pthread_t monitor;
+#ifdef MCX_CONTAINER
+     std::exception_ptr deverror;
+#endif
+
+     tic=StartTimer();
+     if(cfg->exportfield==NULL && cfg->issave2pt && !ses->isstream)
+         cfg->exportfield=(float *)calloc(sizeof(float),ses->fieldlen);
+     if(cfg->exportdetected==NULL && cfg->issavedet)
          cfg->exportdetected=(float*)malloc((cfg->medianum+1)*cfg->maxdetphoton*sizeof(float));
 
      cfg->energytot=0.f;
      cfg->energyesc=0.f;
      cfg->runtime=0;
+     cfg->detectedcount=0;
+     cfg->his.detected64=0;
+     memset(ses->devenergy,0,sizeof(double)*(ses->workdev<<1));
+     memset(ses->devdetcount,0,sizeof(size_t)*ses->workdev);
+     memset(ses->devdetected,0,sizeof(cl_ulong)*ses->workdev);
+     if(ses->field)
+         memset(ses->field,0,sizeof(cl_float)*ses->fieldlen*ses->workdev);
+
+     /*raise the repetitions until the busiest thread stays below MCX_MAX_THREADPHOTON photons*/
+     cfg->respin=ses->respin;
+     for(i=0;i<ses->workdev;i++){
+         double threadload=(double)cfg->nphoton*(ses->isbalance ? 1.f : ses->workload[i]/ses->fullload)/ses->mcgrid[i]; //rebalancing may shift all photons to one device
+         if(threadload/cfg->respin+1.0>=MCX_MAX_THREADPHOTON){
+             cfg->respin=(int)(threadload/(MCX_MAX_THREADPHOTON-2))+1;
+             fprintf(cfg->flog,"- repetition number is raised to %d, a thread can run at most %d photons per launch\n",
+                 cfg->respin,MCX_MAX_THREADPHOTON-1);
+         }
+     }
+     /*the hand-over queues were sized for the first run, a larger run is launched in more repetitions*/
+     if(ses->issplit && (cfg->nphoton+cfg->respin-1)/cfg->respin>ses->handoffcap){
+         cfg->respin=(int)((cfg->nphoton+ses->handoffcap-1)/ses->handoffcap);
+         fprintf(cfg->flog,"- repetition number is raised to %d, at most %d photons are launched at once with -X 1\n",
+             cfg->respin,ses->handoffcap);
+     }
 
      //simulate for all time-gates in maxgate groups per run
 
-     cl_float Vvox;
-     Vvox=cfg->steps.x*cfg->steps.y*cfg->steps.z;
+     /*the seeds come from a state of this run, concurrent sessions do not share the rand() state*/
+     seedstate=(cfg->seed>0 ? (cl_uint)cfg->seed : (cl_uint)time(0));
+
+     for(i=0;i<ses->workdev;i++){
+         for(j=0;j<MCX_BUFNUM;j++){
+             if(j==0 || cfg->respin>1)  //without -r, all time windows replay the same photons
+                 for (l=0; l<ses->mcgrid[i]*RAND_SEED_LEN;l++)
+	             ses->Pseed[l]=rand_r(&seedstate);
+             OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gseed[i*MCX_BUFNUM+j],CL_TRUE,0,sizeof(cl_uint)*ses->mcgrid[i]*RAND_SEED_LEN,
+                                            ses->Pseed, 0, NULL, NULL)));
+         }
+         ses->devphoton[i]=mcx_setphoton(cfg,ses->mcxkernel[i],ses->mcgrid[i],ses->workload[i],ses->fullload);
+         fprintf(cfg->flog,"- [device %d] threadph=%d oddphotons=%d np=%.0f nthread=%d nblocksize=%d repetition=%d%s\n",i,
+               (int)(ses->devphoton[i]/ses->mcgrid[i]),(int)(ses->devphoton[i]%ses->mcgrid[i]),
+               (double)cfg->nphoton*ses->workload[i]/ses->fullload,(int)ses->mcgrid[i],(int)ses->mcblock[i],cfg->respin,
+               ses->devzerocopy[i] ? " zero-copy" : "");
+     }
+     for(i=0;i<ses->workdev;i++)
+         ses->devseed[i]=rand_r(&seedstate);
+
+     fprintf(cfg->flog,"lauching mcx_main_loop on %d device(s) for %d time window(s) x%d repetition(s) ...\n",
+         ses->workdev,ses->nwindow,cfg->respin);
+     fflush(cfg->flog);
+
+     ses->stopsign=0;
+     ses->ckptseq=0;
+     ses->nbatch=0;
+     memset(ses->batchstat,0,sizeof(ses->batchstat));
+     ses->nmoment=0;
+     ses->momentphoton=0.0;
+     if(ses->gmoment){
+         cl_float zerof=0.f;
+         memset(ses->moment,0,sizeof(cl_float)*ses->fieldlen);
+         for(i=0;i<ses->workdev;i++){
+             OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gbatch[i],&zerof,sizeof(cl_float),0,sizeof(cl_float)*ses->fieldlen, 0, NULL, NULL)));
+             OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gmoment[i],&zerof,sizeof(cl_float),0,sizeof(cl_float)*ses->fieldlen, 0, NULL, NULL)));
+         }
+     }
+     for(i=0;i<ses->workdev;i++)
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gstopsign[i],CL_TRUE,0,sizeof(stopsign),stopsign, 0, NULL, NULL)));
+     mon.ses=ses;
+     mon.cfg=cfg;
+     mon.total=(cl_ulong)cfg->nphoton*ses->nwindow;
+     mon.tic=GetTimeMillis();
+     mon.isdone=0;
+     if(pthread_create(&monitor,NULL,mcx_monitor,&mon))
+         mcx_error(-1,(char*)"can not start the monitor thread",__FILE__,__LINE__);
+     if(ses->isstream)
+         mcx_writer_start(&out,ses,cfg,(ses->issplit ? 1 : ses->workdev));
      tic0=GetTimeMillis();
 
-     for(t=cfg->tstart;t<cfg->tend;t+=cfg->tstep*cfg->maxgate){
-       twindow0=t;
-       twindow1=t+cfg->tstep*cfg->maxgate;
-
-       fprintf(cfg->flog,"lauching mcx_main_loop for time window [%.1fns %.1fns] ...\n"
-           ,twindow0*1e9,twindow1*1e9);
-
-       //total number of repetition for the simulations, results will be accumulated to field
-       for(iter=0;iter<cfg->respin;iter++){
-           fprintf(cfg->flog,"simulation run#%2d ... \t",iter+1); fflush(cfg->flog);
-	   param.twin0=twindow0;
-	   param.twin1=twindow1;
-           for(devid=0;devid<workdev;devid++){
-               OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid],gparam,CL_TRUE,0,sizeof(MCXParam),&param, 0, NULL, NULL)));
-               OCL_ASSERT((clSetKernelArg(mcxkernel[devid],12, sizeof(cl_mem), (void*)&gparam)));
-               // launch mcxkernel
-#ifndef USE_OS_TIMER
-               OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid],mcxkernel[devid],1,NULL,mcgrid,mcblock, 0, NULL, &kernelevent)));
-#else
-               OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid],mcxkernel[devid],1,NULL,mcgrid,mcblock, 0, NULL, NULL)));
+     if(ses->issplit){
+#ifdef MCX_CONTAINER
+      try{  //the monitor is joined before the error is rethrown
 #endif
-               OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid],gdetected[devid],CL_FALSE,0,sizeof(uint),
-                                            &detected, 0, NULL, waittoread+devid)));
+       /*
+          with -X 1, every launch runs as a series of slices on all devices:
+          after each slice, the photons that crossed into another slab are
+          routed to its device and continued in the next slice, until none is
+          left in flight. Each slice draws new seeds, so that a continued
+          photon does not replay the random numbers of the thread it left.
+       */
+       cl_uint win, iter, slice, nflight, ndet, n, ndrop, zero=0;
+       cl_uint nimport[MAX_DEVICE], nqueued[MAX_DEVICE], nhandin[MAX_DEVICE];  //nqueued: waiting for a slab, nhandin: room in handin
+       size_t reclen=MCX_HANDOFF_LEN+ses->param.maxmedia, slablen, idx;
+       cl_float twin[2]={cfg->tstart,cfg->tstart+cfg->tstep*cfg->maxgate}, zerof=0.f;
+       cl_float *energy=(cl_float*)malloc(sizeof(cl_float)*(ses->maxthread<<1));
+       cl_float *handout=(cl_float*)malloc(sizeof(cl_float)*reclen*ses->handoffcap);
+       cl_float *handin[MAX_DEVICE], *slabfield=NULL;
+       cl_float *winfield=(ses->isstream ? (cl_float*)calloc(sizeof(cl_float),ses->fieldlen) : cfg->exportfield);
+       double launched0=0.0;
+
+       for(i=0;i<ses->workdev;i++){
+           handin[i]=(cl_float*)malloc(sizeof(cl_float)*reclen*ses->handoffcap);
+           nhandin[i]=ses->handoffcap;
+       }
+       if(cfg->issave2pt)
+           slabfield=(cl_float*)malloc(sizeof(cl_float)*ses->fieldlen);
+
+       for(win=0;win<ses->nwindow;win++){
+           for(i=0;i<ses->workdev;i++){
+               launched0+=ses->devenergy[(i<<1)+1];  //the photons launched in this window are counted from here
+               OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gparam[i],CL_TRUE,offsetof(MCXParam,twin0),sizeof(twin),twin, 0, NULL, NULL)));
+               OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gfield[i*MCX_BUFNUM],&zerof,sizeof(cl_float),0,
+                                            sizeof(cl_float)*(ses->slab1[i]-ses->slab0[i])*ses->param.dimlen.y*cfg->maxgate, 0, NULL, NULL)));
            }
-           clWaitForEvents(workdev,waittoread);
-           tic1=GetTimeMillis();
-	   toc+=tic1-tic0;
-           fprintf(cfg->flog,"kernel complete:  \t%d ms\nretrieving flux ... \t",tic1-tic);
-
-           for(devid=0;devid<workdev;devid++){
-             if(cfg->issavedet){
-                OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid],gdetphoton[devid],CL_TRUE,0,sizeof(float)*cfg->maxdetphoton*(cfg->medianum+1),
-	                                        Pdet, 0, NULL, NULL)));
-		if(detected>cfg->maxdetphoton){
-			fprintf(cfg->flog,"WARNING: the detected photon (%d) \
-is more than what your have specified (%d), please use the -H option to specify a greater number\t"
-                           ,detected,cfg->maxdetphoton);
-		}else{
-			fprintf(cfg->flog,"detected %d photons, total: %d\t",detected,cfg->detectedcount+detected);
-		}
-                cfg->his.detected+=detected;
-                detected=MIN(detected,cfg->maxdetphoton);
-		if(cfg->exportdetected){
-                        cfg->exportdetected=(float*)realloc(cfg->exportdetected,(cfg->detectedcount+detected)*detreclen*sizeof(float));
-	                memcpy(cfg->exportdetected+cfg->detectedcount*(detreclen),Pdet,detected*(detreclen)*sizeof(float));
-                        cfg->detectedcount+=detected;
-		}
-	     }
-	     //handling the 2pt distributions
-             if(cfg->issave2pt){
-               OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid],gfield[devid],CL_TRUE,0,sizeof(cl_float)*dimxyz*cfg->maxgate,
-	                                        field, 0, NULL, NULL)));
-               fprintf(cfg->flog,"transfer complete:\t%d ms\n",GetTimeMillis()-tic);  fflush(cfg->flog);
-
-               if(cfg->respin>1){
-                   for(i=0;i<fieldlen;i++)  //accumulate field, can be done in the GPU
-                      field[fieldlen+i]+=field[i];
-               }
-               if(iter+1==cfg->respin){ 
-                   if(cfg->respin>1)  //copy the accumulated fields back
-                       memcpy(field,field+fieldlen,sizeof(cl_float)*fieldlen);
-               }
-                   if(cfg->isnormalized){
-
-                       OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid],genergy[devid],CL_TRUE,0,sizeof(cl_float)*(cfg->nthread<<1),
-	                                        energy, 0, NULL, NULL)));
-                       for(i=0;i<cfg->nthread;i++){
-                           cfg->energyesc+=energy[(i<<1)];
-       	       	       	   cfg->energytot+=energy[(i<<1)+1];
-                           //eabsorp+=Plen[i].z;  // the accumulative absorpted energy near the source
+           for(iter=0;iter<(cl_uint)cfg->respin;iter++){
+               memset(nimport,0,sizeof(nimport));
+               memset(nqueued,0,sizeof(nqueued));
+               slice=0;
+               do{
+                   for(i=0;i<ses->workdev;i++){
+                       k=i*MCX_BUFNUM;
+                       if(slice==0)
+                           ses->devphoton[i]=mcx_setphoton(cfg,ses->mcxkernel[i],ses->mcgrid[i],ses->workload[i],ses->fullload);
+                       else{  //only the handed-over photons are left
+                           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 0, sizeof(cl_uint),(void*)&zero)));
+                           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 1, sizeof(cl_uint),(void*)&zero)));
                        }
+                       if(win || iter || slice){
+                           for(l=0;l<ses->mcgrid[i]*RAND_SEED_LEN;l++)
+                               ses->Pseed[l]=rand_r(&seedstate);
+                           OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gseed[k],CL_TRUE,0,sizeof(cl_uint)*ses->mcgrid[i]*RAND_SEED_LEN,
+                                            ses->Pseed, 0, NULL, NULL)));
+                       }
+                       OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],14, sizeof(cl_uint),(void*)(nimport+i))));
+                       OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gdetected[k],&zero,sizeof(cl_uint),0,sizeof(cl_uint), 0, NULL, NULL)));
+                       OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gexportnum[i],&zero,sizeof(cl_uint),0,sizeof(cl_uint), 0, NULL, NULL)));
+                       OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->genergy[k],&zerof,sizeof(cl_float),0,sizeof(cl_float)*(ses->mcgrid[i]<<1),
+                                            0, NULL, NULL)));
+                       OCL_ASSERT((clEnqueueNDRangeKernel(ses->mcxqueue[i],ses->mcxkernel[i],1,NULL,ses->mcgrid+i,ses->mcblock+i, 0, NULL, NULL)));
+                       OCL_ASSERT((clFlush(ses->mcxqueue[i])));
+                   }
+
+                   /*
+                      collect the results of the slice and route the handed-over photons by their z-layer;
+                      the photons that do not fit in the import buffer of a slab wait for the next slice
+                   */
+                   ndrop=0;
+                   for(i=0;i<ses->workdev;i++){
+                       k=i*MCX_BUFNUM;
+                       OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->genergy[k],CL_TRUE,0,sizeof(cl_float)*(ses->mcgrid[i]<<1),
+                                            energy, 0, NULL, NULL)));
+                       for(l=0;l<ses->mcgrid[i];l++){
+                           ses->devenergy[i<<1]+=energy[l<<1];
+                           ses->devenergy[(i<<1)+1]+=energy[(l<<1)+1];
+                       }
+                       if(cfg->issavedet){
+                           OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gdetected[k],CL_TRUE,0,sizeof(cl_uint),&ndet, 0, NULL, NULL)));
+                           n=MIN(ndet,cfg->maxdetphoton);
+                           if(n){
+                               ses->devdet[i]=(float*)realloc(ses->devdet[i],(ses->devdetcount[i]+n)*detreclen*sizeof(float));
+                               OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gdetphoton[k],CL_TRUE,0,sizeof(float)*n*detreclen,
+                                            ses->devdet[i]+ses->devdetcount[i]*detreclen, 0, NULL, NULL)));
+                               ses->devdetcount[i]+=n;
+                           }
+                           ses->devdetected[i]+=ndet;
+                           if(ndet>cfg->maxdetphoton)
+                               fprintf(cfg->flog,"WARNING: the detected photon (%d) \
+is more than what your have specified (%d), please use the -H option to specify a greater number\n"
+                                       ,ndet,cfg->maxdetphoton);
+                       }
+                       OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gexportnum[i],CL_TRUE,0,sizeof(cl_uint),&n, 0, NULL, NULL)));
+                       if(n>ses->handoffcap){
+                           fprintf(cfg->flog,"WARNING: %d photons left slab %d, only %d can be handed over\n",n,i,ses->handoffcap);
+                           n=ses->handoffcap;
+                       }
+                       if(n)
+                           OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gexport[i],CL_TRUE,0,sizeof(cl_float)*reclen*n,
+                                            handout, 0, NULL, NULL)));
+                       for(idx=0;idx<n;idx++){
+                           cl_float *rec=handout+idx*reclen;
+                           cl_uint z=(cl_uint)floorf(rec[2]);
+                           for(j=0;j<ses->workdev && (z<ses->slab0[j] || z>=ses->slab1[j]);j++);
+                           if(j>=ses->workdev){
+                               ndrop++;
+                               continue;
+                           }
+                           if(nqueued[j]>=nhandin[j]){
+                               nhandin[j]<<=1;
+                               handin[j]=(cl_float*)realloc(handin[j],sizeof(cl_float)*reclen*nhandin[j]);
+                           }
+                           memcpy(handin[j]+(nqueued[j]++)*reclen,rec,sizeof(cl_float)*reclen);
+                       }
+                   }
+                   if(ndrop)
+                       fprintf(cfg->flog,"WARNING: %d handed-over photons are outside of every slab and are dropped\n",ndrop);
+                   nflight=0;
+                   for(j=0;j<ses->workdev;j++){
+                       nimport[j]=MIN(nqueued[j],ses->handoffcap);
+                       if(nimport[j])
+                           OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[j],ses->gimport[j],CL_TRUE,0,sizeof(cl_float)*reclen*nimport[j],
+                                            handin[j], 0, NULL, NULL)));
+                       nqueued[j]-=nimport[j];
+                       if(nqueued[j])
+                           memmove(handin[j],handin[j]+(size_t)nimport[j]*reclen,sizeof(cl_float)*reclen*nqueued[j]);
+                       nflight+=nimport[j]+nqueued[j];
                    }
-	           if(cfg->exportfield){
-	               for(i=0;i<fieldlen;i++)
-		           cfg->exportfield[i]+=field[i];
+                   if(cfg->isverbose)
+                       fprintf(cfg->flog,"\tslice %d: %d photons handed over\n",slice+1,nflight);
+                   slice++;
+               }while(nflight>0);
+               fprintf(cfg->flog,"- window %d run#%2d: %d slice(s)\n",win+1,iter+1,slice);
+               fflush(cfg->flog);
+               if(ses->stopsign)  //the slices above completed the photons in flight
+                   break;
+           }
+           //the field of each slab goes to its z-layers of every time gate
+           if(cfg->issave2pt && winfield){
+               for(i=0;i<ses->workdev;i++){
+                   slablen=(size_t)(ses->slab1[i]-ses->slab0[i])*ses->param.dimlen.y;
+                   OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gfield[i*MCX_BUFNUM],CL_TRUE,0,sizeof(cl_float)*slablen*cfg->maxgate,
+                                            slabfield, 0, NULL, NULL)));
+                   for(j=0;j<(cl_uint)cfg->maxgate;j++){
+                       cl_float *gate=winfield+(size_t)j*ses->dimxyz+(size_t)ses->slab0[i]*ses->param.dimlen.y;
+                       for(idx=0;idx<slablen;idx++)
+                           gate[idx]+=slabfield[(size_t)j*slablen+idx];
                    }
+               }
+           }
+           if(ses->isstream){
+               for(i=0;i<ses->workdev;i++)
+                   launched0-=ses->devenergy[(i<<1)+1];
+               mcx_writer_add(&out,0,win,winfield,-launched0);
+               memset(winfield,0,sizeof(cl_float)*ses->fieldlen);
+               launched0=0.0;
+           }
+           if(ses->stopsign)
+               break;
+           twin[0]+=cfg->tstep*cfg->maxgate;
+           twin[1]+=cfg->tstep*cfg->maxgate;
+       }
+       for(i=0;i<ses->workdev;i++)
+           free(handin[i]);
+       free(handout);
+       free(slabfield);
+       free(energy);
+       if(ses->isstream)
+           free(winfield);
+#ifdef MCX_CONTAINER
+      }catch(...){
+          deverror=std::current_exception();
+      }
+#endif
+       if(ses->isstream)
+           mcx_writer_done(&out,0);
+     }else
+     /*
+        each device runs its own pipeline in a host thread: launch n+1 is
+        enqueued on one buffer set before the results of launch n are read
+        from the other set through the transfer queue, so the host work and
+        the transfers are hidden behind the kernel of the next launch. The
+        transfer queue is in-order, so the reads of launch n are enqueued
+        before anything that waits for launch n+1.
+     */
+#pragma omp parallel num_threads(ses->workdev) private(i)
+     {
+#ifdef MCX_CONTAINER
+      try{  //an error can not leave the parallel region, it is rethrown after it
+#endif
+       cl_uint devid=omp_get_thread_num(), nlaunch=ses->nwindow*cfg->respin, launch, iter, win=0;
+       cl_uint b, p, k=0, fb=0, nb, nrecord=0, zero=0, seedstate=ses->devseed[devid];
+       cl_uint ndet[MCX_BUFNUM];
+       cl_ulong nphoton[MCX_BUFNUM];
+       size_t idx;
+       cl_float twin=cfg->tstart, zerof=0.f;
+       size_t energylen=ses->mcgrid[devid]<<1, seedlen=ses->mcgrid[devid]*RAND_SEED_LEN;
+       char iszerocopy=ses->devzerocopy[devid];
+       cl_int mapstatus;
+       cl_float *energy=NULL, *stage=NULL, *recordptr=NULL;
+       cl_float *energyptr[MCX_BUFNUM], *fieldptr[MCX_BUFNUM];  //the results of a launch, mapped or copied
+       cl_float *tally=(ses->isprecroi ? (cl_float*)malloc(sizeof(cl_float)*ses->mcgrid[devid]*MCX_BUFNUM) : NULL);
+       double launchenergy, tallysum, winenergy=0.0;
+       cl_uint  *seed=(cl_uint*)malloc(sizeof(cl_uint)*seedlen*MCX_BUFNUM);
+       cl_float *devfield=(ses->field ? ses->field+(size_t)devid*ses->fieldlen : cfg->exportfield);
+       cl_event kernelev[MCX_BUFNUM], detev[MCX_BUFNUM], energyev[MCX_BUFNUM];
+       cl_event seedev[MCX_BUFNUM], fieldev[MCX_BUFNUM], tallyev[MCX_BUFNUM], recordev=NULL;
+       cl_event momentev[MCX_BUFNUM], *doneev=NULL;  //doneev: the field of a launch is complete, after mcx_add_moment with -V
+       cl_event ckptev[MCX_BUFNUM], waitev[2];  //ckptev: the field of a checkpoint is read before the next launch adds to it
+       cl_uint start=0, ckptseq=0, nwait;
+       char ckpt[MCX_BUFNUM]={0};        //the launch of this set is followed by a checkpoint
+       cl_uint ckptseed[MCX_BUFNUM]={0};  //the seed state of a checkpoint, before the seeds of the next launch are drawn
+       cl_float *ckptfield[MCX_BUFNUM]={NULL}, *resumefield=NULL;
+       cl_event unmapev[MCX_BUFNUM], fieldunmapev[MCX_BUFNUM];  //a mapped buffer is reused only after its unmap
+       cl_ulong tstart,tend;
+       MCXParam param0=ses->param, param1=ses->param;
+       MCXParam *devparam[MCX_BUFNUM]={&param0,&param1};  //a window updates one while the other may be in transfer
+
+       if(omp_get_num_threads()<(int)ses->workdev)
+           mcx_error(-1,(char*)"not enough host threads for the devices, please compile mcxcl with OpenMP",__FILE__,__LINE__);
+
+       for(b=0;b<MCX_BUFNUM;b++)
+           seedev[b]=unmapev[b]=fieldunmapev[b]=ckptev[b]=NULL;
+       if(!iszerocopy){
+           energy=(cl_float*)malloc(sizeof(cl_float)*energylen*MCX_BUFNUM);
+           if(cfg->issave2pt)  //host copies of the fields of the last nfield windows
+               stage=(cl_float*)malloc(sizeof(cl_float)*ses->fieldlen*ses->nfield);
+       }
+       if(cfg->isresume){
+           start=mcx_load_checkpoint(ses,cfg,devid,nlaunch,&seedstate,&resumefield);
+           if(start>=nlaunch && resumefield){  //the device had completed its launches
+               for(idx=0;idx<ses->fieldlen;idx++)
+                   devfield[idx]+=resumefield[idx];
+               free(resumefield);
+               resumefield=NULL;
+           }
+       }
+
+       for(launch=start;launch<=nlaunch;launch++){
+         if(launch<nlaunch){
+           b=launch%MCX_BUFNUM;
+           k=devid*MCX_BUFNUM+b;
+           win=launch/cfg->respin;
+
+           //a new time window starts on the other field buffer, cleared on the device or restored from a checkpoint
+           if(launch%cfg->respin==0 || launch==start){
+               if(launch>start)
+                   twin+=cfg->tstep*cfg->maxgate;
+               devparam[win%MCX_BUFNUM]->twin0=twin;
+               devparam[win%MCX_BUFNUM]->twin1=twin+cfg->tstep*cfg->maxgate;
+               OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[devid],ses->gparam[devid],CL_FALSE,0,sizeof(MCXParam),
+                                            devparam[win%MCX_BUFNUM], 0, NULL, NULL)));
+               fb=devid*MCX_BUFNUM+win%ses->nfield;
+               if(resumefield){
+                   OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[devid],ses->gfield[fb],CL_TRUE,0,sizeof(cl_float)*ses->fieldlen,
+                                            resumefield, 0, NULL, NULL)));
+                   free(resumefield);
+                   resumefield=NULL;
+               }else
+                   OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[devid],ses->gfield[fb],&zerof,sizeof(cl_float),0,sizeof(cl_float)*ses->fieldlen,
+                       (fieldunmapev[win%ses->nfield]!=NULL), (fieldunmapev[win%ses->nfield] ? fieldunmapev+win%ses->nfield : NULL), NULL)));
+               if(fieldunmapev[win%ses->nfield]){
+                   clReleaseEvent(fieldunmapev[win%ses->nfield]);
+                   fieldunmapev[win%ses->nfield]=NULL;
+               }
+               if(ses->gmoment)
+                   OCL_ASSERT((clSetKernelArg(ses->momentkernel[devid], 1, sizeof(cl_mem), (void*)(ses->gfield+fb))));
+               OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid], 3, sizeof(cl_mem), (void*)(ses->gmoment ? ses->gbatch+devid : ses->gfield+fb))));
+           }
+           OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[devid],ses->gdetected[k],&zero,sizeof(cl_uint),0,sizeof(cl_uint), 0, NULL, NULL)));
+           OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[devid],ses->genergy[k],&zerof,sizeof(cl_float),0,sizeof(cl_float)*energylen,
+                                            (unmapev[b]!=NULL), (unmapev[b] ? unmapev+b : NULL), NULL)));
+           if(unmapev[b]){
+               clReleaseEvent(unmapev[b]);
+               unmapev[b]=NULL;
+           }
+           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid], 4, sizeof(cl_mem), (void*)(ses->genergy+k))));
+           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid], 5, sizeof(cl_mem), (void*)(ses->gseed+k))));
+           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid], 6, sizeof(cl_mem), (void*)(ses->gdetphoton+k))));
+           OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid],10, sizeof(cl_mem), (void*)(ses->gdetected+k))));
+           if(ses->isprecroi)
+               OCL_ASSERT((clSetKernelArg(ses->mcxkernel[devid],13, sizeof(cl_mem), (void*)(ses->gtally+k))));
+
+           nphoton[b]=ses->devphoton[devid];
+           nwait=0;
+           if(seedev[b])
+               waitev[nwait++]=seedev[b];
+           if(ckptev[(launch+1)%MCX_BUFNUM])  //the checkpoint of the previous launch
+               waitev[nwait++]=ckptev[(launch+1)%MCX_BUFNUM];
+           OCL_ASSERT((clEnqueueNDRangeKernel(ses->mcxqueue[devid],ses->mcxkernel[devid],1,NULL,ses->mcgrid+devid,ses->mcblock+devid,
+                                            nwait, (nwait ? waitev : NULL), kernelev+b)));
+#ifndef USE_OS_TIMER
+#pragma omp critical
+           {
+               if(kernelevent)
+                   clReleaseEvent(kernelevent);
+               kernelevent=kernelev[b];
+               clRetainEvent(kernelevent);
+           }
+#endif
+           doneev=kernelev+b;
+           if(ses->gmoment){  //the second moment is divided by the photons the launch has actually launched
+               OCL_ASSERT((clSetKernelArg(ses->launchkernel[devid], 0, sizeof(cl_mem), (void*)(ses->genergy+k))));
+               OCL_ASSERT((clEnqueueNDRangeKernel(ses->mcxqueue[devid],ses->launchkernel[devid],1,NULL,ses->sumgroup+devid,ses->sumgroup+devid,
+                                            0, NULL, NULL)));
+               OCL_ASSERT((clEnqueueNDRangeKernel(ses->mcxqueue[devid],ses->momentkernel[devid],1,NULL,&ses->fieldlen,NULL,
+                                            0, NULL, momentev+b)));
+               doneev=momentev+b;
+           }
+           /*after a stop request, this launch is the last one and its time window is read back even if incomplete*/
+           if(ses->isbalance ? balancestop : ses->stopsign)
+               nlaunch=launch+1;
+
+           /*a checkpoint is due, or the run stops after this launch*/
+           ckpt[b]=(cfg->checkpoint>0.f && (ckptseq!=ses->ckptseq || (ses->stopsign && launch==nlaunch-1)));
+           if(ckpt[b]){
+               ckptseq=ses->ckptseq;
+               ckptseed[b]=seedstate;
+               if(cfg->issave2pt){
+                   if(ckptfield[b]==NULL)
+                       ckptfield[b]=(cl_float*)malloc(sizeof(cl_float)*ses->fieldlen);
+                   OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->gfield[fb],CL_FALSE,0,sizeof(cl_float)*ses->fieldlen,
+                                            ckptfield[b], 1, doneev, ckptev+b)));
+               }
+           }
+         }
+
+         //start reading the photons detected by the previous launch
+         if(launch>start){
+             p=(launch-1)%MCX_BUFNUM;
+             OCL_ASSERT((clWaitForEvents(1,detev+p)));
+             nrecord=(cfg->issavedet ? MIN(ndet[p],cfg->maxdetphoton) : 0);
+             if(nrecord){
+                 ses->devdet[devid]=(float*)realloc(ses->devdet[devid],(ses->devdetcount[devid]+nrecord)*detreclen*sizeof(float));
+                 if(iszerocopy){
+                     recordptr=(cl_float*)clEnqueueMapBuffer(ses->mcxcopyq[devid],ses->gdetphoton[devid*MCX_BUFNUM+p],CL_FALSE,CL_MAP_READ,
+                                            0,sizeof(float)*nrecord*detreclen, 0, NULL, &recordev, &mapstatus);
+                     OCL_ASSERT(mapstatus);
+                 }else
+                     OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->gdetphoton[devid*MCX_BUFNUM+p],CL_FALSE,0,sizeof(float)*nrecord*detreclen,
+                                            ses->devdet[devid]+ses->devdetcount[devid]*detreclen, 0, NULL, &recordev)));
              }
-	     //initialize the next simulation
-	     if(twindow1<cfg->tend && iter<cfg->respin){
-                  memset(field,0,sizeof(cl_float)*dimxyz*cfg->maxgate);
-                  OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid],gfield[devid],CL_TRUE,0,sizeof(cl_float)*dimxyz*cfg->maxgate,
-                                                field, 0, NULL, NULL)));
-		  OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 3, sizeof(cl_mem), (void*)(gfield+devid))));
-	     }
-	     if(cfg->respin>1 && RAND_SEED_LEN>1){
-               for (i=0; i<cfg->nthread*RAND_SEED_LEN; i++)
-		   Pseed[i]=rand();
-               OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid],gseed[devid],CL_TRUE,0,sizeof(cl_uint)*cfg->nthread*RAND_SEED_LEN,
-	                                        Pseed, 0, NULL, NULL)));
-	       OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 5, sizeof(cl_mem), (void*)(gseed+devid))));
-	     }
-             OCL_ASSERT((clFinish(mcxqueue[devid])));
-           }// loop over work devices
-       }// iteration
-       if(twindow1<cfg->tend){
-	    cl_float *tmpenergy=(cl_float*)calloc(sizeof(cl_float),cfg->nthread*3);
-            OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid],genergy[devid],CL_TRUE,0,sizeof(cl_float)*(cfg->nthread<<1),
-                                        tmpenergy, 0, NULL, NULL)));
-	    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 4, sizeof(cl_mem), (void*)(genergy+devid))));	
-	    free(tmpenergy);
+         }
+
+         if(launch<nlaunch){
+           /*
+              the seeds of launch n+1 go to the set last read by launch n-1;
+              they are generated while the kernel runs, and without -r all
+              time windows reuse the initial seeds
+           */
+           if(cfg->respin>1 && RAND_SEED_LEN>1 && launch+1<nlaunch && launch+1>=MCX_BUFNUM){
+               nb=(launch+1)%MCX_BUFNUM;
+               if(seedev[nb]){
+                   OCL_ASSERT((clWaitForEvents(1,seedev+nb)));
+                   clReleaseEvent(seedev[nb]);
+               }
+               for (i=0; i<seedlen; i++)
+                   seed[nb*seedlen+i]=rand_r(&seedstate);
+               OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxcopyq[devid],ses->gseed[devid*MCX_BUFNUM+nb],CL_FALSE,0,sizeof(cl_uint)*seedlen,
+                                            seed+nb*seedlen, 1, kernelev+nb, seedev+nb)));
+           }
+           OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->gdetected[k],CL_FALSE,0,sizeof(cl_uint),
+                                            ndet+b, 1, kernelev+b, detev+b)));
+           if(iszerocopy){
+               energyptr[b]=(cl_float*)clEnqueueMapBuffer(ses->mcxcopyq[devid],ses->genergy[k],CL_FALSE,CL_MAP_READ,
+                                            0,sizeof(cl_float)*energylen, 1, kernelev+b, energyev+b, &mapstatus);
+               OCL_ASSERT(mapstatus);
+           }else{
+               energyptr[b]=energy+b*energylen;
+               OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->genergy[k],CL_FALSE,0,sizeof(cl_float)*energylen,
+                                            energyptr[b], 1, kernelev+b, energyev+b)));
+           }
+           if(ses->isprecroi)
+               OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->gtally[k],CL_FALSE,0,sizeof(cl_float)*ses->mcgrid[devid],
+                                            tally+b*ses->mcgrid[devid], 1, kernelev+b, tallyev+b)));
+           if(cfg->issave2pt && (launch%cfg->respin==cfg->respin-1 || launch==nlaunch-1)){
+               if(iszerocopy){
+                   fieldptr[win%ses->nfield]=(cl_float*)clEnqueueMapBuffer(ses->mcxcopyq[devid],ses->gfield[fb],CL_FALSE,CL_MAP_READ,
+                                            0,sizeof(cl_float)*ses->fieldlen, 1, doneev, fieldev+win%ses->nfield, &mapstatus);
+                   OCL_ASSERT(mapstatus);
+               }else{
+                   fieldptr[win%ses->nfield]=stage+(size_t)(win%ses->nfield)*ses->fieldlen;
+                   OCL_ASSERT((clEnqueueReadBuffer(ses->mcxcopyq[devid],ses->gfield[fb],CL_FALSE,0,sizeof(cl_float)*ses->fieldlen,
+                                            fieldptr[win%ses->nfield], 1, doneev, fieldev+win%ses->nfield)));
+               }
+           }
+         }
+         if(launch==start)
+             continue;
+
+         //collect the results of the previous launch while the current one runs
+         b=(launch-1)%MCX_BUFNUM;
+         iter=(launch-1)%cfg->respin;
+         win=(launch-1)/cfg->respin;
+
+         //unmaps are enqueued in this order, so the last one of a buffer set covers the set
+         if(nrecord){
+             OCL_ASSERT((clWaitForEvents(1,&recordev)));
+             clReleaseEvent(recordev);
+             if(iszerocopy){
+                 memcpy(ses->devdet[devid]+ses->devdetcount[devid]*detreclen,recordptr,sizeof(float)*nrecord*detreclen);
+                 OCL_ASSERT((clEnqueueUnmapMemObject(ses->mcxcopyq[devid],ses->gdetphoton[devid*MCX_BUFNUM+b],recordptr, 0, NULL, NULL)));
+             }
+             ses->devdetcount[devid]+=nrecord;
+         }
+         if(cfg->issavedet)
+             ses->devdetected[devid]+=ndet[b];
+         OCL_ASSERT((clWaitForEvents(1,energyev+b)));
+         launchenergy=0.0;
+         for(i=0;i<ses->mcgrid[devid];i++){
+             ses->devenergy[devid<<1]+=energyptr[b][(i<<1)];
+             launchenergy+=energyptr[b][(i<<1)+1];
+         }
+         ses->devenergy[(devid<<1)+1]+=launchenergy;
+         winenergy+=launchenergy;
+         tallysum=0.0;
+         if(ses->isprecroi){
+             OCL_ASSERT((clWaitForEvents(1,tallyev+b)));
+             clReleaseEvent(tallyev[b]);
+             for(i=0;i<ses->mcgrid[devid];i++)
+                 tallysum+=tally[b*ses->mcgrid[devid]+i];
+         }
+         if(iszerocopy)
+             OCL_ASSERT((clEnqueueUnmapMemObject(ses->mcxcopyq[devid],ses->genergy[devid*MCX_BUFNUM+b],energyptr[b], 0, NULL, unmapev+b)));
+         if(cfg->issave2pt && (iter==cfg->respin-1 || launch==nlaunch)){
+             cl_float *winfield=fieldptr[win%ses->nfield];
+             OCL_ASSERT((clWaitForEvents(1,fieldev+win%ses->nfield)));
+             clReleaseEvent(fieldev[win%ses->nfield]);
+             if(ses->isstream)
+                 mcx_writer_add(&out,devid,win,winfield,winenergy);
+             else
+                 for(idx=0;idx<ses->fieldlen;idx++)
+                     devfield[idx]+=winfield[idx];
+             winenergy=0.0;
+             if(iszerocopy)
+                 OCL_ASSERT((clEnqueueUnmapMemObject(ses->mcxcopyq[devid],ses->gfield[devid*MCX_BUFNUM+win%ses->nfield],winfield,
+                                            0, NULL, fieldunmapev+win%ses->nfield)));
+         }
+         if(ckpt[b]){  //all results of the launch are collected
+             if(ckptev[b]){
+                 OCL_ASSERT((clWaitForEvents(1,ckptev+b)));
+                 clReleaseEvent(ckptev[b]);
+                 ckptev[b]=NULL;
+             }
+             mcx_save_checkpoint(ses,cfg,devid,launch,ckptseed[b],ckptfield[b]);
+             ckpt[b]=0;
+         }
+         OCL_ASSERT((clGetEventProfilingInfo(kernelev[b],CL_PROFILING_COMMAND_START,sizeof(cl_ulong),&tstart,NULL)));
+         OCL_ASSERT((clGetEventProfilingInfo(kernelev[b],CL_PROFILING_COMMAND_END,sizeof(cl_ulong),&tend,NULL)));
+         clReleaseEvent(kernelev[b]);
+         clReleaseEvent(detev[b]);
+         clReleaseEvent(energyev[b]);
+         if(ses->gmoment)
+             clReleaseEvent(momentev[b]);
+#pragma omp critical
+         {
+             if(ses->gmoment){
+                 ses->nmoment++;
+                 ses->momentphoton+=launchenergy;  //a photon is launched with a unit weight
+             }
+             fprintf(cfg->flog,"- [device %d] window %d run#%2d: kernel %.0f ms, %llu photons, detected %d\n",devid,
+                 win+1,iter+1,(tend-tstart)*1e-6,(unsigned long long)nphoton[b],ndet[b]);
+             if(ndet[b]>cfg->maxdetphoton)
+                 fprintf(cfg->flog,"WARNING: the detected photon (%d) \
+is more than what your have specified (%d), please use the -H option to specify a greater number\n"
+                         ,ndet[b],cfg->maxdetphoton);
+             if(cfg->precision>0.f)
+                 mcx_add_batch(ses,cfg,(ses->isprecroi ? tallysum : (double)ndet[b]),launchenergy);
+             fflush(cfg->flog);
+         }
+
+         //rebalance the launch after the current one by the speed just measured
+         if(ses->isbalance){
+             if(tend>tstart)
+                 ses->workload[devid]=0.5f*(ses->workload[devid]+(float)nphoton[b]/((tend-tstart)*1e-6f));
+#pragma omp barrier
+#pragma omp single
+             {
+                 balancestop=ses->stopsign;  //the devices stop after the same launch, so that their barriers match
+                 ses->fullload=0.f;
+                 for(i=0;i<ses->workdev;i++)
+                     ses->fullload+=ses->workload[i];
+                 if(cfg->isverbose){
+                     fprintf(cfg->flog,"workload split:");
+                     for(i=0;i<ses->workdev;i++)
+                         fprintf(cfg->flog," %.1f%%",ses->workload[i]*100.f/ses->fullload);
+                     fprintf(cfg->flog,"\n");
+                 }
+             }
+             ses->devphoton[devid]=mcx_setphoton(cfg,ses->mcxkernel[devid],ses->mcgrid[devid],ses->workload[devid],ses->fullload);
+         }
        }
-     }// time gates
 
-     if(cfg->isnormalized){
-	   float scale=0.f;
-           fprintf(cfg->flog,"normalizing raw data ...\t");
+       OCL_ASSERT((clFinish(ses->mcxcopyq[devid])));
+       OCL_ASSERT((clFinish(ses->mcxqueue[devid])));
+       for(b=0;b<MCX_BUFNUM;b++){
+           if(seedev[b])
+               clReleaseEvent(seedev[b]);
+           if(unmapev[b])
+               clReleaseEvent(unmapev[b]);
+           if(fieldunmapev[b])
+               clReleaseEvent(fieldunmapev[b]);
+           if(ckptev[b])
+               clReleaseEvent(ckptev[b]);
+           free(ckptfield[b]);
+       }
+       free(stage);
+       free(seed);
+       free(energy);
+       free(tally);
+       free(resumefield);
+#ifdef MCX_CONTAINER
+      }catch(...){
+#pragma omp critical
+          if(!deverror)
+              deverror=std::current_exception();
+      }
+#endif
+       if(ses->isstream)
+           mcx_writer_done(&out,omp_get_thread_num());
+     }
+     mon.isdone=1;
+     pthread_join(monitor,NULL);
+     if(ses->isstream)
+         mcx_writer_finish(&out);
+#ifdef MCX_CONTAINER
+     if(deverror)
+         std::rethrow_exception(deverror);
+#endif
+     tic1=GetTimeMillis();
+     toc=tic1-tic0;
+
+     //single cross-device reduction, in device order
+     for(devid=0;devid<ses->workdev;devid++){
+         cfg->energyesc+=ses->devenergy[devid<<1];
+         cfg->energytot+=ses->devenergy[(devid<<1)+1];
+         launched+=ses->devenergy[(devid<<1)+1];  //a photon is launched with a unit weight
+         cfg->his.detected64+=ses->devdetected[devid];
+         if(cfg->issave2pt && cfg->exportfield && ses->field){
+             cl_float *devfield=ses->field+(size_t)devid*ses->fieldlen;
+             for(size_t idx=0;idx<ses->fieldlen;idx++)
+                 cfg->exportfield[idx]+=devfield[idx];
+         }
+         if(ses->gmoment){
+             cl_float *devmoment=(cl_float*)malloc(sizeof(cl_float)*ses->fieldlen);
+             OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[devid],ses->gmoment[devid],CL_TRUE,0,sizeof(cl_float)*ses->fieldlen,
+                                            devmoment, 0, NULL, NULL)));
+             for(size_t idx=0;idx<ses->fieldlen;idx++)
+                 ses->moment[idx]+=devmoment[idx];
+             free(devmoment);
+         }
+         if(cfg->issavedet && cfg->exportdetected && ses->devdetcount[devid]){
+             cfg->exportdetected=(float*)realloc(cfg->exportdetected,(cfg->detectedcount+ses->devdetcount[devid])*detreclen*sizeof(float));
+             memcpy(cfg->exportdetected+cfg->detectedcount*detreclen,ses->devdet[devid],ses->devdetcount[devid]*detreclen*sizeof(float));
+             cfg->detectedcount+=ses->devdetcount[devid];
+         }
+         free(ses->devdet[devid]);
+         ses->devdet[devid]=NULL;
+     }
+     cfg->nlaunched=(size_t)(launched/ses->nwindow+0.5);
+     if(ses->stopsign)
+         fprintf(cfg->flog,"- the run was stopped early: %llu of %llu photons launched\n",
+             (unsigned long long)cfg->nlaunched,(unsigned long long)cfg->nphoton);
+     if(cfg->issavedet)
+         fprintf(cfg->flog,"detected %llu photons, saved %llu\n",cfg->his.detected64,(unsigned long long)cfg->detectedcount);
+     if(ses->gmoment)
+         mcx_standard_error(ses,cfg);
+     ttransfer=GetTimeMillis()-tic1;
+
+     mcx_save_session(ses,cfg,tic,toc,ttransfer);
+
+     if((cfg->checkpoint>0.f || cfg->isresume) && !ses->stopsign){  //a completed run has no use for its checkpoints
+         char name[MAX_PATH_LENGTH], suffix[16];
+         for(devid=0;devid<ses->workdev;devid++){
+             sprintf(suffix,"ckpt%d",devid);
+             mcx_outputname(cfg,suffix,name,sizeof(name));
+             remove(name);
+         }
+     }
+}
+
+
+/*
+   save the state of a device after its launches before nextlaunch: its
+   energy and detected photon counts, its detected photons, the field of
+   its window and the state of its seeds. The file is written aside and
+   renamed, so that a crash while saving keeps the previous checkpoint; a
+   failure only warns, the run goes on
+*/
+void mcx_save_checkpoint(MCXSession *ses,Config *cfg,cl_uint devid,cl_uint nextlaunch,cl_uint seedstate,const cl_float *field){
+     MCXCheckpoint ck;
+     char name[MAX_PATH_LENGTH], tmpname[MAX_PATH_LENGTH+4], suffix[16];
+     size_t detreclen=cfg->medianum+1;
+     FILE *fp;
+     int isok;
+
+     memset(&ck,0,sizeof(ck));
+     memcpy(ck.magic,MCX_CKPT_MAGIC,sizeof(MCX_CKPT_MAGIC));
+     ck.version=MCX_CKPT_VERSION;
+     ck.devid=devid;
+     ck.workdev=ses->workdev;
+     ck.respin=cfg->respin;
+     ck.nextlaunch=nextlaunch;
+     ck.seedstate=seedstate;
+     ck.detreclen=detreclen;
+     ck.issave2pt=cfg->issave2pt;
+     ck.nphoton=cfg->nphoton;
+     ck.fieldlen=ses->fieldlen;
+     ck.detected=ses->devdetected[devid];
+     ck.ndetrecord=ses->devdetcount[devid];
+     ck.energy[0]=ses->devenergy[devid<<1];
+     ck.energy[1]=ses->devenergy[(devid<<1)+1];
+
+     sprintf(suffix,"ckpt%d",devid);
+     mcx_outputname(cfg,suffix,name,sizeof(name));
+     snprintf(tmpname,sizeof(tmpname),"%s.tmp",name);
+     fp=fopen(tmpname,"wb");
+     isok=(fp!=NULL && fwrite(&ck,sizeof(ck),1,fp)==1
+           && (!cfg->issave2pt || fwrite(field,sizeof(cl_float),ses->fieldlen,fp)==ses->fieldlen)
+           && fwrite(ses->devdet[devid],sizeof(float)*detreclen,ck.ndetrecord,fp)==ck.ndetrecord);
+     if(fp && fclose(fp))
+         isok=0;
+     if(isok && rename(tmpname,name)==0)
+         fprintf(cfg->flog,"- [device %d] checkpoint saved after launch %d\n",devid,nextlaunch);
+     else
+         fprintf(cfg->flog,"WARNING: can not save the checkpoint of device %d to %s, the run goes on\n",devid,name);
+     fflush(cfg->flog);
+}
+
+
+/*
+   restore a device from its checkpoint (-Q 1): its counts, its detected
+   photons and the state of its seeds, from which the seeds of its next
+   launch are drawn; the field of its window is returned in *field. Returns
+   the launch to continue from, 0 when the device has no checkpoint
+*/
+cl_uint mcx_load_checkpoint(MCXSession *ses,Config *cfg,cl_uint devid,cl_uint nlaunch,cl_uint *seedstate,cl_float **field){
+     MCXCheckpoint ck;
+     char name[MAX_PATH_LENGTH], suffix[16];
+     size_t detreclen=cfg->medianum+1, seedlen=ses->mcgrid[devid]*RAND_SEED_LEN, i;
+     cl_uint *seed;
+     FILE *fp;
+     int isok;
+
+     *field=NULL;
+     sprintf(suffix,"ckpt%d",devid);
+     mcx_outputname(cfg,suffix,name,sizeof(name));
+     if((fp=fopen(name,"rb"))==NULL){
+         fprintf(cfg->flog,"- [device %d] no checkpoint in %s, the device starts from its first launch\n",devid,name);
+         return 0;
+     }
+     if(fread(&ck,sizeof(ck),1,fp)!=1 || memcmp(ck.magic,MCX_CKPT_MAGIC,sizeof(MCX_CKPT_MAGIC)) || ck.version!=MCX_CKPT_VERSION
+        || ck.devid!=devid || ck.workdev!=ses->workdev || ck.respin!=(cl_uint)cfg->respin || ck.nphoton!=cfg->nphoton
+        || ck.fieldlen!=ses->fieldlen || ck.detreclen!=detreclen || ck.issave2pt!=(cl_uint)cfg->issave2pt || ck.nextlaunch>nlaunch){
+         fclose(fp);
+         mcx_error(-1,(char*)"the checkpoint does not match this run, please use the same options and devices",__FILE__,__LINE__);
+     }
+     if(cfg->issave2pt)
+         *field=(cl_float*)malloc(sizeof(cl_float)*ses->fieldlen);
+     ses->devdet[devid]=(float*)realloc(ses->devdet[devid],ck.ndetrecord*detreclen*sizeof(float));
+     isok=((!cfg->issave2pt || fread(*field,sizeof(cl_float),ses->fieldlen,fp)==ses->fieldlen)
+           && fread(ses->devdet[devid],sizeof(float)*detreclen,ck.ndetrecord,fp)==ck.ndetrecord);
+     fclose(fp);
+     if(!isok)
+         mcx_error(-1,(char*)"the checkpoint is truncated",__FILE__,__LINE__);
+
+     ses->devenergy[devid<<1]=ck.energy[0];
+     ses->devenergy[(devid<<1)+1]=ck.energy[1];
+     ses->devdetected[devid]=ck.detected;
+     ses->devdetcount[devid]=ck.ndetrecord;
+     *seedstate=ck.seedstate;
+     /*draw the seeds of the next launch as the run would have, the first launches use those written at the start*/
+     if(cfg->respin>1 && RAND_SEED_LEN>1 && ck.nextlaunch<nlaunch && ck.nextlaunch>=MCX_BUFNUM){
+         seed=(cl_uint*)malloc(sizeof(cl_uint)*seedlen);
+         for(i=0;i<seedlen;i++)
+             seed[i]=rand_r(seedstate);
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[devid],ses->gseed[devid*MCX_BUFNUM+ck.nextlaunch%MCX_BUFNUM],CL_TRUE,0,
+                                            sizeof(cl_uint)*seedlen,seed, 0, NULL, NULL)));
+         free(seed);
+     }
+     fprintf(cfg->flog,"- [device %d] resumed after launch %d of %d, %llu photon(s) detected so far\n",devid,ck.nextlaunch,nlaunch,
+         (unsigned long long)ck.detected);
+     return ck.nextlaunch;
+}
+
+
+/*
+   turn the second moment of -V into the standard error of the raw field:
+   with x_b the field of launch b of n_b photons, N=sum(n_b), B launches
+   and m=sum(x_b)/N, a photon deposits with the variance
+   sum((x_b-n_b*m)^2/n_b)/(B-1)=(sum(x_b^2/n_b)-N*m^2)/(B-1), and the field,
+   a sum of N photons, with N times it
+*/
+void mcx_standard_error(MCXSession *ses,Config *cfg){
+     double nphoton=ses->momentphoton, sum, var;
+
+     if(ses->nmoment<2){
+         fprintf(cfg->flog,"WARNING: the run was stopped after %d launch, no standard error is saved\n",ses->nmoment);
+         return;
+     }
+     for(size_t idx=0;idx<ses->fieldlen;idx++){
+         sum=cfg->exportfield[idx];
+         var=nphoton/(ses->nmoment-1)*(ses->moment[idx]-sum*sum/nphoton);
+         ses->moment[idx]=(var>0.0 ? (cl_float)sqrt(var) : 0.f);  //rounding may leave a slightly negative variance
+     }
+     fprintf(cfg->flog,"standard error of the field estimated from %d launches\n",ses->nmoment);
+}
+
+
+/*
+   the normalization factor of a field deposited by photons launched with
+   the given total energy
+*/
+float mcx_field_scale(Config *cfg,double energy){
+     cl_float Vvox;
+     float scale=0.f;
+     Vvox=cfg->steps.x*cfg->steps.y*cfg->steps.z*cfg->tallybin[0]*cfg->tallybin[1]*cfg->tallybin[2];  //a full cell of -N
+
+     if(cfg->outputtype==otFlux || cfg->outputtype==otFluence){
+         scale=1.f/(energy*Vvox*cfg->tstep);
+         if(cfg->unitinmm!=1.f)
+             scale*=cfg->unitinmm; /* Vvox (in mm^3 already) * (Tstep) * (Eabsorp/U) */
+
+         if(cfg->outputtype==otFluence)
+             scale*=cfg->tstep;
+     }else if(cfg->outputtype==otEnergy || cfg->outputtype==otJacobian)
+         scale=1.f/energy;
+     return scale;
+}
+
+
+/*
+   start the writer thread of the time windows of a run; nsource threads
+   add their part of every window with mcx_writer_add
+*/
+void mcx_writer_start(MCXWriter *w,MCXSession *ses,Config *cfg,cl_uint nsource){
+     cl_uint i;
+
+     memset(w->nwin,0,sizeof(w->nwin));
+     memset(w->isdone,0,sizeof(w->isdone));
+     w->ses=ses;
+     w->cfg=cfg;
+     w->nsource=nsource;
+     w->nwritten=0;
+     for(i=0;i<MCX_WRITER_SLOT;i++){
+         w->field[i]=(cl_float*)calloc(sizeof(cl_float),ses->fieldlen);
+         w->energy[i]=0.0;
+     }
+#ifdef MCX_CONTAINER
+     w->error=NULL;
+#endif
+     pthread_mutex_init(&w->lock,NULL);
+     pthread_cond_init(&w->cond,NULL);
+     if(pthread_create(&w->thread,NULL,mcx_writer,w))
+         mcx_error(-1,(char*)"can not start the writer thread",__FILE__,__LINE__);
+}
+
+/*
+   add the field of a source to time window win, launched with the given
+   energy; waits while the slot of the window still holds an unsaved one
+*/
+void mcx_writer_add(MCXWriter *w,cl_uint src,cl_uint win,const cl_float *field,double energy){
+     cl_float *slot;
+
+     pthread_mutex_lock(&w->lock);
+     while(win>=w->nwritten+MCX_WRITER_SLOT)
+         pthread_cond_wait(&w->cond,&w->lock);
+     slot=w->field[win%MCX_WRITER_SLOT];
+     for(size_t idx=0;idx<w->ses->fieldlen;idx++)
+         slot[idx]+=field[idx];
+     w->energy[win%MCX_WRITER_SLOT]+=energy;
+     w->nwin[src]=win+1;
+     pthread_cond_broadcast(&w->cond);
+     pthread_mutex_unlock(&w->lock);
+}
 
-           if(cfg->outputtype==otFlux || cfg->outputtype==otFluence){
-               scale=1.f/(cfg->energytot*Vvox*cfg->tstep);
-	       if(cfg->unitinmm!=1.f)
-		   scale*=cfg->unitinmm; /* Vvox (in mm^3 already) * (Tstep) * (Eabsorp/U) */
+/*
+   a source adds no further window, after the last one or a stop or error
+*/
+void mcx_writer_done(MCXWriter *w,cl_uint src){
+     pthread_mutex_lock(&w->lock);
+     w->isdone[src]=1;
+     pthread_cond_broadcast(&w->cond);
+     pthread_mutex_unlock(&w->lock);
+}
 
-               if(cfg->outputtype==otFluence)
-		   scale*=cfg->tstep;
-	   }else if(cfg->outputtype==otEnergy || cfg->outputtype==otJacobian)
-	       scale=1.f/cfg->energytot;
+/*
+   wait for the last windows to be saved and release the writer
+*/
+void mcx_writer_finish(MCXWriter *w){
+     cl_uint i;
+
+     for(i=0;i<w->nsource;i++)
+         mcx_writer_done(w,i);
+     pthread_join(w->thread,NULL);
+     pthread_mutex_destroy(&w->lock);
+     pthread_cond_destroy(&w->cond);
+     for(i=0;i<MCX_WRITER_SLOT;i++)
+         free(w->field[i]);
+#ifdef MCX_CONTAINER
+     if(w->error)
+         std::rethrow_exception(w->error);
+#endif
+}
 
+/*
+   the writer thread: a window is saved once every source has added it or
+   ended, normalized by the photons launched in it, and appended to the
+   .mc2 after the previous windows; a run stopped early ends with the last
+   window any source has started
+*/
+void *mcx_writer(void *arg){
+     MCXWriter *w=(MCXWriter *)arg;
+     Config *cfg=w->cfg;
+     size_t fieldlen=w->ses->fieldlen;
+     cl_uint i, slot, isready, isadded;
+     float scale;
+
+     pthread_mutex_lock(&w->lock);
+     while(w->nwritten<w->ses->nwindow){
+         isready=1;
+         isadded=0;
+         for(i=0;i<w->nsource;i++){
+             isready&=(w->nwin[i]>w->nwritten || w->isdone[i]);
+             isadded|=(w->nwin[i]>w->nwritten);
+         }
+         if(!isready){
+             pthread_cond_wait(&w->cond,&w->lock);
+             continue;
+         }
+         if(!isadded)
+             break;
+         pthread_mutex_unlock(&w->lock);
+
+         slot=w->nwritten%MCX_WRITER_SLOT;
+         scale=(cfg->isnormalized ? mcx_field_scale(cfg,w->energy[slot]) : 1.f);
+#ifdef MCX_CONTAINER
+         try{
+#endif
+             if(cfg->isnormalized)
+                 mcx_normalizecells(w->field[slot],scale,fieldlen,cfg);
+             mcx_savedata(w->field[slot],fieldlen,(w->nwritten>0),"mc2",cfg);
+#ifdef MCX_CONTAINER
+         }catch(...){
+             if(!w->error)
+                 w->error=std::current_exception();
+         }
+#endif
+         fprintf(cfg->flog,"- time window %d saved, normalization factor alpha=%f\n",w->nwritten+1,scale);
+         fflush(cfg->flog);
+         memset(w->field[slot],0,sizeof(cl_float)*fieldlen);
+         w->energy[slot]=0.0;
+
+         pthread_mutex_lock(&w->lock);
+         w->nwritten++;
+         pthread_cond_broadcast(&w->cond);
+     }
+     pthread_mutex_unlock(&w->lock);
+     return NULL;
+}
+
+
+/*
+   normalize and save the outputs of a run, then print its statistics
+*/
+void mcx_save_session(MCXSession *ses,Config *cfg,cl_uint tic,cl_uint toc,cl_uint ttransfer){
+     /*every time window launches the same photons, so one window holds 1/nwindow of the
+       total energy; this is the per-window energy the writer thread normalizes with*/
+     float scale=(cfg->isnormalized ? mcx_field_scale(cfg,cfg->energytot/ses->nwindow) : 1.f);
+     if(cfg->isnormalized && cfg->exportfield){
+         fprintf(cfg->flog,"normalizing raw data ...\t");
 	 fprintf(cfg->flog,"normalization factor alpha=%f\n",scale);  fflush(cfg->flog);
-         mcx_normalize(cfg->exportfield,scale,fieldlen);
+         mcx_normalizecells(cfg->exportfield,scale,ses->fieldlen,cfg);
+         if(ses->moment && ses->nmoment>1)
+             mcx_normalizecells(ses->moment,scale,ses->fieldlen,cfg);
      }
-     if(cfg->issave2pt && cfg->parentid==mpStandalone){
-         fprintf(cfg->flog,"saving data to file ... %d %d\t",fieldlen,cfg->maxgate);
-         mcx_savedata(cfg->exportfield,fieldlen,0,"mc2",cfg);
+     if(cfg->issave2pt && cfg->parentid==mpStandalone && !ses->isstream){  //otherwise saved window by window
+         fprintf(cfg->flog,"saving data to file ... %llu %d\t",(unsigned long long)ses->fieldlen,cfg->maxgate);
+         mcx_savedata(cfg->exportfield,ses->fieldlen,0,"mc2",cfg);
+         if(ses->moment && ses->nmoment>1)
+             mcx_savedata(ses->moment,ses->fieldlen,0,"se.mc2",cfg);
          fprintf(cfg->flog,"saving data complete : %d ms\n\n",GetTimeMillis()-tic);
          fflush(cfg->flog);
      }
      if(cfg->issavedet && cfg->parentid==mpStandalone && cfg->exportdetected){
          cfg->his.unitinmm=cfg->unitinmm;
-         cfg->his.savedphoton=cfg->detectedcount;
-         cfg->his.detected=cfg->detectedcount;
+         cfg->his.totalphoton64=cfg->nlaunched;
+         cfg->his.savedphoton64=cfg->detectedcount;
          mcx_savedetphoton(cfg->exportdetected,cfg->seeddata,cfg->detectedcount,0,cfg);
      }
+     if((cfg->issave2pt || cfg->issavedet) && cfg->parentid==mpStandalone)
+         mcx_saveruninfo(cfg,scale,ses->nwindow);
 
      // total energy here equals total simulated photons+unfinished photons for all threads
-     fprintf(cfg->flog,"simulated %d photons (%d) with %d CUs with %d threads (repeat x%d)\nMCX simulation speed: %.2f photon/ms\n",
-             cfg->nphoton,cfg->nphoton,workdev,cfg->nthread, cfg->respin,(double)cfg->nphoton/toc); fflush(cfg->flog);
+     fprintf(cfg->flog,"simulated %llu photons (%llu) with %d CUs with %d threads (repeat x%d)\nMCX simulation speed: %.2f photon/ms\n",
+             (unsigned long long)cfg->nlaunched,(unsigned long long)cfg->nphoton,ses->workdev,(int)ses->totalthread, cfg->respin,(double)cfg->nlaunched/toc); fflush(cfg->flog);
+     fprintf(cfg->flog,"timing: build %d ms, kernel %d ms, transfer %d ms\n",ses->tbuild,toc,ttransfer);
      fprintf(cfg->flog,"total simulated energy: %.2f\tabsorbed: %5.5f%%\n(loss due to initial specular reflection is excluded in the total)\n",
              cfg->energytot,(cfg->energytot-cfg->energyesc)/cfg->energytot*100.f);fflush(cfg->flog);
      fflush(cfg->flog);
+}
 
-     clReleaseMemObject(gmedia);
-     clReleaseMemObject(gproperty);
-     clReleaseMemObject(gparam);
 
-     for(i=0;i<workdev;i++){
-         clReleaseMemObject(gfield[i]);
-         clReleaseMemObject(gseed[i]);
-         clReleaseMemObject(genergy[i]);
-         clReleaseMemObject(gstopsign[i]);
-         clReleaseMemObject(gdetected[i]);
-         clReleaseMemObject(gdetpos[i]);
-         clReleaseKernel(mcxkernel[i]);
-     }
-     free(gfield);
-     free(gseed);
-     free(genergy);
-     free(gstopsign);
-     free(gdetected);
-     free(gdetpos);
-     free(mcxkernel);
-
-     free(waittoread);
-
-     for(devid=0;devid<workdev;devid++)
-        clReleaseCommandQueue(mcxqueue[devid]);
-
-     free(mcxqueue);
-     clReleaseProgram(mcxprogram);
-     clReleaseContext(mcxcontext);
+/*
+   run up to npack sweep runs in the same launches (-P): every run gets an
+   equal range of the work-groups of each launch and its own source, photon
+   number, properties, field slice and detected photon slots, selected in
+   the kernel by the problem id of the thread; the launches are synchronous,
+   the packed runs are meant for volumes too small to need the pipeline
+*/
+void mcx_run_packed(MCXSession *ses,Config *runs,cl_uint nrun){
+     Config *cfg=runs;  //the settings shared by all packed runs
+     cl_uint i,j,r,win,iter,tic,tic0,toc,ttransfer=0,zero=0,respin=ses->respin;
+     cl_uint detreclen=cfg->medianum+1, layer=ses->param.dimlen.y, nproblem=nrun;
+     cl_float zerof=0.f;
+     size_t idx, pthread[MAX_DEVICE], gthread[MAX_DEVICE];
+     Medium *prop=(Medium*)malloc(sizeof(Medium)*cfg->medianum*nrun);
+     MCXProblem *problem=(MCXProblem*)calloc(nrun,sizeof(MCXProblem));
+     cl_uint *ndet=(cl_uint*)malloc(sizeof(cl_uint)*nrun);
+     cl_float *energy=(cl_float*)malloc(sizeof(cl_float)*(ses->maxthread<<1));
+     cl_float *stage=(cfg->issave2pt ? (cl_float*)malloc(sizeof(cl_float)*ses->fieldlen*nrun) : NULL);
+     double *winenergy=(double*)calloc(nrun,sizeof(double));  //the energy launched by each run before the current time window
+     float *record=(cfg->issavedet ? (float*)malloc(sizeof(float)*cfg->maxdetphoton*detreclen) : NULL);
+     MCXParam devparam=ses->param;
+     cl_uint seedstate;
+
+     tic=StartTimer();
+     for(i=0;i<ses->workdev;i++){
+         pthread[i]=(ses->mcgrid[i]/ses->mcblock[i]/nrun)*ses->mcblock[i];
+         gthread[i]=pthread[i]*nrun;
+         if(pthread[i]==0)
+             mcx_error(-1,(char*)"too few work-groups to pack the runs, please use a smaller -P or a larger -t",__FILE__,__LINE__);
+     }
+     /*all runs share the launches, the busiest thread of any run sets the repetitions*/
+     for(r=0;r<nrun;r++)
+         for(i=0;i<ses->workdev;i++){
+             double threadload=(double)runs[r].nphoton*ses->workload[i]/ses->fullload/pthread[i];
+             if(threadload/respin+1.0>=MCX_MAX_THREADPHOTON)
+                 respin=(cl_uint)(threadload/(MCX_MAX_THREADPHOTON-2))+1;
+         }
+     if(respin!=ses->respin)
+         fprintf(cfg->flog,"- repetition number is raised to %d, a thread can run at most %d photons per launch\n",
+             respin,MCX_MAX_THREADPHOTON-1);
+
+     for(r=0;r<nrun;r++){
+         Config *run=runs+r;
+         if(run->exportfield==NULL && run->issave2pt)
+             run->exportfield=(float *)calloc(sizeof(float),ses->fieldlen);
+         if(run->exportdetected==NULL && run->issavedet)
+             run->exportdetected=(float*)malloc(detreclen*run->maxdetphoton*sizeof(float));
+         run->respin=respin;
+         run->energytot=0.f;
+         run->energyesc=0.f;
+         run->runtime=0;
+         run->detectedcount=0;
+         run->his.detected64=0;
+         memcpy(prop+r*cfg->medianum,run->prop,cfg->medianum*sizeof(Medium));
+
+         problem[r].ps.s[0]=run->srcpos.x;
+         problem[r].ps.s[1]=run->srcpos.y;
+         problem[r].ps.s[2]=run->srcpos.z;
+         problem[r].ps.s[3]=1.f;
+         problem[r].c0.s[0]=run->srcdir.x;
+         problem[r].c0.s[1]=run->srcdir.y;
+         problem[r].c0.s[2]=run->srcdir.z;
+         problem[r].idx1dorig=(int(floorf(run->srcpos.z))*layer+int(floorf(run->srcpos.y))*ses->param.dimlen.x+int(floorf(run->srcpos.x)));
+         problem[r].mediaidorig=(cfg->vol[problem[r].idx1dorig] & MED_MASK);
+     }
+     for(j=0;j<ses->nplatform;j++){
+         for(i=0;ses->devplat[i]!=j;i++);
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gproperty[j],CL_TRUE,0,cfg->medianum*nrun*sizeof(Medium),
+                                            prop, 0, NULL, NULL)));
+     }
+
+     seedstate=(cfg->seed>0 ? (cl_uint)cfg->seed : (cl_uint)time(0));
+
+     for(i=0;i<ses->workdev;i++){
+         for(r=0;r<nrun;r++){
+             double devphoton=(double)runs[r].nphoton*ses->workload[i]/((double)ses->fullload*respin);
+             problem[r].threadphoton=(cl_uint)(devphoton/pthread[i]);
+             problem[r].oddphotons=(cl_uint)(devphoton-(double)problem[r].threadphoton*pthread[i]);
+         }
+         OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gproblem[i],CL_TRUE,0,nrun*sizeof(MCXProblem),
+                                            problem, 0, NULL, NULL)));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 0, sizeof(cl_uint),(void*)&zero)));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 1, sizeof(cl_uint),(void*)&zero)));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 4, sizeof(cl_mem), (void*)(ses->genergy+i*MCX_BUFNUM))));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 5, sizeof(cl_mem), (void*)(ses->gseed+i*MCX_BUFNUM))));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i], 6, sizeof(cl_mem), (void*)(ses->gdetphoton+i*MCX_BUFNUM))));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],10, sizeof(cl_mem), (void*)(ses->gdetected+i*MCX_BUFNUM))));
+         OCL_ASSERT((clSetKernelArg(ses->mcxkernel[i],14, sizeof(cl_uint), (void*)&nproblem)));
+         fprintf(cfg->flog,"- [device %d] %d run(s) x %d threads, nblocksize=%d repetition=%d\n",i,
+               nrun,(int)pthread[i],(int)ses->mcblock[i],respin);
+     }
+
+     fprintf(cfg->flog,"lauching %d packed run(s) on %d device(s) for %d time window(s) x%d repetition(s) ...\n",
+         nrun,ses->workdev,ses->nwindow,respin);
+     fflush(cfg->flog);
+     tic0=GetTimeMillis();
+
+     devparam.twin0=cfg->tstart;
+     for(win=0;win<ses->nwindow;win++){
+         devparam.twin1=devparam.twin0+cfg->tstep*cfg->maxgate;
+         for(i=0;i<ses->workdev;i++){
+             OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gparam[i],CL_TRUE,0,sizeof(MCXParam),
+                                            &devparam, 0, NULL, NULL)));
+             OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gfield[i*MCX_BUFNUM],&zerof,sizeof(cl_float),0,
+                                            sizeof(cl_float)*ses->fieldlen*nrun, 0, NULL, NULL)));
+         }
+         for(iter=0;iter<respin;iter++){
+             for(i=0;i<ses->workdev;i++){
+                 j=i*MCX_BUFNUM;
+                 if(win+iter==0 || respin>1){  //without -r, all time windows replay the same photons
+                     for(idx=0;idx<ses->mcgrid[i]*RAND_SEED_LEN;idx++)
+                         ses->Pseed[idx]=rand_r(&seedstate);
+                     OCL_ASSERT((clEnqueueWriteBuffer(ses->mcxqueue[i],ses->gseed[j],CL_TRUE,0,sizeof(cl_uint)*ses->mcgrid[i]*RAND_SEED_LEN,
+                                            ses->Pseed, 0, NULL, NULL)));
+                 }
+                 OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->gdetected[j],&zero,sizeof(cl_uint),0,sizeof(cl_uint)*nrun, 0, NULL, NULL)));
+                 OCL_ASSERT((clEnqueueFillBuffer(ses->mcxqueue[i],ses->genergy[j],&zerof,sizeof(cl_float),0,sizeof(cl_float)*(gthread[i]<<1), 0, NULL, NULL)));
+                 OCL_ASSERT((clEnqueueNDRangeKernel(ses->mcxqueue[i],ses->mcxkernel[i],1,NULL,gthread+i,ses->mcblock+i, 0, NULL, NULL)));
+                 OCL_ASSERT((clFlush(ses->mcxqueue[i])));
+             }
+             for(i=0;i<ses->workdev;i++){
+                 j=i*MCX_BUFNUM;
+                 OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gdetected[j],CL_TRUE,0,sizeof(cl_uint)*nrun,
+                                            ndet, 0, NULL, NULL)));
+                 OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->genergy[j],CL_TRUE,0,sizeof(cl_float)*(gthread[i]<<1),
+                                            energy, 0, NULL, NULL)));
+                 for(idx=0;idx<gthread[i];idx++){
+                     runs[idx/pthread[i]].energyesc+=energy[idx<<1];
+                     runs[idx/pthread[i]].energytot+=energy[(idx<<1)+1];
+                 }
+                 for(r=0;r<nrun && cfg->issavedet;r++){
+                     Config *run=runs+r;
+                     cl_uint nrecord=MIN(ndet[r],cfg->maxdetphoton);
+                     run->his.detected64+=ndet[r];
+                     if(ndet[r]>cfg->maxdetphoton)
+                         fprintf(cfg->flog,"WARNING: the detected photon (%d) \
+is more than what your have specified (%d), please use the -H option to specify a greater number\n"
+                                 ,ndet[r],cfg->maxdetphoton);
+                     if(nrecord==0 || run->exportdetected==NULL)
+                         continue;
+                     OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gdetphoton[j],CL_TRUE,sizeof(float)*r*cfg->maxdetphoton*detreclen,
+                                            sizeof(float)*nrecord*detreclen, record, 0, NULL, NULL)));
+                     run->exportdetected=(float*)realloc(run->exportdetected,(run->detectedcount+nrecord)*detreclen*sizeof(float));
+                     memcpy(run->exportdetected+run->detectedcount*detreclen,record,nrecord*detreclen*sizeof(float));
+                     run->detectedcount+=nrecord;
+                 }
+             }
+             fprintf(cfg->flog,"- window %d run#%2d: %d packed run(s) complete\n",win+1,iter+1,nrun);
+             fflush(cfg->flog);
+         }
+         //the field of run r is the r-th slice of the packed field
+         for(i=0;i<ses->workdev && cfg->issave2pt;i++){
+             OCL_ASSERT((clEnqueueReadBuffer(ses->mcxqueue[i],ses->gfield[i*MCX_BUFNUM],CL_TRUE,0,sizeof(cl_float)*ses->fieldlen*nrun,
+                                            stage, 0, NULL, NULL)));
+             for(r=0;r<nrun;r++){
+                 cl_float *runfield=stage+(size_t)r*ses->fieldlen;
+                 if(runs[r].exportfield)
+                     for(idx=0;idx<ses->fieldlen;idx++)
+                         runs[r].exportfield[idx]+=runfield[idx];
+             }
+         }
+         /*as the writer thread does, each window is normalized by the energy launched in it and appended to the .mc2*/
+         for(r=0;r<nrun && ses->isstream;r++){
+             Config *run=runs+r;
+             double energy=run->energytot-winenergy[r];
+             winenergy[r]=run->energytot;
+             if(run->exportfield==NULL)
+                 continue;
+             if(run->isnormalized)
+                 mcx_normalizecells(run->exportfield,mcx_field_scale(run,energy),ses->fieldlen,run);
+             mcx_savedata(run->exportfield,ses->fieldlen,(win>0),"mc2",run);
+             memset(run->exportfield,0,sizeof(float)*ses->fieldlen);
+         }
+         devparam.twin0=devparam.twin1;
+     }
+     toc=GetTimeMillis()-tic0;
+
+     for(r=0;r<nrun;r++){
+         fprintf(cfg->flog,"- packed run %d: %s\n",r+1,runs[r].session);
+         if(runs[r].issavedet)
+             fprintf(cfg->flog,"detected %llu photons, saved %llu\n",runs[r].his.detected64,(unsigned long long)runs[r].detectedcount);
+         runs[r].nlaunched=runs[r].nphoton;
+         mcx_save_session(ses,runs+r,tic,toc,ttransfer);
+     }
+     free(prop);
+     free(problem);
+     free(ndet);
+     free(energy);
+     free(stage);
+     free(winenergy);
+     free(record);
+}
+
+
+/*
+   release the OpenCL state and the host buffers of a session
+*/
+void mcx_release_session(MCXSession *ses){
+     cl_uint i,j,devid;
+
+     for(j=0;j<ses->nplatform;j++)
+         clReleaseMemObject(ses->gproperty[j]);
+     for(j=0;j<(ses->issplit ? ses->workdev : ses->nplatform);j++)
+         clReleaseMemObject(ses->gmedia[j]);
+     if(ses->issplit){
+         for(i=0;i<ses->workdev;i++){
+             clReleaseMemObject(ses->gimport[i]);
+             clReleaseMemObject(ses->gexport[i]);
+             clReleaseMemObject(ses->gexportnum[i]);
+         }
+         free(ses->gimport);
+         free(ses->gexport);
+         free(ses->gexportnum);
+     }
+     if(ses->npack>1){
+         for(i=0;i<ses->workdev;i++)
+             clReleaseMemObject(ses->gproblem[i]);
+         free(ses->gproblem);
+     }
+     if(ses->isprecroi){
+         for(i=0;i<ses->workdev*MCX_BUFNUM;i++)
+             clReleaseMemObject(ses->gtally[i]);
+         free(ses->gtally);
+     }
+     if(ses->gmoment){
+         for(i=0;i<ses->workdev;i++){
+             clReleaseMemObject(ses->gbatch[i]);
+             clReleaseMemObject(ses->gmoment[i]);
+             clReleaseMemObject(ses->glaunched[i]);
+             clReleaseKernel(ses->momentkernel[i]);
+             clReleaseKernel(ses->launchkernel[i]);
+         }
+         free(ses->gbatch);
+         free(ses->gmoment);
+         free(ses->glaunched);
+         free(ses->momentkernel);
+         free(ses->launchkernel);
+         free(ses->moment);
+     }
+
+     for(i=0;i<ses->workdev*MCX_BUFNUM;i++){
+         if(ses->gfield[i])
+             clReleaseMemObject(ses->gfield[i]);
+         clReleaseMemObject(ses->gdetphoton[i]);
+         clReleaseMemObject(ses->gseed[i]);
+         clReleaseMemObject(ses->genergy[i]);
+         clReleaseMemObject(ses->gdetected[i]);
+     }
+     for(i=0;i<ses->workdev;i++){
+         clReleaseMemObject(ses->gparam[i]);
+         clReleaseMemObject(ses->gstopsign[i]);
+         clReleaseMemObject(ses->gdetpos[i]);
+         clReleaseKernel(ses->mcxkernel[i]);
+     }
+     free(ses->gparam);
+     free(ses->gfield);
+     free(ses->gdetphoton);
+     free(ses->gseed);
+     free(ses->genergy);
+     free(ses->gstopsign);
+     free(ses->gdetected);
+     free(ses->gdetpos);
+     free(ses->mcxkernel);
+
+     free(ses->workload);
+     free(ses->devspeed);
+     free(ses->devphoton);
+     free(ses->devseed);
+     free(ses->devdetcount);
+     free(ses->devdetected);
+     free(ses->devenergy);
+     free(ses->devdet);
+     free(ses->devzerocopy);
+     free(ses->mcgrid);
+     free(ses->mcblock);
+
+     for(devid=0;devid<ses->workdev;devid++){
+        clReleaseCommandQueue(ses->mcxqueue[devid]);
+        clReleaseCommandQueue(ses->mcxcopyq[devid]);
+        clReleaseCommandQueue(ses->mcxctrlq[devid]);
+     }
+
+     free(ses->mcxqueue);
+     free(ses->mcxcopyq);
+     free(ses->mcxctrlq);
+     for(j=0;j<ses->nplatform;j++){
+         clReleaseProgram(ses->mcxprogram[j]);
+         clReleaseContext(ses->mcxcontext[j]);
+     }
 #ifndef USE_OS_TIMER
-     clReleaseEvent(kernelevent);
+     if(kernelevent)
+         clReleaseEvent(kernelevent);
+     kernelevent=NULL;
 #endif
-     free(Pseed);
-     free(energy);
-     free(field);
+     free(ses->Pseed);
+     free(ses->field);
+}
+
+
+/*
+   master driver code to run MC simulations
+*/
+void mcx_run_simulation(Config *cfg,float *fluence,float *totalenergy){
+     MCXSession ses;
+
+     mcx_init_session(&ses,cfg);
+     mcx_run_session(&ses,cfg);
+     mcx_release_session(&ses);
+}
+
+
+/*
+   run every line of the sweep file (--sweep) on one session: the devices,
+   the kernel and the media are set up once, and each run only uploads its
+   source, properties and seeds; a field left as '-' keeps the value of the
+   input file, and each run saves its outputs under its own session name;
+   with -P n, up to n runs are read ahead and simulated in the same launches
+*/
+void mcx_run_sweep(Config *cfg){
+     MCXSession ses;
+     FILE *fp=fopen(cfg->sweepfile,"rt");
+     size_t nphoton=cfg->nphoton;
+     float4 srcpos=cfg->srcpos, srcdir=cfg->srcdir;
+     Medium *prop=(Medium*)malloc(cfg->medianum*sizeof(Medium));
+     int run=0;
+
+     if(fp==NULL)
+         mcx_error(-2,(char*)"can not open the sweep file",__FILE__,__LINE__);
+     memcpy(prop,cfg->prop,cfg->medianum*sizeof(Medium));
+
+     mcx_init_session(&ses,cfg);
+     if(ses.npack>1){
+         Config *runs=(Config*)malloc(sizeof(Config)*ses.npack);
+         cl_uint nrun, r;
+         do{
+             for(nrun=0;nrun<ses.npack && mcx_readsweep(fp,cfg);nrun++){
+                 fprintf(cfg->flog,"- sweep run %d: %s\n",++run,cfg->session);
+                 runs[nrun]=*cfg;  //each run keeps its own properties and outputs
+                 runs[nrun].prop=(Medium*)malloc(cfg->medianum*sizeof(Medium));
+                 memcpy(runs[nrun].prop,cfg->prop,cfg->medianum*sizeof(Medium));
+                 runs[nrun].exportfield=NULL;
+                 runs[nrun].exportdetected=NULL;
+
+                 cfg->nphoton=nphoton;
+                 cfg->srcpos=srcpos;
+                 cfg->srcdir=srcdir;
+                 memcpy(cfg->prop,prop,cfg->medianum*sizeof(Medium));
+             }
+             if(nrun)
+                 mcx_run_packed(&ses,runs,nrun);
+             for(r=0;r<nrun;r++){
+                 free(runs[r].prop);
+                 free(runs[r].exportfield);
+                 free(runs[r].exportdetected);
+             }
+         }while(nrun==ses.npack && !mcx_stop_requested());
+         free(runs);
+     }else
+     while(!mcx_stop_requested() && mcx_readsweep(fp,cfg)){
+         fprintf(cfg->flog,"- sweep run %d: %s\n",++run,cfg->session);
+         if(cfg->exportfield)
+             memset(cfg->exportfield,0,sizeof(float)*ses.fieldlen);
+         mcx_update_session(&ses,cfg);
+         mcx_run_session(&ses,cfg);
+
+         cfg->nphoton=nphoton;  //the next run starts from the input file again
+         cfg->srcpos=srcpos;
+         cfg->srcdir=srcdir;
+         memcpy(cfg->prop,prop,cfg->medianum*sizeof(Medium));
+     }
+     mcx_release_session(&ses);
+     fprintf(cfg->flog,"sweep complete: %d run(s)\n",run);
+     fclose(fp);
+     free(prop);
 }
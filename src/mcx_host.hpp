@@ -3,6 +3,10 @@
 
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS
 #include <CL/cl.h>
+#include <pthread.h>
+#ifdef MCX_CONTAINER
+  #include <exception>
+#endif
 #include "mcx_utils.h"
 
 #ifdef  __cplusplus
@@ -10,6 +14,7 @@ extern "C" {
 #endif
 
 #define MIN(a,b)           ((a)<(b)?(a):(b))
+#define MAX(a,b)           ((a)>(b)?(a):(b))
 #define MCX_RNG_NAME       "Logistic-Lattice"
 #define RAND_SEED_LEN      5        //32bit seed length (32*5=160bits)
 #define RO_MEM             (CL_MEM_READ_ONLY  | CL_MEM_COPY_HOST_PTR)
@@ -17,6 +22,25 @@ extern "C" {
 #define RW_MEM             (CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR)
 #define RW_PTR             (CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR)
 
+#define MCX_TUNE_FILE      ".mcxcl_tune"   //tuned launch sizes, stored in the home folder
+#define MCX_TUNE_PHOTON    1048576  //max photons per calibration launch
+#define MCX_TUNE_MAXWAVE   32       //max work-groups per compute unit to try
+#define MCX_TUNE_BUFNUM    8        //scratch buffers of a calibration kernel
+#define MCX_CALIB_SHARE    16       //a calibration launch simulates 1/16 of a device's photons
+#define MCX_MAX_THREADPHOTON 16777216 //2^24, photons per thread per launch, counted exactly in a float
+#define MCX_BUFNUM         2        //per-launch buffer sets of a device, double-buffered
+#define MCX_HANDOFF_LEN    11       //floats of a handed-over photon before its partial paths, as in mcx_core.cl
+#define MCX_MAX_HANDOFF    1048576  //max photons per launch with -X 1, all of them may cross a slab at once
+#define MCX_MEM_USABLE     0.9      //share of the device memory the memory plan may use
+#define MCX_MB             1048576.0
+#define MCX_MONITOR_MS     200      //polling period of the progress and of the stop requests
+#define MCX_PROGRESS_LEN   50       //width of the progress bar
+#define MCX_PRECISION_MINBATCH 4    //batches before the precision of -E is trusted
+#define MCX_SUM_GROUP      256      //largest work-group of mcx_sum_launched, a power of 2
+#define MCX_WRITER_SLOT    2        //time windows held by the output writer, one is filled while the other is saved
+#define MCX_CKPT_MAGIC     "MCXCKPT"   //first bytes of a checkpoint file
+#define MCX_CKPT_VERSION   2
+
 #define OCL_ASSERT(x)  ocl_assess((x),__FILE__,__LINE__)
 
 
@@ -38,13 +62,172 @@ typedef struct KernelParams {
   cl_uint detnum;
   cl_uint idx1dorig;
   cl_uint mediaidorig;
+  cl_uint slabstart;
+  cl_uint slabend;
+  cl_uint mediaoffset;
+  cl_uint4 roi0,roi1;
+  cl_uint4 outroi0,outroidim,outbin,reserved;
+}MCXParam __attribute__ ((aligned (16)));
+
+typedef struct ProblemParams {
+  cl_float4 ps,c0;
+  cl_uint idx1dorig;
+  cl_uint mediaidorig;
   cl_uint threadphoton;
   cl_uint oddphotons;
-}MCXParam __attribute__ ((aligned (16)));
+}MCXProblem __attribute__ ((aligned (16)));
+
+/*
+   the OpenCL state of a run: the contexts, programs, kernels and buffers
+   built by mcx_init_session are reused by every mcx_run_session call of a
+   sweep, only the per-run data (source, properties, seeds) is uploaded again
+*/
+typedef struct MCXSession {
+  MCXParam   param;                       //kernel constants of the current run
+  cl_uint    workdev,nplatform,nwindow,nfield;
+  cl_uint    isbalance,issplit,srcdev,handoffcap,respin;
+  cl_uint    npack;                       //sweep runs per launch, each with its own source, properties and outputs
+  cl_uint    isprecroi;                   //-E monitors the energy deposited in a box, not the detected photons
+  cl_uint    isoutroi;                    //the field only covers the box of -O, or is binned by -N
+  cl_uint    isstream;                    //each time window is saved once complete, by the writer thread or by mcx_run_packed
+  cl_uint    nbatch;                      //batches (launches of a device) collected with -E
+  double     batchstat[5];                //sums of y, n, y^2, y*n and n^2 over the batches
+  cl_uint    nmoment;                     //launches added to the second moment with -V
+  double     momentphoton;                //photons actually launched by these launches
+  cl_uint    tbuild;
+  volatile cl_uint stopsign;              //set when the run is stopped early, no further launch is enqueued
+  volatile cl_uint ckptseq;               //raised by the monitor thread when a checkpoint is due (-C)
+  cl_uint    devplat[MAX_DEVICE];         //platform index of each active device
+  cl_uint    slab0[MAX_DEVICE],slab1[MAX_DEVICE];  //z-layers [slab0,slab1) owned by each device with -X 1
+  cl_context mcxcontext[MAX_DEVICE];      //one per platform
+  cl_program mcxprogram[MAX_DEVICE];      //built per platform
+  cl_command_queue *mcxqueue;             //compute command queues
+  cl_command_queue *mcxcopyq;             //transfer command queues, overlap with the kernels
+  cl_command_queue *mcxctrlq;             //stop flag and progress counter, used by the monitor thread only
+  cl_kernel  *mcxkernel;
+  cl_mem     gmedia[MAX_DEVICE],gproperty[MAX_DEVICE],*gparam;  //gmedia/gproperty: one per platform, or gmedia per slab
+  cl_mem     *gfield,*gdetphoton,*gseed,*genergy;  //MCX_BUFNUM sets per device
+  cl_mem     *gstopsign,*gdetected,*gdetpos;  //gstopsign: {stop flag, completed photons/work-group size}
+  cl_mem     *gimport,*gexport,*gexportnum;  //photons handed over between the slabs
+  cl_mem     *gproblem;                   //sources and photon numbers of the packed runs with -P
+  cl_mem     *gtally;                     //per-thread energy deposited in the box of -E, MCX_BUFNUM sets per device
+  cl_mem     *gbatch,*gmoment,*glaunched; //field of the current launch, its second moment and its launched photons with -V, one per device
+  cl_kernel  *momentkernel,*launchkernel; //mcx_add_moment and mcx_sum_launched, one per device with -V
+  size_t     sumgroup[MAX_DEVICE];        //work-group of mcx_sum_launched on each device
+  cl_float   fullload,*workload,*devspeed;
+  cl_ulong   *devphoton,*devdetected;
+  cl_uint    *devseed,*Pseed;
+  size_t     *devdetcount,*mcgrid,*mcblock;
+  size_t     maxthread,totalthread,dimxyz,outlen,fieldlen;  //outlen: voxels of a time gate of the field
+  char       *devzerocopy;
+  double     *devenergy;
+  float      **devdet;
+  cl_float   *field;                      //one field per device for the final reduction
+  cl_float   *moment;                     //second moment of the field summed over the devices, then its standard error
+} MCXSession;
+
+/*
+   the state of a run shared with its monitor thread
+*/
+typedef struct MCXMonitor {
+  MCXSession *ses;
+  Config     *cfg;
+  cl_ulong   total;                       //photons of all launches of the run
+  cl_uint    tic;                         //start of the run, for the time budget (-w)
+  volatile int isdone;                    //set once the launches are collected
+} MCXMonitor;
+
+/*
+   the header of the checkpoint of a device, followed by the field of its
+   window (with -S 1) and its detected photon records
+*/
+typedef struct MCXCheckpointHeader {
+  char       magic[8];                    //MCX_CKPT_MAGIC
+  cl_uint    version,devid,workdev,respin;
+  cl_uint    nextlaunch;                  //the launches before it are in the checkpoint
+  cl_uint    seedstate;                   //state of the seeds of the device before those of nextlaunch
+  cl_uint    detreclen,issave2pt;
+  cl_ulong   nphoton,fieldlen,detected,ndetrecord;
+  double     energy[2];                   //escaped and launched energy of the device
+} MCXCheckpoint;
+
+/*
+   the time windows of a run on their way to the .mc2: a window is summed
+   over the sources (the devices, or the host thread with -X 1) in a slot,
+   then normalized and appended by the writer thread once every source has
+   added it or ended
+*/
+typedef struct MCXWriter {
+  MCXSession *ses;
+  Config     *cfg;
+  cl_float   *field[MCX_WRITER_SLOT];     //window win is kept in slot win%MCX_WRITER_SLOT
+  double     energy[MCX_WRITER_SLOT];     //photons launched in the window
+  cl_uint    nsource,nwritten;
+  cl_uint    nwin[MAX_DEVICE];            //windows added by each source
+  char       isdone[MAX_DEVICE];          //the source adds no further window
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;                   //a window was added or written
+  pthread_t  thread;
+#ifdef MCX_CONTAINER
+  std::exception_ptr error;               //an error of the writer thread, rethrown by mcx_writer_finish
+#endif
+} MCXWriter;
+
+#ifdef MCX_CONTAINER
+/*
+   with MCX_CONTAINER, mcx_error throws this through mcx_throw_exception
+*/
+typedef struct MCXCLErrorInfo{
+  int  id;
+  char msg[MAX_PATH_LENGTH];
+} MCXCLError;
+#endif
 
 void mcx_run_simulation(Config *cfg,float *fluence,float *totalenergy);
-cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *activedevlist);
+void mcx_init_session(MCXSession *ses,Config *cfg);
+void mcx_update_session(MCXSession *ses,Config *cfg);
+void mcx_run_session(MCXSession *ses,Config *cfg);
+void mcx_run_packed(MCXSession *ses,Config *runs,cl_uint nrun);
+void mcx_save_session(MCXSession *ses,Config *cfg,cl_uint tic,cl_uint toc,cl_uint ttransfer);
+void mcx_standard_error(MCXSession *ses,Config *cfg);
+float mcx_field_scale(Config *cfg,double energy);
+void mcx_save_checkpoint(MCXSession *ses,Config *cfg,cl_uint devid,cl_uint nextlaunch,cl_uint seedstate,const cl_float *field);
+cl_uint mcx_load_checkpoint(MCXSession *ses,Config *cfg,cl_uint devid,cl_uint nlaunch,cl_uint *seedstate,cl_float **field);
+void mcx_writer_start(MCXWriter *w,MCXSession *ses,Config *cfg,cl_uint nsource);
+void mcx_writer_add(MCXWriter *w,cl_uint src,cl_uint win,const cl_float *field,double energy);
+void mcx_writer_done(MCXWriter *w,cl_uint src);
+void mcx_writer_finish(MCXWriter *w);
+void *mcx_writer(void *arg);
+void mcx_release_session(MCXSession *ses);
+void *mcx_monitor(void *arg);
+void mcx_stop_run(MCXSession *ses);
+void mcx_add_batch(MCXSession *ses,Config *cfg,double y,double n);
+void mcx_request_stop(int isstop);
+int  mcx_stop_requested(void);
+void mcx_run_sweep(Config *cfg);
+cl_platform_id mcx_list_gpu(Config *cfg,unsigned int *activedev,cl_device_id *activedevlist,cl_platform_id *activeplatformlist);
 void ocl_assess(int cuerr,const char *file,const int linenum);
+cl_ulong mcx_hash(cl_ulong hash,const char *str);
+int  mcx_tunefile(char *fname,size_t len);
+int  mcx_loadtune(cl_ulong key,size_t *nthread,size_t *nblock);
+void mcx_savetune(cl_ulong key,size_t nthread,size_t nblock,float speed,const char *devname);
+cl_kernel mcx_tunekernel(Config *cfg,cl_context context,cl_command_queue queue,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,size_t maxthread,cl_mem *scratch);
+void mcx_tunerelease(cl_kernel kernel,cl_mem *scratch);
+float mcx_tunelaunch(cl_command_queue queue,cl_kernel kernel,size_t nthread,size_t nblock,
+                     cl_uint nphoton,cl_uint maxmedia,int issavedet);
+void mcx_tune_device(Config *cfg,cl_context context,cl_command_queue queue,cl_device_id dev,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,cl_ulong key,
+                     size_t *nthread,size_t *nblock,float *speed);
+float mcx_calibrate_device(Config *cfg,cl_context context,cl_command_queue queue,cl_program program,
+                     cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,
+                     size_t nthread,size_t nblock,cl_uint nphoton);
+void mcx_launchsize(Config *cfg,cl_context context,cl_command_queue queue,cl_device_id dev,cl_program program,
+                     const char *opt,cl_mem gmedia,cl_mem gproperty,cl_mem gparam,MCXParam *param,
+                     size_t *nthread,size_t *nblock,float *speed);
+void mcx_plan_memory(Config *cfg,cl_device_id *devices,cl_uint workdev,int issplit,cl_uint *slab0,cl_uint *slab1,
+                     char *devzerocopy,cl_uint npack);
+cl_ulong mcx_setphoton(Config *cfg,cl_kernel kernel,size_t nthread,float load,float fullload);
 
 #ifdef  __cplusplus
 }
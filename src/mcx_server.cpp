@@ -0,0 +1,388 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcx_server.cpp: mcxcld, a job server keeping the devices, the kernels and
+**                  the volumes of recent jobs between the simulations
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mcx_host.hpp"
+#include "mcx_server.h"
+#include "mcxcl_lib.h"
+
+#ifndef MCX_CONTAINER
+  #error "mcxcld must be built with -DMCX_CONTAINER, otherwise an error of a job ends the server"
+#endif
+
+/*
+   a job of the queue: the parsed configuration and the connection of its
+   client, which receives the log and the final status line
+*/
+typedef struct MCXServerJob{
+     Config cfg;
+     int    fd;
+     unsigned int id;
+     struct MCXServerJob *next;
+} MCXJob;
+
+/*
+   a session kept by a worker: the configuration of the job that built it
+   (its volume and detectors decide which later jobs may reuse it) and the
+   gate group it asked for, before the memory plan set it
+*/
+typedef struct MCXServerSlot{
+     Config     cfg;
+     MCXSession ses;
+     unsigned int maxgate;
+     unsigned int lastuse;
+     int        isused;
+} MCXSlot;
+
+typedef struct MCXServerWorker{
+     pthread_t  thread;
+     char       deviceid[MAX_DEVICE];   //the one device of the worker, in -G form
+     unsigned int id, ncache, clock;
+     MCXSlot    *slot;
+} MCXWorker;
+
+static pthread_mutex_t jobmutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobready=PTHREAD_COND_INITIALIZER;
+static MCXJob *jobqueue=NULL;
+
+/*
+   send the last line of a job, the client takes its status from it
+*/
+static void mcx_server_done(int fd,int status,const char *msg){
+     char line[MAX_PATH_LENGTH+64];
+     int len=snprintf(line,sizeof(line),"%s %d %s\n",MCX_SERVER_DONE,status,msg);
+     if(write(fd,line,MIN(len,(int)sizeof(line)-1))<0)
+         fprintf(stderr,"mcxcld: client left before the end of its job\n");
+     close(fd);
+}
+
+/*
+   a later job can reuse a session when everything built into the kernel,
+   the buffers and the constant parameters is the same; the source, the
+   optical properties, the photon number, the seed and the outputs may differ
+*/
+static int mcx_server_match(MCXSlot *slot,Config *cfg){
+     Config *old=&slot->cfg;
+     size_t dimxyz=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z;
+
+     return (slot->isused && memcmp(&old->dim,&cfg->dim,sizeof(uint4))==0
+          && memcmp(&old->steps,&cfg->steps,sizeof(float4))==0
+          && memcmp(&old->crop0,&cfg->crop0,sizeof(uint4))==0 && memcmp(&old->crop1,&cfg->crop1,sizeof(uint4))==0
+          && old->medianum==cfg->medianum && old->detnum==cfg->detnum
+          && old->tstart==cfg->tstart && old->tend==cfg->tend && old->tstep==cfg->tstep
+          && slot->maxgate==cfg->maxgate && old->maxdetphoton==cfg->maxdetphoton
+          && old->nthread==cfg->nthread && old->nblocksize==cfg->nblocksize
+          && old->issavedet==cfg->issavedet && old->issave2pt==cfg->issave2pt
+          && old->isreflect==cfg->isreflect && old->isrefint==cfg->isrefint && old->zerocopy==cfg->zerocopy
+          && old->minenergy==cfg->minenergy && old->sradius==cfg->sradius && old->unitinmm==cfg->unitinmm
+          && old->respin==cfg->respin && (old->precision>0.f)==(cfg->precision>0.f)
+          && memcmp(old->precbox,cfg->precbox,sizeof(cfg->precbox))==0 && old->issavese==cfg->issavese
+          && memcmp(old->outroi,cfg->outroi,sizeof(cfg->outroi))==0 && memcmp(old->tallybin,cfg->tallybin,sizeof(cfg->tallybin))==0
+          && strcmp(old->compileropt,cfg->compileropt)==0
+          && memcmp(old->detpos,cfg->detpos,cfg->detnum*sizeof(float4))==0
+          && memcmp(old->vol,cfg->vol,dimxyz)==0);
+}
+
+static void mcx_server_evict(MCXSlot *slot){
+     if(slot->isused){
+         mcx_release_session(&slot->ses);
+         mcx_clearcfg(&slot->cfg);
+     }
+     slot->isused=0;
+}
+
+/*
+   take the first job matching a cached session of the worker, so that the
+   jobs on the same volume stay on the device holding it, or else the oldest
+*/
+static MCXJob *mcx_server_take(MCXWorker *w){
+     MCXJob **prev, **pick=NULL, *job;
+     unsigned int i;
+
+     pthread_mutex_lock(&jobmutex);
+     while(jobqueue==NULL)
+         pthread_cond_wait(&jobready,&jobmutex);
+     for(prev=&jobqueue;*prev && pick==NULL;prev=&(*prev)->next)
+         for(i=0;i<w->ncache;i++)
+             if(mcx_server_match(w->slot+i,&(*prev)->cfg)){
+                 pick=prev;
+                 break;
+             }
+     if(pick==NULL)
+         pick=&jobqueue;
+     job=*pick;
+     *pick=job->next;
+     pthread_mutex_unlock(&jobmutex);
+     return job;
+}
+
+/*
+   run one job on the worker's device: on a cached session when one
+   matches, or on a new one replacing the least recently used
+*/
+static void mcx_server_run(MCXWorker *w,MCXJob *job){
+     Config *cfg=&job->cfg;
+     MCXSlot *slot=NULL;
+     FILE *log=fdopen(dup(job->fd),"w");
+     unsigned int i;
+     int status=0, owned=0;  //owned: the slot keeps the configuration of the job
+     char msg[MAX_PATH_LENGTH]="ok";
+
+     if(log==NULL){
+         mcx_server_done(job->fd,MCXCL_ERR_INPUT,"can not open the log stream");
+         mcx_clearcfg(cfg);
+         return;
+     }
+     if(cfg->flog==stdout)
+         cfg->flog=log;
+     strncpy(cfg->deviceid,w->deviceid,MAX_DEVICE);
+     w->clock++;
+     for(i=0;i<w->ncache && slot==NULL;i++)
+         if(mcx_server_match(w->slot+i,cfg))
+             slot=w->slot+i;
+     try{
+         if(slot){
+             fprintf(cfg->flog,"- [server] job %d reuses a session on device %d\n",job->id,w->id);
+             cfg->maxgate=slot->cfg.maxgate;
+             slot->ses.respin=cfg->respin;
+             mcx_update_session(&slot->ses,cfg);
+             mcx_run_session(&slot->ses,cfg);
+         }else{
+             for(i=0,slot=w->slot;i<w->ncache;i++)
+                 if(!w->slot[i].isused || w->slot[i].lastuse<slot->lastuse)
+                     slot=w->slot+i;
+             mcx_server_evict(slot);
+             fprintf(cfg->flog,"- [server] job %d builds a session on device %d\n",job->id,w->id);
+             slot->maxgate=cfg->maxgate;
+             mcx_init_session(&slot->ses,cfg);
+             slot->cfg=*cfg;      //the slot now owns the volume and the detectors of the job
+             slot->isused=owned=1;
+             mcx_run_session(&slot->ses,&slot->cfg);
+             free(slot->cfg.exportfield);
+             free(slot->cfg.exportdetected);
+             slot->cfg.exportfield=NULL;
+             slot->cfg.exportdetected=NULL;
+         }
+         slot->lastuse=w->clock;
+     }catch(MCXCLError &err){
+         status=err.id;
+         snprintf(msg,sizeof(msg),"%s",err.msg);
+         if(slot && slot->isused)  //the state of a failed session is not trusted
+             mcx_server_evict(slot);
+     }
+     if(owned && slot->isused)
+         slot->cfg.flog=stdout;
+     else if(!owned)
+         mcx_clearcfg(cfg);
+     fclose(log);
+     mcx_server_done(job->fd,status,msg);
+}
+
+static void *mcx_server_worker(void *arg){
+     MCXWorker *w=(MCXWorker *)arg;
+     for(;;){
+         MCXJob *job=mcx_server_take(w);
+         mcx_server_run(w,job);
+         free(job);
+     }
+     return NULL;
+}
+
+/*
+   read a job request: "MCXCL-JOB", then "cwd <dir>", one "opt <token>" per
+   command line token and "inp <bytes>" followed by the content of the input
+   file; the input is parsed as "mcxcl -s job<id> -o <dir> <tokens> -f <input>"
+*/
+static int mcx_server_parse(MCXJob *job,const char *kernelfile,char *err){
+     FILE *in=fdopen(dup(job->fd),"r");
+     char line[MAX_PATH_LENGTH], cwd[MAX_PATH_LENGTH]="", inpfile[]="/tmp/mcxcld_XXXXXX";
+     char *argv[MCX_SERVER_MAXOPT+10], *buf=NULL, session[32];
+     int argc=0, i, tmpfd=-1, ret=0;
+     long len=-1;
+
+     if(in==NULL)
+         return MCXCL_ERR_INPUT;
+     if(fgets(line,sizeof(line),in)==NULL || strncmp(line,MCX_SERVER_JOB,strlen(MCX_SERVER_JOB))){
+         fclose(in);
+         strcpy(err,"not a job request");
+         return MCXCL_ERR_INPUT;
+     }
+     sprintf(session,"job%u",job->id);
+     argv[argc++]=strdup("mcxcl");
+     argv[argc++]=strdup("-s");
+     argv[argc++]=strdup(session);
+     while(len<0 && fgets(line,sizeof(line),in)){
+         line[strcspn(line,"\r\n")]='\0';
+         if(strncmp(line,"cwd ",4)==0)
+             snprintf(cwd,sizeof(cwd),"%s",line+4);
+         else if(strncmp(line,"opt ",4)==0 && argc<MCX_SERVER_MAXOPT){
+             /*the informational and interactive options would stop or block the server*/
+             if(strcmp(line+4,"-h")==0 || strcmp(line+4,"-L")==0 || strcmp(line+4,"-i")==0 || strcmp(line+4,"-Y")==0 ||
+                strcmp(line+4,"-M")==0 || strcmp(line+4,"--help")==0 || strcmp(line+4,"--listgpu")==0 ||
+                strcmp(line+4,"--interactive")==0 || strcmp(line+4,"--sweep")==0 || strcmp(line+4,"--dumpmask")==0){
+                 snprintf(err,MAX_PATH_LENGTH,"option %.64s is not supported by the server",line+4);
+                 ret=MCXCL_ERR_INPUT;
+             }
+             argv[argc++]=strdup(line+4);
+         }else if(strncmp(line,"inp ",4)==0)
+             len=atol(line+4);
+     }
+     if(ret==0 && (len<=0 || len>MCX_SERVER_MAXINPUT)){
+         strcpy(err,"the input file is missing or too large");
+         ret=MCXCL_ERR_INPUT;
+     }
+     if(ret==0){
+         buf=(char*)malloc(len);
+         if(fread(buf,1,len,in)!=(size_t)len || (tmpfd=mkstemp(inpfile))<0 || write(tmpfd,buf,len)!=len){
+             strcpy(err,"can not receive the input file");
+             ret=MCXCL_ERR_INPUT;
+         }
+         if(tmpfd>=0)
+             close(tmpfd);
+     }
+     fclose(in);
+     free(buf);
+
+     if(ret==0){
+         /*the root path goes first, a -o of the job replaces it; the input and the kernel go last*/
+         memmove(argv+3,argv+1,(argc-1)*sizeof(char*));
+         argv[1]=strdup("-o");
+         argv[2]=strdup(cwd[0] ? cwd : ".");
+         argc+=2;
+         argv[argc++]=strdup("-f");
+         argv[argc++]=strdup(inpfile);
+         argv[argc++]=strdup("-k");
+         argv[argc++]=strdup(kernelfile);
+         try{
+             mcx_initcfg(&job->cfg);
+             mcx_parsecmd(argc,argv,&job->cfg);
+             job->cfg.parentid=mpStandalone;  //the outputs are saved where the job asked
+             job->cfg.sweepfile[0]='\0';
+         }catch(MCXCLError &e){
+             snprintf(err,MAX_PATH_LENGTH,"%s",e.msg);
+             mcx_clearcfg(&job->cfg);
+             ret=e.id;
+         }
+         unlink(inpfile);
+     }
+     for(i=0;i<argc;i++)
+         free(argv[i]);
+     return ret;
+}
+
+/*
+   list the devices of -G, start one worker per device and accept the jobs
+   on the Unix socket until the process is stopped
+*/
+void mcx_run_server(const char *sockpath,const char *kernelfile,const char *deviceid,unsigned int ncache){
+     Config cfg;
+     cl_device_id devices[MAX_DEVICE];
+     unsigned int ndev=0, i, k, njob=0;
+     MCXWorker *worker;
+     struct sockaddr_un addr;
+     int sock;
+
+     signal(SIGPIPE,SIG_IGN);
+     mcx_initcfg(&cfg);
+     strncpy(cfg.deviceid,deviceid,MAX_DEVICE-1);
+     try{
+         mcx_list_gpu(&cfg,&ndev,devices,NULL);
+     }catch(MCXCLError &err){
+         fprintf(stderr,"mcxcld: %s\n",err.msg);
+         exit(1);
+     }
+     if(ndev==0){
+         fprintf(stderr,"mcxcld: no device is selected by -G %s\n",deviceid);
+         exit(1);
+     }
+
+     worker=(MCXWorker*)calloc(ndev,sizeof(MCXWorker));
+     for(i=0,k=0;i<ndev;i++,k++){
+         for(;deviceid[k]!='1';k++);
+         memset(worker[i].deviceid,'0',k);
+         worker[i].deviceid[k]='1';
+         worker[i].id=i;
+         worker[i].ncache=MAX(ncache,1U);
+         worker[i].slot=(MCXSlot*)calloc(worker[i].ncache,sizeof(MCXSlot));
+     }
+
+     memset(&addr,0,sizeof(addr));
+     addr.sun_family=AF_UNIX;
+     strncpy(addr.sun_path,sockpath,sizeof(addr.sun_path)-1);
+     unlink(sockpath);
+     if((sock=socket(AF_UNIX,SOCK_STREAM,0))<0 || bind(sock,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(sock,MCX_SERVER_BACKLOG)<0){
+         perror("mcxcld");
+         exit(1);
+     }
+     for(i=0;i<ndev;i++)
+         pthread_create(&worker[i].thread,NULL,mcx_server_worker,worker+i);
+     fprintf(stdout,"mcxcld: %d device(s), %d cached session(s) each, listening on %s\n",ndev,worker[0].ncache,sockpath);
+     fflush(stdout);
+
+     for(;;){
+         MCXJob *job=(MCXJob*)calloc(1,sizeof(MCXJob));
+         char err[MAX_PATH_LENGTH]="";
+         int status;
+
+         if((job->fd=accept(sock,NULL,NULL))<0){
+             free(job);
+             continue;
+         }
+         job->id=++njob;
+         if((status=mcx_server_parse(job,kernelfile,err))!=0){
+             mcx_server_done(job->fd,status,err);
+             free(job);
+             continue;
+         }
+         pthread_mutex_lock(&jobmutex);
+         MCXJob **tail=&jobqueue;
+         while(*tail)
+             tail=&(*tail)->next;
+         *tail=job;
+         pthread_cond_signal(&jobready);
+         pthread_mutex_unlock(&jobmutex);
+     }
+}
+
+int main(int argc, char *argv[]){
+     const char *kernelfile="mcx_core.cl", *deviceid="1";
+     unsigned int ncache=MCX_SERVER_CACHE;
+     int i;
+
+     for(i=1;i<argc-1;i++){
+         if(strcmp(argv[i],"-k")==0)
+             kernelfile=argv[++i];
+         else if(strcmp(argv[i],"-G")==0)
+             deviceid=argv[++i];
+         else if(strcmp(argv[i],"-C")==0)
+             ncache=atoi(argv[++i]);
+         else
+             break;
+     }
+     if(i!=argc-1){
+         printf("usage: %s [-k mcx_core.cl] [-G 1] [-C %d] socket\n\
+ -k file   the kernel of all jobs\n\
+ -G mask   the devices to serve, as in mcxcl -G; one job runs on each\n\
+ -C n      sessions (device set-ups with their volume) kept per device\n",argv[0],MCX_SERVER_CACHE);
+         return 1;
+     }
+     mcx_run_server(argv[argc-1],kernelfile,deviceid,ncache);
+     return 0;
+}
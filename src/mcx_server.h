@@ -0,0 +1,21 @@
+#ifndef _MCEXTREME_SERVER_H
+#define _MCEXTREME_SERVER_H
+
+#define MCX_SERVER_JOB      "MCXCL-JOB"    //first line of a job request
+#define MCX_SERVER_DONE     "MCXCL-DONE"   //last line of a reply: "MCXCL-DONE <status> <message>"
+#define MCX_SERVER_CACHE    2              //default sessions kept per device
+#define MCX_SERVER_MAXOPT   256            //command line tokens of a job
+#define MCX_SERVER_MAXINPUT 1048576        //max bytes of the input file of a job
+#define MCX_SERVER_BACKLOG  64             //pending connections
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+void mcx_run_server(const char *sockpath,const char *kernelfile,const char *deviceid,unsigned int ncache);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
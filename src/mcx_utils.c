@@ -22,19 +22,26 @@
 #include "mcx_utils.h"
 
 char shortopt[]={'h','i','f','n','m','t','T','s','a','g','b','B','D','G','W','z',
-                 'd','r','S','p','e','U','R','l','L','M','I','o','c','k','v','J','\0'};
+                 'd','r','S','p','e','U','R','l','L','M','I','o','c','k','v','J','A','Z','X','Y','P','j','w','E','K','V','C','Q','F','O','N','\0'};
 const char *fullopt[]={"--help","--interactive","--input","--photon","--move",
                  "--thread","--blocksize","--session","--array","--gategroup",
                  "--reflect","--reflect3","--device","--devicelist","--workload","--srcfrom0",
 		 "--savedet","--repeat","--save2pt","--printlen","--minenergy",
                  "--normalize","--skipradius","--log","--listgpu","--dumpmask",
-                 "--printgpu","--root","--cpu","--kernel","--verbose","--compileropt",""};
+                 "--printgpu","--root","--cpu","--kernel","--verbose","--compileropt",
+                 "--autotune","--zerocopy","--split","--sweep","--pack",
+                 "--progress","--maxtime","--precision","--precbox","--savese",
+                 "--checkpoint","--resume","--outputformat","--outroi","--tallybin",""};
 #ifdef WIN32
          char pathsep='\\';
 #else
          char pathsep='/';
 #endif
 
+#ifdef _MSC_VER
+  #define strtok_r strtok_s  /*the reentrant strtok of MSVC*/
+#endif
+
 
 void mcx_initcfg(Config *cfg){
      cfg->medianum=0;
@@ -68,7 +75,7 @@ void mcx_initcfg(Config *cfg){
      cfg->rootpath[0]='\0';
      cfg->iscpu=0;
      cfg->isverbose=0;
-     cfg->clsource='\0';
+     cfg->clsource=NULL;
      cfg->maxdetphoton=1000000; 
      cfg->isdumpmask=0;
 
@@ -88,7 +95,7 @@ void mcx_initcfg(Config *cfg){
 
      memset(&cfg->his,0,sizeof(History));
      memcpy(cfg->his.magic,"MCXH",4);
-     cfg->his.version=1;
+     cfg->his.version=MCX_HISTORY_VERSION;
      cfg->his.unitinmm=1.f;
      cfg->exportfield=NULL;
      cfg->exportdetected=NULL;
@@ -101,6 +108,24 @@ void mcx_initcfg(Config *cfg){
 #endif
      cfg->seeddata=NULL;
      cfg->outputtype=otFlux;
+     cfg->autotune=1;
+     cfg->zerocopy=2;
+     cfg->issplit=0;
+     cfg->sweepfile[0]='\0';
+     cfg->npack=1;
+     cfg->isprogress=0;
+     cfg->maxtime=0.f;
+     cfg->precision=0.f;
+     memset(cfg->precbox,0,sizeof(cfg->precbox));
+     cfg->precbox[0]=-1.f;
+     cfg->issavese=0;
+     cfg->checkpoint=0.f;
+     cfg->isresume=0;
+     cfg->outputformat=ofFloat;
+     memset(cfg->outroi,0,sizeof(cfg->outroi));
+     cfg->outroi[0]=-1.f;
+     cfg->tallybin[0]=cfg->tallybin[1]=cfg->tallybin[2]=1;
+     cfg->nlaunched=0;
 }
 
 void mcx_clearcfg(Config *cfg){
@@ -122,10 +147,204 @@ void mcx_clearcfg(Config *cfg){
      mcx_initcfg(cfg);
 }
 
-void mcx_savedata(float *dat, int len, int doappend, const char *suffix, Config *cfg){
+/*
+   the path of an output of the session, named by its suffix, in a buffer of len bytes
+*/
+void mcx_outputname(Config *cfg, const char *suffix, char *name, size_t len){
+     int n;
+     if(cfg->rootpath[0] && cfg->session[0]!=pathsep)
+         n=snprintf(name,len,"%s%c%s.%s",cfg->rootpath,pathsep,cfg->session,suffix);
+     else
+         n=snprintf(name,len,"%s.%s",cfg->session,suffix);
+     if(n<0 || (size_t)n>=len)
+         mcx_error(-2,"the output path is too long",__FILE__,__LINE__);
+}
+
+/*
+   float to IEEE half precision, rounded to the nearest even; the relative
+   error is at most 2^-11 from 6.1e-5 to 65504, larger values become inf
+*/
+static unsigned short mcx_float2half(float f){
+     union {float f; unsigned int i;} v;
+     unsigned int sign, mant, h, r, half;
+     int exp, shift;
+
+     v.f=f;
+     sign=(v.i>>16)&0x8000U;
+     exp=(int)((v.i>>23)&0xFF);
+     mant=v.i&0x7FFFFFU;
+     if(exp==0xFF)  //inf or nan
+         return sign|0x7C00U|(mant ? 0x200U : 0U);
+     exp+=15-127;
+     if(exp>=31)
+         return sign|0x7C00U;
+     if(exp<=0){    //a subnormal half
+         if(exp<-10)
+             return sign;
+         mant|=0x800000U;
+         shift=14-exp;
+         h=mant>>shift;
+         r=mant&((1U<<shift)-1);
+         half=1U<<(shift-1);
+     }else{
+         h=((unsigned int)exp<<10)|(mant>>13);
+         r=mant&0x1FFFU;
+         half=0x1000U;
+     }
+     if(r>half || (r==half && (h&1)))
+         h++;     //a carry rounds up to the next exponent, or to inf
+     return sign|h;
+}
+
+/*
+   float to bfloat16, the upper half of a float rounded to the nearest even;
+   the relative error is at most 2^-8 over the normal float range
+*/
+static unsigned short mcx_float2bfloat16(float f){
+     union {float f; unsigned int i;} v;
+     v.f=f;
+     if((v.i&0x7FFFFFFFU)>0x7F800000U)
+         return (unsigned short)((v.i>>16)|0x40U);
+     v.i+=0x7FFFU+((v.i>>16)&1);
+     return (unsigned short)(v.i>>16);
+}
+
+/*
+   write a field in the -F encoding; the sparse one holds, for every time
+   gate, the number of nonzero voxels, their indices in the gate and their
+   values, so that a gate can be appended on its own
+*/
+static void mcx_writefield(FILE *fp, float *dat, size_t len, Config *cfg){
+     unsigned int lo[3], boxlen[3];
+     size_t i, j, n, gatelen=mcx_outputbox(cfg,lo,boxlen), outrange=0;
+
+     if(cfg->outputformat==ofHalf || cfg->outputformat==ofBFloat16){
+         unsigned short *buf=(unsigned short *)malloc(sizeof(unsigned short)*MCX_ENCODE_CHUNK);
+         for(i=0;i<len;i+=n){
+             n=(len-i<MCX_ENCODE_CHUNK ? len-i : MCX_ENCODE_CHUNK);
+             if(cfg->outputformat==ofHalf){
+                 for(j=0;j<n;j++){
+                     float a=fabs(dat[i+j]);
+                     buf[j]=mcx_float2half(dat[i+j]);
+                     outrange+=(a>65504.f || (a>0.f && a<6.1035156e-5f));
+                 }
+             }else{
+                 for(j=0;j<n;j++)
+                     buf[j]=mcx_float2bfloat16(dat[i+j]);
+             }
+             fwrite(buf,sizeof(unsigned short),n,fp);
+         }
+         free(buf);
+         if(outrange)
+             fprintf(cfg->flog,"WARNING: %llu values are out of the normal range of half precision, please use -F 2\n",
+                     (unsigned long long)outrange);
+     }else if(cfg->outputformat==ofSparse){
+         unsigned int *idx=(unsigned int *)malloc(sizeof(unsigned int)*MCX_ENCODE_CHUNK);
+         float *val=(float *)malloc(sizeof(float)*MCX_ENCODE_CHUNK);
+         size_t gate;
+         if(gatelen==0 || len%gatelen)
+             gatelen=len;
+         for(gate=0;gate<len;gate+=gatelen){
+             float *g=dat+gate;
+             unsigned int count=0;
+             for(i=0;i<gatelen;i++)
+                 count+=(g[i]!=0.f);
+             fwrite(&count,sizeof(unsigned int),1,fp);
+             for(i=0,n=0;i<gatelen;i++){
+                 if(g[i]!=0.f)
+                     idx[n++]=(unsigned int)i;
+                 if(n==MCX_ENCODE_CHUNK || (i==gatelen-1 && n)){
+                     fwrite(idx,sizeof(unsigned int),n,fp);
+                     n=0;
+                 }
+             }
+             for(i=0,n=0;i<gatelen;i++){
+                 if(g[i]!=0.f)
+                     val[n++]=g[i];
+                 if(n==MCX_ENCODE_CHUNK || (i==gatelen-1 && n)){
+                     fwrite(val,sizeof(float),n,fp);
+                     n=0;
+                 }
+             }
+         }
+         free(val);
+         free(idx);
+     }else
+         fwrite(dat,sizeof(float),len,fp);
+}
+
+/*
+   the voxel box of the saved field, counted from 0: the box of -O clipped
+   to the volume, or the whole volume; lo is its first voxel and len its
+   voxels along each axis. Returns the tally cells of one time gate, the
+   box being split in cells of tallybin voxels from lo (-N), the last cell
+   along an axis may be partial
+*/
+size_t mcx_outputbox(Config *cfg, unsigned int lo[3], unsigned int len[3]){
+     unsigned int dim[3]={cfg->dim.x,cfg->dim.y,cfg->dim.z}, hi, i;
+     float off=(cfg->issrcfrom0 ? 0.f : 1.f);
+     size_t ncell=1;
+
+     for(i=0;i<3;i++){
+         if(cfg->outroi[0]<0.f){
+             lo[i]=0;
+             hi=dim[i]-1;
+         }else{
+             float x0=cfg->outroi[i]-off, x1=cfg->outroi[i+3]-off;
+             lo[i]=(x0>0.f ? (unsigned int)x0 : 0);
+             hi=(x1>0.f ? (unsigned int)x1 : 0);
+             if(hi>dim[i]-1)
+                 hi=dim[i]-1;
+             if(lo[i]>hi)
+                 mcx_error(-1,"the box of -O is empty or outside of the volume",__FILE__,__LINE__);
+         }
+         len[i]=hi-lo[i]+1;
+         ncell*=(len[i]+cfg->tallybin[i]-1)/cfg->tallybin[i];
+     }
+     return ncell;
+}
+
+/*
+   normalize a field binned by -N: a flux or fluence cell cut by the upper
+   face of the box covers fewer voxels, it is scaled by the volume it covers
+   instead of the full cell volume of scale
+*/
+void mcx_normalizecells(float field[], float scale, size_t fieldlen, Config *cfg){
+     unsigned int lo[3], len[3], ncell[3], i;
+     size_t x, y, z, idx=0;
+     float *cover[3];
+     int ispartial=0;
+
+     mcx_outputbox(cfg,lo,len);
+     for(i=0;i<3;i++){
+         ncell[i]=(len[i]+cfg->tallybin[i]-1)/cfg->tallybin[i];
+         ispartial|=(len[i]%cfg->tallybin[i]!=0);
+     }
+     if(!ispartial || (cfg->outputtype!=otFlux && cfg->outputtype!=otFluence)){
+         mcx_normalize(field,scale,fieldlen);
+         return;
+     }
+     for(i=0;i<3;i++){  //the full cell over the voxels covered by each cell along the axis
+         cover[i]=(float *)malloc(sizeof(float)*ncell[i]);
+         for(x=0;x<ncell[i];x++)
+             cover[i][x]=(float)cfg->tallybin[i]/(x<ncell[i]-1 || len[i]%cfg->tallybin[i]==0 ? cfg->tallybin[i] : len[i]%cfg->tallybin[i]);
+     }
+     while(idx<fieldlen){
+         for(z=0;z<ncell[2];z++)
+             for(y=0;y<ncell[1];y++){
+                 float s=scale*cover[2][z]*cover[1][y];
+                 for(x=0;x<ncell[0] && idx<fieldlen;x++)
+                     field[idx++]*=s*cover[0][x];
+             }
+     }
+     for(i=0;i<3;i++)
+         free(cover[i]);
+}
+
+void mcx_savedata(float *dat, size_t len, int doappend, const char *suffix, Config *cfg){
      FILE *fp;
      char name[MAX_PATH_LENGTH];
-     sprintf(name,"%s.%s",cfg->session,suffix);
+     mcx_outputname(cfg,suffix,name,sizeof(name));
      if(doappend){
         fp=fopen(name,"ab");
      }else{
@@ -136,18 +355,21 @@ void mcx_savedata(float *dat, int len, int doappend, const char *suffix, Config
      }
      if(strcmp(suffix,"mch")==0){
 	fwrite(&(cfg->his),sizeof(History),1,fp);
-     }
-     fwrite(dat,sizeof(float),len,fp);
+	fwrite(dat,sizeof(float),len,fp);
+     }else
+	mcx_writefield(fp,dat,len,cfg);
      fclose(fp);
 }
 
-void mcx_savedetphoton(float *ppath, void *seeds, int count, int doappend, Config *cfg){
+void mcx_savedetphoton(float *ppath, void *seeds, size_t count, int doappend, Config *cfg){
 	FILE *fp;
 	char fhistory[MAX_PATH_LENGTH];
-        if(cfg->rootpath[0])
-                sprintf(fhistory,"%s%c%s.mch",cfg->rootpath,pathsep,cfg->session);
-        else
-                sprintf(fhistory,"%s.mch",cfg->session);
+
+	/*version 1 readers only see the 32-bit counts, saturate them*/
+	cfg->his.totalphoton=(cfg->his.totalphoton64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)cfg->his.totalphoton64);
+	cfg->his.detected=(cfg->his.detected64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)cfg->his.detected64);
+	cfg->his.savedphoton=(cfg->his.savedphoton64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)cfg->his.savedphoton64);
+        mcx_outputname(cfg,"mch",fhistory,sizeof(fhistory));
 	if(doappend){
            fp=fopen(fhistory,"ab");
 	}else{
@@ -161,14 +383,35 @@ void mcx_savedetphoton(float *ppath, void *seeds, int count, int doappend, Confi
 	fclose(fp);
 }
 
+/*
+   the totals of the run next to its outputs, one key per line, which
+   mcxclmerge needs to weigh the fields of independently seeded runs; energytot
+   sums all time windows, alpha normalizes by the energy of one window
+*/
+void mcx_saveruninfo(Config *cfg, float scale, unsigned int nwindow){
+     FILE *fp;
+     char name[MAX_PATH_LENGTH];
+     mcx_outputname(cfg,"json",name,sizeof(name));
+     if((fp=fopen(name,"wt"))==NULL){
+	mcx_error(-2,"can not save data to disk",__FILE__,__LINE__);
+     }
+     fprintf(fp,"{\n  \"nphoton\": %llu,\n  \"nlaunched\": %llu,\n  \"seed\": %d,\n",
+             (unsigned long long)cfg->nphoton,(unsigned long long)cfg->nlaunched,cfg->seed);
+     fprintf(fp,"  \"energytot\": %.9g,\n  \"energyesc\": %.9g,\n  \"windows\": %u,\n",cfg->energytot,cfg->energyesc,nwindow);
+     fprintf(fp,"  \"normalized\": %d,\n  \"outputtype\": %d,\n  \"outputformat\": %d,\n  \"alpha\": %.9g,\n",
+             cfg->isnormalized,cfg->outputtype,cfg->outputformat,scale);
+     fprintf(fp,"  \"detected\": %llu,\n  \"saved\": %llu\n}\n",cfg->his.detected64,(unsigned long long)cfg->detectedcount);
+     fclose(fp);
+}
+
 void mcx_printlog(Config *cfg, const char *str){
-     if(cfg->flog>0){ /*stdout is 1*/
+     if(cfg->flog!=NULL){
          fprintf(cfg->flog,"%s\n",str);
      }
 }
 
-void mcx_normalize(float field[], float scale, int fieldlen){
-     int i;
+void mcx_normalize(float field[], float scale, size_t fieldlen){
+     size_t i;
      for(i=0;i<fieldlen;i++){
          field[i]*=scale;
      }
@@ -189,6 +432,21 @@ void mcx_error(const int id,const char *msg,const char *file,const int linenum){
 #endif
 }
 
+/*
+   called before an informational option prints and exits; in the library
+   and the server, the exit would end the host process, the option is an
+   error instead
+*/
+void mcx_infoonly(const char *opt){
+#ifdef MCX_CONTAINER
+     char msg[MAX_PATH_LENGTH];
+     snprintf(msg,sizeof(msg),"option %.64s only prints information and is not supported here",opt);
+     mcx_error(-2,msg,__FILE__,__LINE__);
+#else
+     (void)opt;
+#endif
+}
+
 void mcx_createfluence(float **fluence, Config *cfg){
      mcx_clearfluence(fluence);
      *fluence=(float*)calloc(cfg->dim.x*cfg->dim.y*cfg->dim.z,cfg->maxgate*sizeof(float));
@@ -228,17 +486,19 @@ void mcx_writeconfig(const char *fname, Config *cfg){
 }
 
 void mcx_loadconfig(FILE *in, Config *cfg){
-     int i,idx1d;
+     int i;
+     size_t idx1d;
      unsigned int gates,itmp;
+     double np;
      char filename[MAX_PATH_LENGTH]={0}, comment[MAX_PATH_LENGTH],*comm;
      
      if(in==stdin)
      	fprintf(stdout,"Please specify the total number of photons: [1000000]\n\t");
-     MCX_ASSERT(fscanf(in,"%d", &(i) )==1); 
-     if(cfg->nphoton==0) cfg->nphoton=i;
+     MCX_ASSERT(fscanf(in,"%lf", &(np) )==1);  /*1e11 or 100000000000, beyond the int range*/
+     if(cfg->nphoton==0) cfg->nphoton=(size_t)np;
      comm=fgets(comment,MAX_PATH_LENGTH,in);
      if(in==stdin)
-     	fprintf(stdout,"%d\nPlease specify the random number generator seed: [1234567]\n\t",cfg->nphoton);
+     	fprintf(stdout,"%llu\nPlease specify the random number generator seed: [1234567]\n\t",(unsigned long long)cfg->nphoton);
      MCX_ASSERT(fscanf(in,"%d", &(cfg->seed) )==1);
      comm=fgets(comment,MAX_PATH_LENGTH,in);
      if(in==stdin)
@@ -273,7 +533,7 @@ void mcx_loadconfig(FILE *in, Config *cfg){
 	 cfg->maxgate=gates;
 
      MCX_ASSERT(fscanf(in,"%s", filename)==1);
-     if(cfg->rootpath[0]){
+     if(cfg->rootpath[0] && filename[0]!=pathsep){  /*an absolute volume path is kept*/
 #ifdef WIN32
          sprintf(comment,"%s\\%s",cfg->rootpath,filename);
 #else
@@ -356,20 +616,20 @@ void mcx_loadconfig(FILE *in, Config *cfg){
             cfg->srcpos.x>=cfg->dim.x || cfg->srcpos.y>=cfg->dim.y || cfg->srcpos.z>=cfg->dim.z)
                 mcx_error(-4,"source position is outside of the volume",__FILE__,__LINE__);
 
-	idx1d=((int)floor(cfg->srcpos.z)*cfg->dim.y*cfg->dim.x+(int)floor(cfg->srcpos.y)*cfg->dim.x+(int)floor(cfg->srcpos.x));
+	idx1d=((size_t)floor(cfg->srcpos.z)*cfg->dim.y+(size_t)floor(cfg->srcpos.y))*cfg->dim.x+(size_t)floor(cfg->srcpos.x);
 
         /* if the specified source position is outside the domain, move the source
 	   along the initial vector until it hit the domain */
 	if(cfg->vol && cfg->vol[idx1d]==0){
-                printf("source (%f %f %f) is located outside the domain, vol[%d]=%d\n",
-		      cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,idx1d,cfg->vol[idx1d]);
+                printf("source (%f %f %f) is located outside the domain, vol[%llu]=%d\n",
+		      cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,(unsigned long long)idx1d,cfg->vol[idx1d]);
 		while(cfg->vol[idx1d]==0){
 			cfg->srcpos.x+=cfg->srcdir.x;
 			cfg->srcpos.y+=cfg->srcdir.y;
 			cfg->srcpos.z+=cfg->srcdir.z;
 			printf("fixing source position to (%f %f %f)\n",cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z);
-			idx1d=cfg->isrowmajor?(int)(floor(cfg->srcpos.x)*cfg->dim.y*cfg->dim.z+floor(cfg->srcpos.y)*cfg->dim.z+floor(cfg->srcpos.z)):\
-                		      (int)(floor(cfg->srcpos.z)*cfg->dim.y*cfg->dim.x+floor(cfg->srcpos.y)*cfg->dim.x+floor(cfg->srcpos.x));
+			idx1d=cfg->isrowmajor?((size_t)floor(cfg->srcpos.x)*cfg->dim.y+(size_t)floor(cfg->srcpos.y))*cfg->dim.z+(size_t)floor(cfg->srcpos.z):\
+                		      ((size_t)floor(cfg->srcpos.z)*cfg->dim.y+(size_t)floor(cfg->srcpos.y))*cfg->dim.x+(size_t)floor(cfg->srcpos.x);
 		}
 	}
         cfg->his.maxmedia=cfg->medianum-1; /*skip media 0*/
@@ -383,7 +643,7 @@ void mcx_loadconfig(FILE *in, Config *cfg){
 void mcx_saveconfig(FILE *out, Config *cfg){
      unsigned int i;
 
-     fprintf(out,"%d\n", (cfg->nphoton) ); 
+     fprintf(out,"%llu\n", (unsigned long long)(cfg->nphoton) ); 
      fprintf(out,"%d\n", (cfg->seed) );
      fprintf(out,"%f %f %f\n", (cfg->srcpos.x),(cfg->srcpos.y),(cfg->srcpos.z) );
      fprintf(out,"%f %f %f\n", (cfg->srcdir.x),(cfg->srcdir.y),(cfg->srcdir.z) );
@@ -402,7 +662,7 @@ void mcx_saveconfig(FILE *out, Config *cfg){
 }
 
 void mcx_loadvolume(char *filename,Config *cfg){
-     int datalen,res;
+     size_t datalen,res;
      FILE *fp=fopen(filename,"rb");
      if(fp==NULL){
      	     mcx_error(-5,"the specified binary volume file does not exist",__FILE__,__LINE__);
@@ -411,7 +671,7 @@ void mcx_loadvolume(char *filename,Config *cfg){
      	     free(cfg->vol);
      	     cfg->vol=NULL;
      }
-     datalen=cfg->dim.x*cfg->dim.y*cfg->dim.z;
+     datalen=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z;
      cfg->vol=(unsigned char*)malloc(sizeof(unsigned char)*datalen);
      res=fread(cfg->vol,sizeof(unsigned char),datalen,fp);
      fclose(fp);
@@ -441,7 +701,8 @@ void  mcx_convertrow2col(unsigned char **vol, uint4 *dim){
 }
 
 void  mcx_maskdet(Config *cfg){
-     uint d,dx,dy,dz,idx1d,zi,yi;
+     uint d,dx,dy,dz,zi,yi;
+     size_t idx1d;
      float x,y,z,ix,iy,iz;
      unsigned char *padvol;
      
@@ -452,11 +713,11 @@ void  mcx_maskdet(Config *cfg){
      /*handling boundaries in a volume search is tedious, I first pad vol by a layer of zeros,
        then I don't need to worry about boundaries any more*/
 
-     padvol=(unsigned char*)calloc(dx*dy,dz);
+     padvol=(unsigned char*)calloc((size_t)dx*dy,dz);
 
      for(zi=1;zi<=cfg->dim.z;zi++)
         for(yi=1;yi<=cfg->dim.y;yi++)
-	        memcpy(padvol+zi*dy*dx+yi*dx+1,cfg->vol+(zi-1)*cfg->dim.y*cfg->dim.x+(yi-1)*cfg->dim.x,cfg->dim.x);
+	        memcpy(padvol+((size_t)zi*dy+yi)*dx+1,cfg->vol+((size_t)(zi-1)*cfg->dim.y+(yi-1))*cfg->dim.x,cfg->dim.x);
 
      for(d=0;d<cfg->detnum;d++)                              /*loop over each detector*/
         for(z=-cfg->detpos[d].w;z<=cfg->detpos[d].w;z++){   /*search in a sphere*/
@@ -470,7 +731,7 @@ void  mcx_maskdet(Config *cfg){
 		    x*x+y*y+z*z > (cfg->detpos[d].w+1.f)*(cfg->detpos[d].w+1.f))
 		    continue;
 
-		 idx1d=(int)((iz+1.f)*dy*dx+(iy+1.f)*dx+(ix+1.f));
+		 idx1d=((size_t)(iz+1.f)*dy+(size_t)(iy+1.f))*dx+(size_t)(ix+1.f);
 
 		 if(padvol[idx1d])  /*looking for a voxel on the interface or bounding box*/
                   if(!(padvol[idx1d+1]&&padvol[idx1d-1]&&padvol[idx1d+dx]&&padvol[idx1d-dx]&&padvol[idx1d+dy*dx]&&padvol[idx1d-dy*dx]&&
@@ -479,7 +740,7 @@ void  mcx_maskdet(Config *cfg){
 		     padvol[idx1d+dy*dx+dx]&&padvol[idx1d+dy*dx-dx]&&padvol[idx1d-dy*dx+dx]&&padvol[idx1d-dy*dx-dx]&&
 		     padvol[idx1d+dy*dx+dx+1]&&padvol[idx1d+dy*dx+dx-1]&&padvol[idx1d+dy*dx-dx+1]&&padvol[idx1d+dy*dx-dx-1]&&
 		     padvol[idx1d-dy*dx+dx+1]&&padvol[idx1d-dy*dx+dx-1]&&padvol[idx1d-dy*dx-dx+1]&&padvol[idx1d-dy*dx-dx-1])){
-		          cfg->vol[(int)(iz*cfg->dim.y*cfg->dim.x+iy*cfg->dim.x+ix)]|=(1<<7);/*set the highest bit to 1*/
+		          cfg->vol[((size_t)iz*cfg->dim.y+(size_t)iy)*cfg->dim.x+(size_t)ix]|=(1<<7);/*set the highest bit to 1*/
 	          }
 	      }
 	  }
@@ -488,6 +749,7 @@ void  mcx_maskdet(Config *cfg){
      if(cfg->isdumpmask){
      	 char fname[MAX_PATH_LENGTH];
 	 FILE *fp;
+	 mcx_infoonly("-M");
 	 sprintf(fname,"%s.mask",cfg->session);
 	 if((fp=fopen(fname,"wb"))==NULL){
 	 	mcx_error(-10,"can not save mask file",__FILE__,__LINE__);
@@ -502,6 +764,61 @@ void  mcx_maskdet(Config *cfg){
      free(padvol);
 }
 
+/*
+   read the next run of a sweep file into cfg, skipping the empty and the
+   comment (#) lines; a run is "session nphoton srcx srcy srcz dirx diry dirz"
+   followed by "mus g mua n" for each medium of the input file, and a '-'
+   leaves the value in cfg unchanged; returns 0 at the end of the file
+*/
+int mcx_readsweep(FILE *in, Config *cfg){
+     char line[MAX_PATH_LENGTH*4], *tok, *state;
+     float val[8];
+     unsigned int i,len=8+(cfg->medianum-1)*4;
+     size_t idx1d;
+
+     while(fgets(line,sizeof(line),in)){
+        if((tok=strchr(line,'#'))!=NULL)
+            *tok='\0';
+        if((tok=strtok_r(line," \t\r\n",&state))==NULL)
+            continue;
+        strncpy(cfg->session,tok,MAX_SESSION_LENGTH-1);
+        cfg->session[MAX_SESSION_LENGTH-1]='\0';
+        val[2]=cfg->srcpos.x; val[3]=cfg->srcpos.y; val[4]=cfg->srcpos.z;
+        val[5]=cfg->srcdir.x; val[6]=cfg->srcdir.y; val[7]=cfg->srcdir.z;
+        for(i=1;i<len;i++){
+            if((tok=strtok_r(NULL," \t\r\n",&state))==NULL)
+                mcx_error(-2,"incomplete run in the sweep file",__FILE__,__LINE__);
+            if(strcmp(tok,"-")==0)
+                continue;
+            if(i==1)
+                cfg->nphoton=(size_t)atof(tok);
+            else if(i<5)
+                val[i]=atof(tok)-(cfg->issrcfrom0 ? 0.f : 1.f); /*convert to C index, as in the input file*/
+            else if(i<8)
+                val[i]=atof(tok);
+            else{
+                Medium *med=cfg->prop+1+(i-8)/4;
+                switch((i-8)%4){
+                    case 0: med->mus=atof(tok); break;
+                    case 1: med->g=atof(tok);   break;
+                    case 2: med->mua=atof(tok); break;
+                    case 3: med->n=atof(tok);   break;
+                }
+            }
+        }
+        cfg->srcpos.x=val[2]; cfg->srcpos.y=val[3]; cfg->srcpos.z=val[4];
+        cfg->srcdir.x=val[5]; cfg->srcdir.y=val[6]; cfg->srcdir.z=val[7];
+        if(cfg->srcpos.x<0.f || cfg->srcpos.y<0.f || cfg->srcpos.z<0.f ||
+            cfg->srcpos.x>=cfg->dim.x || cfg->srcpos.y>=cfg->dim.y || cfg->srcpos.z>=cfg->dim.z)
+                mcx_error(-4,"source position is outside of the volume",__FILE__,__LINE__);
+        idx1d=((size_t)floor(cfg->srcpos.z)*cfg->dim.y+(size_t)floor(cfg->srcpos.y))*cfg->dim.x+(size_t)floor(cfg->srcpos.x);
+        if(cfg->vol[idx1d]==0)
+                mcx_error(-4,"the source of a sweep run is outside the domain",__FILE__,__LINE__);
+        return 1;
+     }
+     return 0;
+}
+
 int mcx_readarg(int argc, char *argv[], int id, void *output,const char *type){
      /*
          when a binary option is given without a following number (0~1), 
@@ -518,12 +835,15 @@ int mcx_readarg(int argc, char *argv[], int id, void *output,const char *type){
              *((int*)output)=atoi(argv[id+1]);
 	 else if(strcmp(type,"float")==0)
              *((float*)output)=atof(argv[id+1]);
+	 else if(strcmp(type,"double")==0)
+             *((double*)output)=atof(argv[id+1]);
 	 else if(strcmp(type,"string")==0)
 	     strcpy((char *)output,argv[id+1]);
 	 else if(strcmp(type,"bytenumlist")==0){
-	     char *nexttok,*numlist=(char *)output;
+	     char *nexttok,*state,*numlist=(char *)output,list[MAX_PATH_LENGTH];
 	     int len=0,i;
-	     nexttok=strtok(argv[id+1]," ,;");
+	     snprintf(list,sizeof(list),"%s",argv[id+1]);  /*argv is left intact*/
+	     nexttok=strtok_r(list," ,;",&state);
 	     while(nexttok){
     		 numlist[len++]=(char)(atoi(nexttok)); /*device id<256*/
 		 for(i=0;i<len-1;i++) /* remove duplicaetd ids */
@@ -531,17 +851,18 @@ int mcx_readarg(int argc, char *argv[], int id, void *output,const char *type){
 		       numlist[--len]='\0';
 		       break;
 		    }
-		 nexttok=strtok(NULL," ,;");
+		 nexttok=strtok_r(NULL," ,;",&state);
 		 /*if(len>=MAX_DEVICE) break;*/
 	     }
 	 }else if(strcmp(type,"floatlist")==0){
-	     char *nexttok;
+	     char *nexttok,*state,list[MAX_PATH_LENGTH];
 	     float *numlist=(float *)output;
 	     int len=0;
-	     nexttok=strtok(argv[id+1]," ,;");
+	     snprintf(list,sizeof(list),"%s",argv[id+1]);
+	     nexttok=strtok_r(list," ,;",&state);
 	     while(nexttok){
     		 numlist[len++]=atof(nexttok); /*device id<256*/
-		 nexttok=strtok(NULL," ,;");
+		 nexttok=strtok_r(NULL," ,;",&state);
 	     }
 	 }
      }else{
@@ -565,9 +886,12 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
      int i=1,isinteractive=1,issavelog=0;
      char filename[MAX_PATH_LENGTH]={0};
      char logfile[MAX_PATH_LENGTH]={0};
-     float np=0.f;
+     double np=0.;
+     float tallybin[3];
+     int k;
 
      if(argc<=1){
+     	mcx_infoonly("(none)");
      	mcx_usage(argv[0]);
      	exit(0);
      }
@@ -580,6 +904,7 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
 		}
 	        switch(argv[i][1]){
 		     case 'h': 
+		                mcx_infoonly("-h");
 		                mcx_usage(argv[0]);
 				exit(0);
 		     case 'i':
@@ -597,8 +922,8 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
 		     	        i=mcx_readarg(argc,argv,i,&(cfg->nphoton),"int");
 		     	        break;
 		     case 'n':
-		     	        i=mcx_readarg(argc,argv,i,&(np),"float");
-				cfg->nphoton=(int)np;
+		     	        i=mcx_readarg(argc,argv,i,&(np),"double");
+				cfg->nphoton=(size_t)np;
 		     	        break;
 		     case 't':
 		     	        i=mcx_readarg(argc,argv,i,&(cfg->nthread),"int");
@@ -681,10 +1006,64 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
 		     case 'M':
 		     	        i=mcx_readarg(argc,argv,i,&(cfg->isdumpmask),"char");
 		     	        break;
+		     case 'A':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->autotune),"char");
+		     	        break;
+		     case 'Z':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->zerocopy),"char");
+		     	        break;
+		     case 'X':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->issplit),"char");
+		     	        break;
+		     case 'Y':
+		     	        i=mcx_readarg(argc,argv,i,cfg->sweepfile,"string");
+		     	        break;
+		     case 'P':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->npack),"int");
+		     	        break;
+		     case 'j':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->isprogress),"char");
+		     	        break;
+		     case 'w':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->maxtime),"float");
+		     	        break;
+		     case 'E':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->precision),"float");
+		     	        break;
+		     case 'K':
+		     	        i=mcx_readarg(argc,argv,i,cfg->precbox,"floatlist");
+		     	        break;
+		     case 'V':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->issavese),"char");
+		     	        break;
+		     case 'C':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->checkpoint),"float");
+		     	        break;
+		     case 'Q':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->isresume),"char");
+		     	        break;
+		     case 'F':
+		     	        i=mcx_readarg(argc,argv,i,&(cfg->outputformat),"char");
+		     	        break;
+		     case 'O':
+		     	        i=mcx_readarg(argc,argv,i,cfg->outroi,"floatlist");
+		     	        break;
+		     case 'N':
+		     	        memset(tallybin,0,sizeof(tallybin));
+		     	        i=mcx_readarg(argc,argv,i,tallybin,"floatlist");
+		     	        if(tallybin[1]==0.f && tallybin[2]==0.f)  //one factor for all axes
+		     	            tallybin[1]=tallybin[2]=tallybin[0];
+		     	        for(k=0;k<3;k++)
+		     	            cfg->tallybin[k]=(tallybin[k]>1.f ? (unsigned int)tallybin[k] : 1);
+		     	        break;
 		}
 	    }
 	    i++;
      }
+     if(cfg->isgpuinfo==2)  //refused before the input is read
+          mcx_infoonly("-L");
+     if(cfg->isdumpmask)
+          mcx_infoonly("-M");
      if(issavelog && cfg->session){
           sprintf(logfile,"%s.log",cfg->session);
           cfg->flog=fopen(logfile,"wt");
@@ -732,13 +1111,18 @@ usage: %s <param1> <param2> ...\n\
 where possible parameters include (the first item in [] is the default value)\n\
  -i 	        (--interactive) interactive mode\n\
  -f config      (--input)	read config from a file\n\
- -t [1024|int]  (--thread)	total thread number\n\
+ -t [0|int]     (--thread)	total thread number, 0 to use the tuned or default number\n\
  -T [64|int]    (--blocksize)	thread number per block\n\
- -n [0|int]     (--photon)	total photon number\n\
+ -A [1|0|2]     (--autotune)	1 use the tuned -t/-T of each device, tune once if\n\
+                                not found (unless -t is given); 0 do not tune;\n\
+                                2 always re-tune; results are in ~/.mcxcl_tune\n\
+ -n [0|int]     (--photon)	total photon number, 1e11 or more is accepted\n\
  -r [1|int]     (--repeat)	number of repeations\n\
  -a [0|1]       (--array)	0 for Matlab array, 1 for C array\n\
  -z [0|1]       (--srcfrom0)    src/detector coordinates start from 0, otherwise from 1\n\
- -g [1|int]     (--gategroup)	number of time gates per run\n\
+ -g [1|int]     (--gategroup)	number of time gates per run, 0 for the largest number\n\
+                                that fits in the device memory; with fewer gates than\n\
+                                needed, each group of gates is saved once simulated\n\
  -b [1|0]       (--reflect)	1 to reflect the photons at the boundary, 0 to exit\n\
  -B [0|1]       (--reflect3)	1 to consider maximum 3 reflections, 0 consider only 2\n\
  -e [0.|float]  (--minenergy)	minimum energy level to propagate a photon\n\
@@ -756,7 +1140,43 @@ where possible parameters include (the first item in [] is the default value)\n\
  -k mcx_core.cl (--kernel)      specify path to OpenCL kernel source file\n\
  -G '0111'      (--devicelist)  specify the active OpenCL devices (1 enable, 0 disable)\n\
  -W '50,30,20'  (--workload)    specify relative workload for each device; total is the sum\n\
+                                without -W, the photons are split by the speed measured\n\
+                                on this problem and rebalanced after every launch\n\
  -J '-D MCX'    (--compileropt) specify additional JIT compiler options\n\
+ -Z [2|0|1]     (--zerocopy)	1 map the field, energy and detected photons in host\n\
+                                memory instead of copying them back; 2 only on\n\
+                                devices sharing memory with the host; 0 always copy\n\
+ -X [0|1]       (--split)	1 split the volume into z-slabs, one per device (sized\n\
+                                by -W), so that each device only stores its slab;\n\
+                                photons crossing a slab are handed over to the next\n\
+                                device between launches\n\
+ -Y sweep.txt   (--sweep)	run every line of a sweep file on the same devices,\n\
+                                kernel and media: 'session nphoton srcx srcy srcz\n\
+                                dirx diry dirz' and 'mus g mua n' for each medium,\n\
+                                '-' keeps the value of the input file\n\
+ -P 1           (--pack)	with -Y, run up to n sweep runs in one kernel launch,\n\
+                                each on its own share of the threads\n\
+ -j [0|1]       (--progress)	1 print a progress bar on stderr\n\
+ -w [0.|float]  (--maxtime)	stop a run after this many seconds and save the\n\
+                                partial results, normalized by the photons launched;\n\
+                                Ctrl-C does the same, a second Ctrl-C aborts\n\
+ -E [0.|float]  (--precision)	run the repetitions (-r, at least 2) as batches and stop\n\
+                                once the relative standard error of the detected\n\
+                                photons (-d 1) or of the energy in the -K box is below\n\
+                                this value; -n and -r are then the largest run\n\
+ -K 'x0,y0,z0,x1,y1,z1' (--precbox) voxel box monitored by -E, inclusive\n\
+ -V [0|1]       (--savese)	1 save the standard error of the field (session.se.mc2),\n\
+                                from the spread of the launches (-r 2 or more)\n\
+ -C [0.|float]  (--checkpoint)	save the state of each device every this many seconds\n\
+                                (session.ckpt0, ...) and when the run is stopped\n\
+ -Q [0|1]       (--resume)	1 continue a run from its checkpoints, with the same\n\
+                                options and devices\n\
+ -F [0|1|2|3]   (--outputformat) encoding of the .mc2 fields: 0 float, 1 half\n\
+                                precision, 2 bfloat16, 3 sparse (nonzero voxels only)\n\
+ -O 'x0,y0,z0,x1,y1,z1' (--outroi) only tally and save the field in this voxel\n\
+                                box, inclusive\n\
+ -N [1|'nx,ny,nz'] (--tallybin) tally the field in cells of nx*ny*nz voxels, one\n\
+                                number for all axes\n\
 example:\n\
   %s -t 1024 -T 64 -n 1e7 -f input.inp -s test -r 1 -b 0 -G 1010 -W '50,50' -k ../../src/mcx_core.cl\n",exename,exename);
 }
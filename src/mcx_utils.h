@@ -22,11 +22,13 @@
 #define MAX_PATH_LENGTH     1024
 #define MAX_SESSION_LENGTH  256
 #define MAX_DEVICE          256
+#define MCX_ENCODE_CHUNK    65536   /*values encoded at once by -F*/
 
 #define MCX_ASSERT(x)  mcx_assess((x),"assert error",__FILE__,__LINE__)
 
 enum TOutputType {otFlux, otFluence, otEnergy, otJacobian, otTaylor};
 enum TMCXParent  {mpStandalone, mpMATLAB};
+enum TOutputFormat {ofFloat, ofHalf, ofBFloat16, ofSparse};
 
 typedef struct MCXMedium{
 	float mua;
@@ -35,18 +37,22 @@ typedef struct MCXMedium{
 	float n;
 } Medium __attribute__ ((aligned (16)));  /*this order shall match prop.{xyzw} in mcx_main_loop*/
 
+#define MCX_HISTORY_VERSION 2       /*version 2 adds the 64-bit photon counts*/
+
 typedef struct MCXHistoryHeader{
 	char magic[4];
 	unsigned int  version;
 	unsigned int  maxmedia;
 	unsigned int  detnum;
 	unsigned int  colcount;
-	unsigned int  totalphoton;
+	unsigned int  totalphoton;  /*32-bit counts, saturated, for version 1 readers*/
 	unsigned int  detected;
 	unsigned int  savedphoton;
 	float unitinmm;
 	unsigned int  seedbyte;
-	int reserved[6];
+	unsigned long long totalphoton64;  /*version 2: the full counts, in the former reserved space*/
+	unsigned long long detected64;
+	unsigned long long savedphoton64;
 } History;
 
 typedef struct PhotonReplay{
@@ -56,7 +62,7 @@ typedef struct PhotonReplay{
 } Replay;
 
 typedef struct MCXConfig{
-	int nphoton;      /*(total simulated photon number) we now use this to 
+	size_t nphoton;   /*(total simulated photon number) we now use this to 
 	                     temporarily alias totalmove, as to specify photon
 			     number is causing some troubles*/
 	//int totalmove;   /* [depreciated] total move per photon*/
@@ -104,6 +110,21 @@ typedef struct MCXConfig{
 	char issrcfrom0;    /*1 do not subtract 1 from src/det positions, 0 subtract 1*/
         char isdumpmask;    /*1 dump detector mask; 0 not*/
         char outputtype;    /**<'X' output is flux, 'F' output is fluence, 'E' energy deposit*/
+        char autotune;      /*0 use -t/-T, 1 use the cached tuned launch size or tune if missing, 2 always re-tune*/
+        char zerocopy;      /*0 read back the results, 1 map them in host memory, 2 map only on host-unified devices*/
+        char issplit;       /*1 give each device a z-slab of the volume and hand the photons over between them*/
+        char sweepfile[MAX_PATH_LENGTH]; /*runs of a sweep, one per line, sharing the devices and the kernel*/
+        int npack;          /*sweep runs packed into one kernel launch*/
+        char isprogress;    /*1 print a progress bar on stderr*/
+        float maxtime;      /*wall-clock budget of a run in seconds, 0 for none; the partial results are saved*/
+        float precision;    /*target relative standard error that ends a run early, 0 to run all photons*/
+        float precbox[6];   /*voxel box of the fluence monitored by -E, precbox[0]<0 to monitor the detected photons*/
+        char issavese;      /*1 to save the standard error of the field, estimated from the launches*/
+        float checkpoint;   /*seconds between the checkpoints of a run, 0 for none*/
+        char isresume;      /*1 to continue a run from its checkpoints*/
+        char outputformat;  /*encoding of the saved fields: 0 float, 1 half, 2 bfloat16, 3 sparse float*/
+        float outroi[6];    /*voxel box of the saved field, outroi[0]<0 for the whole volume*/
+        unsigned int tallybin[3]; /*voxels of a cell of the field along x, y and z*/
         float minenergy;    /*minimum energy to propagate photon*/
         float unitinmm;     /*defines the length unit in mm for grid*/
         FILE *flog;         /*stream handle to print log information*/
@@ -117,7 +138,8 @@ typedef struct MCXConfig{
 	float workload[MAX_DEVICE];
 	float *exportfield;     /*memory buffer when returning the flux to external programs such as matlab*/
 	float *exportdetected;  /*memory buffer when returning the partial length info to external programs such as matlab*/
-	unsigned int detectedcount; /**<total number of detected photons*/
+	size_t detectedcount;   /**<total number of saved detected photons*/
+	size_t nlaunched;       /**<photons launched by the last run per time window, fewer than nphoton if it was stopped*/
 	unsigned int runtime;
 	int parentid;
 	void *seeddata;
@@ -126,9 +148,14 @@ typedef struct MCXConfig{
 #ifdef	__cplusplus
 extern "C" {
 #endif
-void mcx_savedata(float *dat,int len,int doappend, const char *suffix, Config *cfg);
+void mcx_savedata(float *dat,size_t len,int doappend, const char *suffix, Config *cfg);
+void mcx_outputname(Config *cfg, const char *suffix, char *name, size_t len);
+size_t mcx_outputbox(Config *cfg, unsigned int lo[3], unsigned int len[3]);
+void mcx_normalizecells(float field[], float scale, size_t fieldlen, Config *cfg);
+void mcx_saveruninfo(Config *cfg, float scale, unsigned int nwindow);
 void mcx_error(const int id,const char *msg,const char *file,const int linenum);
 void mcx_assess(const int id,const char *msg,const char *file,const int linenum);
+void mcx_infoonly(const char *opt);
 void mcx_loadconfig(FILE *in, Config *cfg);
 void mcx_saveconfig(FILE *in, Config *cfg);
 void mcx_readconfig(const char *fname, Config *cfg);
@@ -138,7 +165,7 @@ void mcx_clearcfg(Config *cfg);
 void mcx_parsecmd(int argc, char* argv[], Config *cfg);
 void mcx_usage(char *exename);
 void mcx_loadvolume(char *filename,Config *cfg);
-void mcx_normalize(float field[], float scale, int fieldlen);
+void mcx_normalize(float field[], float scale, size_t fieldlen);
 int  mcx_readarg(int argc, char *argv[], int id, void *output,const char *type);
 void mcx_printlog(Config *cfg, const char *str);
 int  mcx_remap(char *opt);
@@ -146,7 +173,11 @@ void mcx_maskdet(Config *cfg);
 void mcx_createfluence(float **fluence, Config *cfg);
 void mcx_clearfluence(float **fluence);
 void mcx_convertrow2col(unsigned char **vol, uint4 *dim);
-void mcx_savedetphoton(float *ppath, void *seeds, int count, int seedbyte, Config *cfg);
+void mcx_savedetphoton(float *ppath, void *seeds, size_t count, int seedbyte, Config *cfg);
+int  mcx_readsweep(FILE *in, Config *cfg);
+#ifdef MCX_CONTAINER
+void mcx_throw_exception(const int id, const char *msg, const char *file, const int linenum);
+#endif
 
 #ifdef	__cplusplus
 }
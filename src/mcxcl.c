@@ -15,24 +15,35 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <signal.h>
 #include "tictoc.h"
 #include "mcx_utils.h"
 #include "mcx_host.hpp"
 
+/*
+   the first Ctrl-C stops the simulation and saves the partial results,
+   a second one ends mcxcl at once
+*/
+void mcx_sigint(int sig){
+     mcx_request_stop(1);
+     signal(SIGINT,SIG_DFL);
+}
 
 int main (int argc, char *argv[]) {
      Config mcxconfig;
      float *fluence=NULL,totalenergy=0.f;
 
      mcx_initcfg(&mcxconfig);
+     signal(SIGINT,mcx_sigint);
 
      // parse command line options to initialize the configurations
      mcx_parsecmd(argc,argv,&mcxconfig);
 
-     mcx_createfluence(&fluence,&mcxconfig);
-
-     // this launches the MC simulation
-     mcx_run_simulation(&mcxconfig,fluence,&totalenergy);
+     // this launches the MC simulation, or all runs of a sweep on the same devices
+     if(mcxconfig.sweepfile[0])
+         mcx_run_sweep(&mcxconfig);
+     else
+         mcx_run_simulation(&mcxconfig,fluence,&totalenergy);
 
      // clean up the allocated memory in the config
      mcx_clearfluence(&fluence);
@@ -0,0 +1,266 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcxcl_lib.cpp: libmcxcl, simulation sessions behind an opaque handle
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mcx_host.hpp"
+#include "mcx_const.h"
+#include "mcxcl_lib.h"
+
+#ifndef MCX_CONTAINER
+  #error "libmcxcl must be built with -DMCX_CONTAINER, otherwise an error ends the process"
+#endif
+#ifndef USE_OS_TIMER
+  #error "libmcxcl must be built with -DUSE_OS_TIMER, the OpenCL timer keeps the last kernel event in a global"
+#endif
+
+struct MCXCLHandle{
+     Config     cfg;
+     MCXSession ses;
+     int        isconfig;          //cfg was loaded by mcxcl_set_config
+     int        isready;           //ses holds the OpenCL state of cfg
+     int        hasresult;         //the outputs of cfg are those of a completed run
+     char       error[MAX_PATH_LENGTH];
+};
+
+/*
+   with MCX_CONTAINER, mcx_error ends here instead of in exit(): the error
+   unwinds to the library call, which returns its id
+*/
+void mcx_throw_exception(const int id, const char *msg, const char *file, const int linenum){
+     MCXCLError err;
+     err.id=(id ? id : -1);
+     snprintf(err.msg,MAX_PATH_LENGTH,"%s in unit %s:%d",msg,file,linenum);
+     throw err;
+}
+
+static int mcxcl_fail(mcxcl_handle h,const MCXCLError &err){
+     strncpy(h->error,err.msg,MAX_PATH_LENGTH-1);
+     h->error[MAX_PATH_LENGTH-1]='\0';
+     return err.id;
+}
+
+static int mcxcl_input(mcxcl_handle h,int id,const char *msg){
+     strncpy(h->error,msg,MAX_PATH_LENGTH-1);
+     h->error[MAX_PATH_LENGTH-1]='\0';
+     return id;
+}
+
+/*
+   drop the OpenCL state, the next mcxcl_run builds it again for the new
+   volume or configuration
+*/
+static void mcxcl_reset(mcxcl_handle h){
+     if(h->isready)
+         mcx_release_session(&h->ses);
+     h->isready=0;
+     h->hasresult=0;
+}
+
+mcxcl_handle mcxcl_create(void){
+     mcxcl_handle h=(mcxcl_handle)calloc(1,sizeof(struct MCXCLHandle));
+     if(h)
+         mcx_initcfg(&h->cfg);
+     return h;
+}
+
+void mcxcl_destroy(mcxcl_handle h){
+     if(h==NULL)
+         return;
+     mcxcl_reset(h);
+     mcx_clearcfg(&h->cfg);
+     free(h);
+}
+
+const char *mcxcl_error(mcxcl_handle h){
+     return (h ? h->error : "invalid handle");
+}
+
+/*
+   load a configuration from command line options, as mcxcl does (argv[0]
+   is skipped); the input file is read with -f, the informational options
+   -h, -L and -M, which end mcxcl, return an error here
+*/
+int mcxcl_set_config(mcxcl_handle h, int argc, char *argv[]){
+     if(h==NULL)
+         return MCXCL_ERR_HANDLE;
+     if(argc<=1 || argv==NULL)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"no option is given");
+     mcxcl_reset(h);
+     if(h->isconfig)
+         mcx_clearcfg(&h->cfg);
+     h->isconfig=0;
+     try{
+         mcx_initcfg(&h->cfg);
+         mcx_parsecmd(argc,argv,&h->cfg);
+     }catch(MCXCLError &err){
+         return mcxcl_fail(h,err);
+     }
+     h->isconfig=1;
+     h->error[0]='\0';
+     return MCXCL_OK;
+}
+
+/*
+   replace the volume of the configuration by a copy of vol (x-fastest,
+   nx*ny*nz labels); the detectors are masked again and the OpenCL state is
+   rebuilt by the next run
+*/
+int mcxcl_set_volume(mcxcl_handle h, const unsigned char *vol, unsigned int nx, unsigned int ny, unsigned int nz){
+     Config *cfg;
+     size_t len=(size_t)nx*ny*nz, idx1d;
+
+     if(h==NULL || !h->isconfig)
+         return MCXCL_ERR_HANDLE;
+     if(vol==NULL || len==0)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the volume is empty");
+     cfg=&h->cfg;
+     if(cfg->srcpos.x>=nx || cfg->srcpos.y>=ny || cfg->srcpos.z>=nz)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the source is outside of the new volume, please set the source first");
+     idx1d=((size_t)floorf(cfg->srcpos.z)*ny+(size_t)floorf(cfg->srcpos.y))*nx+(size_t)floorf(cfg->srcpos.x);
+     if(vol[idx1d]==0)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the source is outside the domain of the new volume");
+
+     mcxcl_reset(h);
+     free(cfg->vol);
+     free(cfg->exportfield);
+     cfg->exportfield=NULL;
+     cfg->vol=(unsigned char*)malloc(len);
+     memcpy(cfg->vol,vol,len);
+     cfg->dim.x=nx;
+     cfg->dim.y=ny;
+     cfg->dim.z=nz;
+     try{
+         if(cfg->issavedet)
+             mcx_maskdet(cfg);
+     }catch(MCXCLError &err){
+         return mcxcl_fail(h,err);
+     }
+     h->error[0]='\0';
+     return MCXCL_OK;
+}
+
+/*
+   move the source, in grid units counted from 1 unless -z 1 is set; a
+   zero nphoton keeps the photon number; the OpenCL state is kept
+*/
+int mcxcl_set_source(mcxcl_handle h, const float pos[3], const float dir[3], size_t nphoton){
+     Config *cfg;
+     float4 srcpos;
+     size_t idx1d;
+
+     if(h==NULL || !h->isconfig)
+         return MCXCL_ERR_HANDLE;
+     if(pos==NULL || dir==NULL)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the source position or direction is missing");
+     cfg=&h->cfg;
+     srcpos.x=pos[0]-(cfg->issrcfrom0 ? 0.f : 1.f);
+     srcpos.y=pos[1]-(cfg->issrcfrom0 ? 0.f : 1.f);
+     srcpos.z=pos[2]-(cfg->issrcfrom0 ? 0.f : 1.f);
+     if(srcpos.x<0.f || srcpos.y<0.f || srcpos.z<0.f ||
+        srcpos.x>=cfg->dim.x || srcpos.y>=cfg->dim.y || srcpos.z>=cfg->dim.z)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"source position is outside of the volume");
+     idx1d=((size_t)floorf(srcpos.z)*cfg->dim.y+(size_t)floorf(srcpos.y))*cfg->dim.x+(size_t)floorf(srcpos.x);
+     if(cfg->vol[idx1d]==0)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the source is outside the domain");
+
+     cfg->srcpos.x=srcpos.x;
+     cfg->srcpos.y=srcpos.y;
+     cfg->srcpos.z=srcpos.z;
+     cfg->srcdir.x=dir[0];
+     cfg->srcdir.y=dir[1];
+     cfg->srcdir.z=dir[2];
+     if(nphoton)
+         cfg->nphoton=nphoton;
+     h->hasresult=0;
+     h->error[0]='\0';
+     return MCXCL_OK;
+}
+
+/*
+   set the optical properties, {mua,mus,g,n} per medium from medium 0, the
+   background; the number of media is fixed by the configuration
+*/
+int mcxcl_set_media(mcxcl_handle h, const float *prop, unsigned int medianum){
+     if(h==NULL || !h->isconfig)
+         return MCXCL_ERR_HANDLE;
+     if(prop==NULL || medianum!=h->cfg.medianum)
+         return mcxcl_input(h,MCXCL_ERR_INPUT,"the number of media does not match the configuration");
+     memcpy(h->cfg.prop,prop,medianum*sizeof(Medium));
+     h->hasresult=0;
+     h->error[0]='\0';
+     return MCXCL_OK;
+}
+
+/*
+   simulate the current configuration; the first run sets up the devices
+   and builds the kernel, the following ones only upload the source and the
+   optical properties. After an error the OpenCL state is dropped, and a
+   failure inside the set-up may leave a part of it allocated
+*/
+int mcxcl_run(mcxcl_handle h){
+     if(h==NULL || !h->isconfig)
+         return MCXCL_ERR_HANDLE;
+     h->hasresult=0;
+     try{
+         if(!h->isready){
+             mcx_init_session(&h->ses,&h->cfg);
+             h->isready=1;
+         }else
+             mcx_update_session(&h->ses,&h->cfg);
+         if(h->cfg.exportfield)
+             memset(h->cfg.exportfield,0,sizeof(float)*h->ses.fieldlen);
+         mcx_run_session(&h->ses,&h->cfg);
+     }catch(MCXCLError &err){
+         mcxcl_reset(h);
+         return mcxcl_fail(h,err);
+     }
+     h->hasresult=1;
+     h->error[0]='\0';
+     return MCXCL_OK;
+}
+
+/*
+   the outputs of the last run stay owned by the handle until the next run
+*/
+int mcxcl_get_field(mcxcl_handle h, const float **field, size_t *len){
+     if(h==NULL)
+         return MCXCL_ERR_HANDLE;
+     if(!h->hasresult || h->cfg.exportfield==NULL)
+         return mcxcl_input(h,MCXCL_ERR_NORESULT,"no field, please run with -S 1 first");
+     *field=h->cfg.exportfield;
+     *len=h->ses.fieldlen;
+     return MCXCL_OK;
+}
+
+int mcxcl_get_detected(mcxcl_handle h, const float **detected, size_t *count, unsigned int *reclen){
+     if(h==NULL)
+         return MCXCL_ERR_HANDLE;
+     if(!h->hasresult || h->cfg.exportdetected==NULL)
+         return mcxcl_input(h,MCXCL_ERR_NORESULT,"no detected photons, please run with -d 1 first");
+     *detected=h->cfg.exportdetected;
+     *count=h->cfg.detectedcount;
+     *reclen=h->cfg.medianum+1;
+     return MCXCL_OK;
+}
+
+int mcxcl_get_energy(mcxcl_handle h, double *total, double *absorbed){
+     if(h==NULL)
+         return MCXCL_ERR_HANDLE;
+     if(!h->hasresult)
+         return mcxcl_input(h,MCXCL_ERR_NORESULT,"no run has completed");
+     *total=h->cfg.energytot;
+     *absorbed=h->cfg.energytot-h->cfg.energyesc;
+     return MCXCL_OK;
+}
@@ -0,0 +1,59 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcxcl_lib.h: the C interface of libmcxcl
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#ifndef _MCEXTREME_CL_LIBRARY_H
+#define _MCEXTREME_CL_LIBRARY_H
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define MCXCL_OK           0
+#define MCXCL_ERR_HANDLE   -100     //NULL handle, or no configuration yet
+#define MCXCL_ERR_INPUT    -101     //invalid argument
+#define MCXCL_ERR_NORESULT -102     //no run has completed yet
+
+/*
+   an opaque simulation session: the configuration, the volume, the outputs
+   of the last run and the OpenCL state, which is built by the first
+   mcxcl_run and kept for the following ones; a handle must only be used by
+   one thread at a time, different handles may run concurrently
+*/
+typedef struct MCXCLHandle *mcxcl_handle;
+
+/*
+   every call except mcxcl_create/mcxcl_destroy returns MCXCL_OK or an error
+   code: one of the above, or the id of the MCX error, where a failed
+   OpenCL call gives the negated OpenCL status; mcxcl_error describes the
+   last error of a handle
+*/
+mcxcl_handle mcxcl_create(void);
+void mcxcl_destroy(mcxcl_handle h);
+const char *mcxcl_error(mcxcl_handle h);
+
+int mcxcl_set_config(mcxcl_handle h, int argc, char *argv[]);
+int mcxcl_set_volume(mcxcl_handle h, const unsigned char *vol, unsigned int nx, unsigned int ny, unsigned int nz);
+int mcxcl_set_source(mcxcl_handle h, const float pos[3], const float dir[3], size_t nphoton);
+int mcxcl_set_media(mcxcl_handle h, const float *prop, unsigned int medianum);
+int mcxcl_run(mcxcl_handle h);
+
+int mcxcl_get_field(mcxcl_handle h, const float **field, size_t *len);
+int mcxcl_get_detected(mcxcl_handle h, const float **detected, size_t *count, unsigned int *reclen);
+int mcxcl_get_energy(mcxcl_handle h, double *total, double *absorbed);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcxclc.c: client of mcxcld, submits a job and prints its log
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mcx_server.h"
+
+#define MAX_PATH_LENGTH     1024
+
+/*
+   usage: mcxclc socket input.inp [mcxcl options]
+
+   the input file is sent with the options and the current folder, where
+   the server reads the relative volume path and saves the outputs; the
+   session name defaults to the name of the input file, and the exit code
+   is 0 when the job succeeded
+*/
+int main(int argc, char *argv[]){
+     struct sockaddr_un addr;
+     char line[MAX_PATH_LENGTH*2], cwd[MAX_PATH_LENGTH], session[MAX_PATH_LENGTH], *dot, *buf;
+     FILE *inp, *conn;
+     long len;
+     int sock, i, status=1, done=0;
+
+     if(argc<3){
+         printf("usage: %s socket input.inp [mcxcl options]\n",argv[0]);
+         return 1;
+     }
+     if((inp=fopen(argv[2],"rb"))==NULL){
+         fprintf(stderr,"mcxclc: can not read %s\n",argv[2]);
+         return 1;
+     }
+     fseek(inp,0,SEEK_END);
+     len=ftell(inp);
+     fseek(inp,0,SEEK_SET);
+     buf=(char *)malloc(len);
+     if(fread(buf,1,len,inp)!=(size_t)len){
+         fprintf(stderr,"mcxclc: can not read %s\n",argv[2]);
+         return 1;
+     }
+     fclose(inp);
+
+     memset(&addr,0,sizeof(addr));
+     addr.sun_family=AF_UNIX;
+     strncpy(addr.sun_path,argv[1],sizeof(addr.sun_path)-1);
+     if((sock=socket(AF_UNIX,SOCK_STREAM,0))<0 || connect(sock,(struct sockaddr*)&addr,sizeof(addr))<0){
+         perror("mcxclc");
+         return 1;
+     }
+     conn=fdopen(sock,"r+");
+
+     strncpy(session,(strrchr(argv[2],'/') ? strrchr(argv[2],'/')+1 : argv[2]),MAX_PATH_LENGTH-1);
+     session[MAX_PATH_LENGTH-1]='\0';
+     if((dot=strrchr(session,'.'))!=NULL && dot!=session)
+         *dot='\0';
+     if(getcwd(cwd,MAX_PATH_LENGTH)==NULL)
+         strcpy(cwd,".");
+     fprintf(conn,"%s\ncwd %s\nopt -s\nopt %s\n",MCX_SERVER_JOB,cwd,session);
+     for(i=3;i<argc;i++)
+         fprintf(conn,"opt %s\n",argv[i]);
+     fprintf(conn,"inp %ld\n",len);
+     fwrite(buf,1,len,conn);
+     fflush(conn);
+     free(buf);
+
+     /*the log of the job is printed as it comes, the last line holds the status*/
+     while(fgets(line,sizeof(line),conn)){
+         if(strncmp(line,MCX_SERVER_DONE,strlen(MCX_SERVER_DONE))==0){
+             char *msg=line+strlen(MCX_SERVER_DONE)+1;
+             status=atoi(msg);
+             if(status)
+                 fprintf(stderr,"mcxclc: job failed (%d):%s",status,msg+strcspn(msg," "));
+             done=1;
+             break;
+         }
+         fputs(line,stdout);
+     }
+     fclose(conn);
+     if(!done)
+         fprintf(stderr,"mcxclc: the server closed the connection\n");
+     return (status!=0);
+}
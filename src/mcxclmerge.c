@@ -0,0 +1,256 @@
+/*******************************************************************************
+**
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated Monte Carlo 3D photon migration
+**      -- OpenCL edition
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcxclmerge.c: merge the outputs of independently seeded runs
+**
+**  Unpublished work, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcx_utils.h"
+
+#define MERGE_CHUNK      1048576    //floats of each file read at once
+#define MERGE_KEYLEN     64
+
+/*
+   the totals of a run, read from its session.json (see mcx_saveruninfo)
+*/
+typedef struct MCXRunInfo{
+     double nphoton, nlaunched, energytot, energyesc, alpha, detected, saved;
+     int normalized, outputtype, outputformat, windows, seed;
+} RunInfo;
+
+static void merge_error(const char *msg,const char *name){
+     fprintf(stderr,"mcxclmerge: %s %s\n",msg,name);
+     exit(1);
+}
+
+static FILE *merge_open(const char *session,const char *suffix,const char *mode,int isrequired){
+     char name[MAX_PATH_LENGTH];
+     FILE *fp;
+     snprintf(name,MAX_PATH_LENGTH,"%s.%s",session,suffix);
+     if((fp=fopen(name,mode))==NULL && isrequired)
+         merge_error("can not open",name);
+     return fp;
+}
+
+/*
+   one "key": value pair per line, as written by mcx_saveruninfo
+*/
+static void merge_readinfo(const char *session,RunInfo *info){
+     char line[MAX_PATH_LENGTH], key[MERGE_KEYLEN];
+     double val;
+     FILE *fp=merge_open(session,"json","rt",1);
+
+     memset(info,0,sizeof(RunInfo));
+     info->alpha=1.0;
+     info->windows=1;
+     while(fgets(line,sizeof(line),fp)){
+         if(sscanf(line," \"%63[^\"]\" : %lf",key,&val)!=2)
+             continue;
+         if(strcmp(key,"nphoton")==0)         info->nphoton=val;
+         else if(strcmp(key,"nlaunched")==0)  info->nlaunched=val;
+         else if(strcmp(key,"energytot")==0)  info->energytot=val;
+         else if(strcmp(key,"energyesc")==0)  info->energyesc=val;
+         else if(strcmp(key,"alpha")==0)      info->alpha=val;
+         else if(strcmp(key,"detected")==0)   info->detected=val;
+         else if(strcmp(key,"saved")==0)      info->saved=val;
+         else if(strcmp(key,"normalized")==0) info->normalized=(int)val;
+         else if(strcmp(key,"outputtype")==0) info->outputtype=(int)val;
+         else if(strcmp(key,"outputformat")==0) info->outputformat=(int)val;
+         else if(strcmp(key,"windows")==0)    info->windows=(int)val;
+         else if(strcmp(key,"seed")==0)       info->seed=(int)val;
+     }
+     fclose(fp);
+     if(info->energytot<=0.0)
+         merge_error("no launched energy in the totals of",session);
+}
+
+/*
+   sum the fields in chunks; a normalized field is divided by the energy of
+   its run, so that field i weighs energytot_i/sum(energytot)
+*/
+static void merge_field(const char *out,char **runs,int nrun,const double *weight){
+     FILE **fp=(FILE **)malloc(sizeof(FILE*)*nrun), *fout;
+     float  *buf=(float *)malloc(sizeof(float)*MERGE_CHUNK);
+     double *acc=(double *)malloc(sizeof(double)*MERGE_CHUNK);
+     size_t len=0, n, i;
+     int r;
+
+     for(r=0;r<nrun;r++){
+         fp[r]=merge_open(runs[r],"mc2","rb",1);
+         fseek(fp[r],0,SEEK_END);
+         if(r==0)
+             len=ftell(fp[r]);
+         else if((size_t)ftell(fp[r])!=len)
+             merge_error("the field has a different size in",runs[r]);
+         fseek(fp[r],0,SEEK_SET);
+     }
+     fout=merge_open(out,"mc2","wb",1);
+     for(len/=sizeof(float);len>0;len-=n){
+         n=(len<MERGE_CHUNK ? len : MERGE_CHUNK);
+         memset(acc,0,sizeof(double)*n);
+         for(r=0;r<nrun;r++){
+             const double w=weight[r];
+             if(fread(buf,sizeof(float),n,fp[r])!=n)
+                 merge_error("can not read the field of",runs[r]);
+             for(i=0;i<n;i++)  //a plain loop, vectorized by the compiler
+                 acc[i]+=w*buf[i];
+         }
+         for(i=0;i<n;i++)
+             buf[i]=(float)acc[i];
+         if(fwrite(buf,sizeof(float),n,fout)!=n)
+             merge_error("can not write the field of",out);
+     }
+     fclose(fout);
+     for(r=0;r<nrun;r++)
+         fclose(fp[r]);
+     free(acc);
+     free(buf);
+     free(fp);
+}
+
+/*
+   copy n bytes of a run to the merged file
+*/
+static void merge_copy(FILE *in,FILE *out,unsigned long long n,const char *run){
+     char *buf=(char *)malloc(MERGE_CHUNK);
+     size_t len;
+
+     for(;n>0;n-=len){
+         len=(size_t)(n<MERGE_CHUNK ? n : MERGE_CHUNK);
+         if(fread(buf,1,len,in)!=len)
+             merge_error("the detected photons are truncated in",run);
+         if(fwrite(buf,1,len,out)!=len)
+             merge_error("can not write the detected photons of",run);
+     }
+     free(buf);
+}
+
+/*
+   concatenate the detected photons: the records of all runs, then their
+   seeds if any; the header counts are the sums over the runs
+*/
+static void merge_history(const char *out,char **runs,int nrun){
+     History his, total;
+     FILE *fp, *fout;
+     unsigned long long *saved=(unsigned long long *)malloc(sizeof(unsigned long long)*nrun);
+     int r, pass;
+
+     for(r=0;r<nrun;r++){
+         fp=merge_open(runs[r],"mch","rb",1);
+         memset(&his,0,sizeof(his));
+         if(fread(&his,sizeof(History),1,fp)!=1 || memcmp(his.magic,"MCXH",4))
+             merge_error("no detected photon header in",runs[r]);
+         fclose(fp);
+         if(his.version<2){  //version 1 only has the 32-bit counts
+             his.totalphoton64=his.totalphoton;
+             his.detected64=his.detected;
+             his.savedphoton64=his.savedphoton;
+         }
+         saved[r]=his.savedphoton64;
+         if(r==0){
+             total=his;
+             total.version=MCX_HISTORY_VERSION;
+             continue;
+         }
+         if(his.colcount!=total.colcount || his.maxmedia!=total.maxmedia || his.detnum!=total.detnum
+            || his.seedbyte!=total.seedbyte || his.unitinmm!=total.unitinmm)
+             merge_error("the detected photons have a different layout in",runs[r]);
+         total.totalphoton64+=his.totalphoton64;
+         total.detected64+=his.detected64;
+         total.savedphoton64+=his.savedphoton64;
+     }
+     total.totalphoton=(total.totalphoton64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)total.totalphoton64);
+     total.detected=(total.detected64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)total.detected64);
+     total.savedphoton=(total.savedphoton64>0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned int)total.savedphoton64);
+
+     fout=merge_open(out,"mch","wb",1);
+     fwrite(&total,sizeof(History),1,fout);
+     for(pass=0;pass<(total.seedbyte ? 2 : 1);pass++){
+         for(r=0;r<nrun;r++){
+             unsigned long long recbytes=saved[r]*total.colcount*sizeof(float);
+             fp=merge_open(runs[r],"mch","rb",1);
+             fseek(fp,sizeof(History),SEEK_SET);
+             if(pass)
+                 fseek(fp,recbytes,SEEK_CUR);
+             merge_copy(fp,fout,(pass ? saved[r]*total.seedbyte : recbytes),runs[r]);
+             fclose(fp);
+         }
+     }
+     if(fclose(fout))
+         merge_error("can not write the detected photons of",out);
+     free(saved);
+}
+
+/*
+   usage: mcxclmerge output run1 run2 ...
+
+   the runs are session names (with their folder), each with the
+   session.json written by mcxcl; the fields (.mc2) and the detected photons
+   (.mch) are merged when the first run has them, and the merged totals are
+   saved to output.json
+*/
+int main(int argc, char *argv[]){
+     RunInfo *info, total;
+     double *weight;
+     FILE *fp;
+     int r, i, nrun=argc-2;
+
+     if(argc<3){
+         printf("usage: %s output run1 [run2 ...]\n",argv[0]);
+         return 1;
+     }
+     info=(RunInfo *)malloc(sizeof(RunInfo)*nrun);
+     weight=(double *)malloc(sizeof(double)*nrun);
+     memset(&total,0,sizeof(total));
+     for(r=0;r<nrun;r++){
+         merge_readinfo(argv[r+2],info+r);
+         for(i=0;i<r && info[r].seed>0;i++)  //a seed of 0 or less was drawn from the clock
+             if(info[i].seed==info[r].seed)
+                 merge_error("the runs are not independent, the same seed was used by",argv[r+2]);
+         if(info[r].normalized!=info[0].normalized || info[r].outputtype!=info[0].outputtype || info[r].windows!=info[0].windows)
+             merge_error("the field has a different normalization, output type or time windows in",argv[r+2]);
+         total.nphoton+=info[r].nphoton;
+         total.nlaunched+=info[r].nlaunched;
+         total.energytot+=info[r].energytot;
+         total.energyesc+=info[r].energyesc;
+         total.detected+=info[r].detected;
+         total.saved+=info[r].saved;
+     }
+     total.normalized=info[0].normalized;
+     total.outputtype=info[0].outputtype;
+     total.windows=info[0].windows;
+     total.alpha=(total.normalized ? info[0].alpha*info[0].energytot/total.energytot : 1.0);
+     for(r=0;r<nrun;r++)  //the scale of a normalized field is inversely proportional to the energy of its run
+         weight[r]=(total.normalized ? info[r].energytot/total.energytot : 1.0);
+
+     if((fp=merge_open(argv[2],"mc2","rb",0))!=NULL){
+         fclose(fp);
+         for(r=0;r<nrun;r++)
+             if(info[r].outputformat)
+                 merge_error("only float fields (-F 0) can be merged, the field is encoded in",argv[r+2]);
+         merge_field(argv[1],argv+2,nrun,weight);
+     }
+     if((fp=merge_open(argv[2],"mch","rb",0))!=NULL){
+         fclose(fp);
+         merge_history(argv[1],argv+2,nrun);
+     }
+
+     fp=merge_open(argv[1],"json","wt",1);
+     fprintf(fp,"{\n  \"nphoton\": %.0f,\n  \"nlaunched\": %.0f,\n  \"runs\": %d,\n",total.nphoton,total.nlaunched,nrun);
+     fprintf(fp,"  \"energytot\": %.17g,\n  \"energyesc\": %.17g,\n  \"windows\": %d,\n",total.energytot,total.energyesc,total.windows);
+     fprintf(fp,"  \"normalized\": %d,\n  \"outputtype\": %d,\n  \"alpha\": %.9g,\n",total.normalized,total.outputtype,total.alpha);
+     fprintf(fp,"  \"detected\": %.0f,\n  \"saved\": %.0f\n}\n",total.detected,total.saved);
+     fclose(fp);
+     printf("merged %d runs: %.0f photons launched, %.0f detected\n",nrun,total.nlaunched,total.detected);
+     free(weight);
+     free(info);
+     return 0;
+}
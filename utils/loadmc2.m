@@ -8,7 +8,9 @@ function data=loadmc2(fname,dim,format)
 %        dim:   an array to specify the output data dimension
 %               normally, dim=[nx,ny,nz,nt]
 %        format:a string to indicate the format used to save
-%               the .mc2 file; if omitted, it is set to 'float'
+%               the .mc2 file; if omitted, it is set to 'float'.
+%               The encodings of mcxcl -F are read with 'half' (-F 1),
+%               'bfloat16' (-F 2) and 'sparse' (-F 3)
 %
 %    output:
 %        data:  the output MCX solution data array, in the
@@ -23,7 +25,35 @@ if(nargin==2)
 end
 
 fid=fopen(fname,'rb');
-data=fread(fid,inf,format);
+
+if(strcmp(format,'half'))
+   raw=fread(fid,inf,'uint16=>double');
+   sgn=1-2*(raw>=32768);
+   ex=bitand(floor(raw/1024),31);
+   mant=bitand(raw,1023);
+   data=sgn.*((ex>0).*(1+mant/1024).*2.^(ex-15)+(ex==0).*mant/1024*2^-14);
+   data(ex==31)=sgn(ex==31)*Inf;
+   data(ex==31 & mant>0)=NaN;
+elseif(strcmp(format,'bfloat16'))
+   raw=fread(fid,inf,'uint16=>uint32');
+   data=double(typecast(bitshift(raw,16),'single'));
+elseif(strcmp(format,'sparse'))
+   % per time gate: the count n of nonzero voxels, their 0-based indices and values
+   gatelen=prod(dim(1:min(3,length(dim))));
+   data=zeros(prod(dim),1);
+   offset=0;
+   while(1)
+      n=fread(fid,1,'uint32');
+      if(isempty(n))
+         break;
+      end
+      idx=fread(fid,n,'uint32');
+      data(offset+idx+1)=fread(fid,n,'float32');
+      offset=offset+gatelen;
+   end
+else
+   data=fread(fid,inf,format);
+end
 fclose(fid);
 
 data=reshape(data,dim);
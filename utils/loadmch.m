@@ -0,0 +1,57 @@
+function [data,header]=loadmch(fname,format)
+%    [data,header]=loadmch(fname,format)
+%
+%    author: Qianqian Fang (fangq <at> nmr.mgh.harvard.edu)
+%
+%    input:
+%        fname: the file name to the output .mch file
+%        format:a string to indicate the format used to save
+%               the .mch file; if omitted, it is set to 'float'
+%
+%    output:
+%        data:  the detected photon records, one row per photon:
+%               [detector id, scattering events, partial path lengths ...]
+%        header:[version,maxmedia,detnum,colcount,totalphoton,detected,
+%               savedphoton,unitinmm] of the last block; for version 2
+%               files, the photon counts are read from the 64-bit fields
+%
+%    this file is part of Monte Carlo eXtreme (MCX)
+%    License: GPLv3, see http://mcx.sf.net for details
+
+
+if(nargin==1)
+   format='float';
+end
+
+fid=fopen(fname,'rb');
+
+data=[];
+header=[];
+
+while(~feof(fid))
+    magicheader=fread(fid,4,'char');
+    if(length(magicheader)<4)
+        break;
+    end
+    if(strcmp(char(magicheader(:)'),'MCXH')~=1)
+        fclose(fid);
+        error('this file is not a .mch file');
+    end
+    hd=fread(fid,7,'uint');       % version,maxmedia,detnum,colcount,totalphoton,detected,savedphoton
+    unitmm=fread(fid,1,'float32');
+    seedbyte=fread(fid,1,'uint');
+    if(hd(1)>=2)
+        hd(5:7)=fread(fid,3,'uint64'); % the 64-bit counts, not saturated
+    else
+        fread(fid,6,'uint');        % reserved
+    end
+    dat=fread(fid,hd(4)*hd(7),format);
+    dat=reshape(dat,[hd(4),hd(7)])';
+    if(seedbyte>0)
+        fread(fid,seedbyte*hd(7),'uchar');
+    end
+    data=[data;dat];
+    header=[hd(:)' unitmm];
+end
+
+fclose(fid);